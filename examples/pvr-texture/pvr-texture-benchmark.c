@@ -0,0 +1,756 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Benchmarks the PVR texture codecs over a set of generated images (and
+ * any images given on the command line), printing the speed, memory use
+ * and quality of each codec on each image.
+ *
+ * To check a codec change, save the numbers before it:
+ *
+ *   pvr-texture-benchmark --save-baseline=before.ini
+ *
+ * and compare against them after:
+ *
+ *   pvr-texture-benchmark --baseline=before.ini
+ *
+ * which exits with a failure if any image got worse by more than the
+ * tolerances. Speeds only compare on the same machine, so keep baselines
+ * for each machine you benchmark on.
+ */
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pvr-texture.h"
+
+/* A codec and the settings to run it with */
+typedef struct
+{
+  const gchar *name;
+  PvrFormat    format;
+  PvrQuality   quality;
+  PvrEtc1Mode  etc1_mode;
+  PvrDither    dither;
+} BenchCodec;
+
+static const BenchCodec bench_codecs[] =
+{
+  { "pvrtc4",      PVR_FORMAT_PVRTC4, PVR_QUALITY_NORMAL, PVR_ETC1_QUALITY,
+    PVR_DITHER_ORDERED },
+  { "pvrtc4-row",  PVR_FORMAT_PVRTC4, PVR_QUALITY_NORMAL, PVR_ETC1_QUALITY,
+    PVR_DITHER_ROW },
+  { "pvrtc4-fast", PVR_FORMAT_PVRTC4, PVR_QUALITY_FAST,   PVR_ETC1_QUALITY,
+    PVR_DITHER_ORDERED },
+  { "pvrtc4-high", PVR_FORMAT_PVRTC4, PVR_QUALITY_HIGH,   PVR_ETC1_QUALITY,
+    PVR_DITHER_ORDERED },
+  { "pvrtc2",      PVR_FORMAT_PVRTC2, PVR_QUALITY_NORMAL, PVR_ETC1_QUALITY,
+    PVR_DITHER_ORDERED },
+  { "pvrtc2-row",  PVR_FORMAT_PVRTC2, PVR_QUALITY_NORMAL, PVR_ETC1_QUALITY,
+    PVR_DITHER_ROW },
+  { "etc1",        PVR_FORMAT_ETC1,   PVR_QUALITY_NORMAL, PVR_ETC1_QUALITY,
+    PVR_DITHER_ORDERED },
+  { "etc1-fast",   PVR_FORMAT_ETC1,   PVR_QUALITY_NORMAL, PVR_ETC1_FAST,
+    PVR_DITHER_ORDERED }
+};
+
+/* pvrtc4-high is a hundred times slower than the rest, so it has to be
+ * asked for. The -row ones are the old dither, to compare against */
+#define BENCH_DEFAULT_CODECS "pvrtc4,pvrtc4-fast,pvrtc2,etc1,etc1-fast"
+
+/* An RGBA8888 image to compress */
+typedef struct
+{
+  gchar  *name;
+  gint    width;
+  gint    height;
+  guchar *pixels;
+} BenchImage;
+
+/* What one codec did with one image */
+typedef struct
+{
+  gdouble encode_mps;  /* megapixels of the image compressed per second */
+  gdouble decode_mps;  /* and decompressed */
+  gdouble peak_kb;     /* memory used on top of what was in use before */
+  gdouble psnr[4];     /* red, green, blue and alpha */
+  gint    alpha_error; /* the most any alpha value changed by */
+} BenchResult;
+
+static gint         bench_repeat = 3;
+static gint         bench_threads = 0;
+static gchar       *bench_simd = NULL;
+static gchar       *bench_codec_list = NULL;
+static gchar       *bench_baseline = NULL;
+static gchar       *bench_save_baseline = NULL;
+static gdouble      bench_psnr_tolerance = 0.05;
+static gdouble      bench_speed_tolerance = 15;
+static gdouble      bench_memory_tolerance = 10;
+static gboolean     bench_no_synthetic = FALSE;
+
+static GOptionEntry bench_options[] =
+{
+  { "repeat", 'r', 0, G_OPTION_ARG_INT, &bench_repeat,
+    "Runs of each codec to take the fastest of (3)", "N" },
+  { "threads", 't', 0, G_OPTION_ARG_INT, &bench_threads,
+    "Worker threads, or 0 for one per CPU (0)", "N" },
+  { "simd", 's', 0, G_OPTION_ARG_STRING, &bench_simd,
+    "Kernels to use: auto, none, sse2, avx2 or neon (auto)", "KIND" },
+  { "codecs", 'c', 0, G_OPTION_ARG_STRING, &bench_codec_list,
+    "Comma separated codecs to run (" BENCH_DEFAULT_CODECS "), "
+    "pvrtc4-high, pvrtc4-row and pvrtc2-row are also available", "LIST" },
+  { "baseline", 'b', 0, G_OPTION_ARG_FILENAME, &bench_baseline,
+    "Compare the results with those saved in FILE", "FILE" },
+  { "save-baseline", 'o', 0, G_OPTION_ARG_FILENAME, &bench_save_baseline,
+    "Save the results to FILE", "FILE" },
+  { "psnr-tolerance", 0, 0, G_OPTION_ARG_DOUBLE, &bench_psnr_tolerance,
+    "dB any channel may lose before it counts as worse (0.05)", "DB" },
+  { "speed-tolerance", 0, 0, G_OPTION_ARG_DOUBLE, &bench_speed_tolerance,
+    "Percent speed may drop before it counts as worse (15)", "PERCENT" },
+  { "memory-tolerance", 0, 0, G_OPTION_ARG_DOUBLE, &bench_memory_tolerance,
+    "Percent peak memory may grow before it counts as worse (10)",
+    "PERCENT" },
+  { "no-synthetic", 0, 0, G_OPTION_ARG_NONE, &bench_no_synthetic,
+    "Only use the images given on the command line", NULL },
+  { NULL }
+};
+
+/* Same sequence everywhere, so the generated images never change */
+static guint32
+bench_random (guint32 *seed)
+{
+  *seed = *seed * 1664525 + 1013904223;
+  return *seed >> 8;
+}
+
+static BenchImage *
+bench_image_new (const gchar *name,
+                 gint         width,
+                 gint         height)
+{
+  BenchImage *image = g_new0 (BenchImage, 1);
+
+  image->name = g_strdup (name);
+  image->width = width;
+  image->height = height;
+  image->pixels = g_malloc0 (width * height * 4);
+
+  return image;
+}
+
+static void
+bench_image_free (BenchImage *image)
+{
+  g_free (image->name);
+  g_free (image->pixels);
+  g_free (image);
+}
+
+/* Smooth ramps in each channel, where banding shows */
+static BenchImage *
+bench_make_gradient (void)
+{
+  BenchImage *image = bench_image_new ("gradient", 512, 512);
+  gint x, y;
+
+  for (y = 0; y < image->height; y++)
+    for (x = 0; x < image->width; x++)
+      {
+        guchar *p = image->pixels + (y * image->width + x) * 4;
+
+        p[0] = x / 2;
+        p[1] = y / 2;
+        p[2] = (x + y) / 4;
+        p[3] = 255;
+      }
+
+  return image;
+}
+
+/* Something like a photo: soft shapes with fine grain over them, at a
+ * size that has to be padded */
+static BenchImage *
+bench_make_photo (const gchar *name,
+                  gint         width,
+                  gint         height)
+{
+  BenchImage *image = bench_image_new (name, width, height);
+  guint32 seed = 1;
+  gint x, y, c;
+
+  for (y = 0; y < image->height; y++)
+    for (x = 0; x < image->width; x++)
+      {
+        guchar *p = image->pixels + (y * image->width + x) * 4;
+        gdouble shade = sin (x * 0.013) * cos (y * 0.021) +
+                        0.5 * sin ((x + 2 * y) * 0.047);
+
+        for (c = 0; c < 3; c++)
+          {
+            gint v = 128 + shade * (50 + 20 * c) + (c - 1) * x / 20 +
+                     (gint) (bench_random (&seed) % 17) - 8;
+
+            p[c] = CLAMP (v, 0, 255);
+          }
+        p[3] = 255;
+      }
+
+  return image;
+}
+
+/* Something like a screenshot: flat panels, thin lines and lots of
+ * small hard edged marks the size of text */
+static BenchImage *
+bench_make_ui (void)
+{
+  BenchImage *image = bench_image_new ("ui", 800, 424);
+  guint32 seed = 2;
+  gint x, y, i;
+
+  for (y = 0; y < image->height; y++)
+    for (x = 0; x < image->width; x++)
+      {
+        guchar *p = image->pixels + (y * image->width + x) * 4;
+        gboolean panel = x < 200;
+        gboolean line = y % 70 == 0 || x == 200;
+
+        p[0] = line ? 90 : panel ? 32 : 236;
+        p[1] = line ? 90 : panel ? 48 : 236;
+        p[2] = line ? 90 : panel ? 80 : 230;
+        p[3] = 255;
+      }
+
+  /* the "text" */
+  for (i = 0; i < 3000; i++)
+    {
+      gint gx = bench_random (&seed) % (image->width - 8);
+      gint gy = bench_random (&seed) % (image->height - 12);
+      gint gw = 1 + bench_random (&seed) % 6;
+      gint gh = 2 + bench_random (&seed) % 9;
+      gboolean dark = gx >= 200;
+
+      for (y = gy; y < gy + gh; y++)
+        for (x = gx; x < gx + gw; x++)
+          {
+            guchar *p = image->pixels + (y * image->width + x) * 4;
+
+            p[0] = p[1] = p[2] = dark ? 20 : 250;
+          }
+    }
+
+  return image;
+}
+
+/* A round icon with an antialiased edge and a soft drop shadow, so it
+ * has opaque, clear and partly transparent pixels */
+static BenchImage *
+bench_make_icon (const gchar *name,
+                 gint         size,
+                 gboolean     binary_alpha)
+{
+  BenchImage *image = bench_image_new (name, size, size);
+  gdouble centre = size / 2.0, radius = size * 0.4;
+  gint x, y;
+
+  for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++)
+      {
+        guchar *p = image->pixels + (y * size + x) * 4;
+        gdouble d = hypot (x + 0.5 - centre, y + 0.5 - centre);
+        gdouble shadow = hypot (x + 0.5 - centre - size * 0.05,
+                                y + 0.5 - centre - size * 0.05);
+        gdouble cover = CLAMP (radius + 0.5 - d, 0, 1);
+
+        p[0] = 40 + 180 * x / size;
+        p[1] = 200 - 120 * y / size;
+        p[2] = d < radius * 0.5 ? 240 : 60;
+        if (binary_alpha)
+          p[3] = d < radius ? 255 : 0;
+        else if (cover > 0)
+          p[3] = 255 * cover;
+        else
+          {
+            p[0] = p[1] = p[2] = 0;
+            p[3] = 96 * CLAMP ((radius + size * 0.08 - shadow) /
+                               (size * 0.08), 0, 1);
+          }
+      }
+
+  return image;
+}
+
+/* Noise at an awkward size, the worst case for every codec */
+static BenchImage *
+bench_make_noise (void)
+{
+  BenchImage *image = bench_image_new ("noise", 333, 77);
+  guint32 seed = 3;
+  gint i;
+
+  for (i = 0; i < image->width * image->height * 4; i++)
+    image->pixels[i] = bench_random (&seed);
+
+  return image;
+}
+
+static BenchImage *
+bench_load_image (const gchar *file)
+{
+  GdkPixbuf *pixbuf, *rgba;
+  BenchImage *image;
+  GError *error = NULL;
+  gchar *name;
+  gint y;
+
+  pixbuf = gdk_pixbuf_new_from_file (file, &error);
+  if (!pixbuf)
+    {
+      g_printerr ("Couldn't load %s. %s\n", file, error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  /* always 4 channels, and a copy we can read without the rowstride */
+  rgba = gdk_pixbuf_add_alpha (pixbuf, FALSE, 0, 0, 0);
+  g_object_unref (pixbuf);
+
+  name = g_path_get_basename (file);
+  image = bench_image_new (name, gdk_pixbuf_get_width (rgba),
+                           gdk_pixbuf_get_height (rgba));
+  g_free (name);
+
+  for (y = 0; y < image->height; y++)
+    memcpy (image->pixels + y * image->width * 4,
+            gdk_pixbuf_get_pixels (rgba) + y * gdk_pixbuf_get_rowstride (rgba),
+            image->width * 4);
+  g_object_unref (rgba);
+
+  return image;
+}
+
+/* Copies the image into the middle of a buffer of the size the format
+ * needs, repeating the last row and column into the rest, which is what
+ * hd_pvr_texture_save does too */
+static guchar *
+bench_pad_image (const BenchImage *image,
+                 PvrFormat         format,
+                 gint             *width,
+                 gint             *height)
+{
+  guchar *padded;
+  gint x, y;
+
+  *width = image->width;
+  *height = image->height;
+  if (format != PVR_FORMAT_ETC1)
+    {
+      *width = 1;
+      while (*width < image->width)
+        *width <<= 1;
+      *height = 1;
+      while (*height < image->height)
+        *height <<= 1;
+    }
+  pvr_texture_level_size (format, *width, *height, width, height);
+
+  padded = g_malloc (*width * *height * 4);
+  for (y = 0; y < *height; y++)
+    {
+      const guchar *row = image->pixels +
+                          MIN (y, image->height - 1) * image->width * 4;
+      guchar *out = padded + y * *width * 4;
+
+      memcpy (out, row, image->width * 4);
+      for (x = image->width; x < *width; x++)
+        memcpy (out + x * 4, row + (image->width - 1) * 4, 4);
+    }
+
+  return padded;
+}
+
+/* Reads a "kB" line from /proc/self/status, or returns -1 */
+static gdouble
+bench_read_status (const gchar *field)
+{
+  gchar *status, *line;
+  gdouble value = -1;
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return -1;
+
+  line = strstr (status, field);
+  if (line)
+    value = g_ascii_strtod (line + strlen (field) + 1, NULL);
+  g_free (status);
+
+  return value;
+}
+
+/* Sets the peak resident size back to what is resident now, and returns
+ * that. Linux only; elsewhere the peaks come out as 0. */
+static gdouble
+bench_reset_peak (void)
+{
+  FILE *clear_refs = fopen ("/proc/self/clear_refs", "w");
+
+  if (clear_refs)
+    {
+      fputs ("5", clear_refs);
+      fclose (clear_refs);
+    }
+
+  return bench_read_status ("VmRSS:");
+}
+
+static gboolean
+bench_run (const BenchImage        *image,
+           const BenchCodec        *codec,
+           const PvrTextureOptions *base_options,
+           BenchResult             *result)
+{
+  PvrTextureOptions options = *base_options;
+  gdouble encode_time = G_MAXDOUBLE, decode_time = G_MAXDOUBLE;
+  gdouble rss, sums[4] = { 0, 0, 0, 0 };
+  gdouble megapixels = image->width * image->height / 1e6;
+  guchar *padded = NULL, *compressed = NULL, *decoded = NULL;
+  gint width, height, x, y, c, i;
+  guint size;
+  GTimer *timer;
+
+  options.quality = codec->quality;
+  options.etc1_mode = codec->etc1_mode;
+  options.dither = codec->dither;
+
+  rss = bench_reset_peak ();
+  timer = g_timer_new ();
+  for (i = 0; i < MAX (bench_repeat, 1); i++)
+    {
+      /* the padding is part of what it costs to compress an image */
+      g_timer_start (timer);
+      g_free (compressed);
+      g_free (padded);
+      padded = bench_pad_image (image, codec->format, &width, &height);
+      switch (codec->format)
+        {
+        case PVR_FORMAT_PVRTC2:
+          compressed = pvr_texture_compress_pvrtc2_full (padded, width, height,
+                                                         &options, &size);
+          break;
+        case PVR_FORMAT_ETC1:
+          compressed = pvr_texture_compress_etc1_full (padded, width, height,
+                                                       &options, &size);
+          break;
+        default:
+          compressed = pvr_texture_compress_pvrtc4_full (padded, width, height,
+                                                         &options, &size);
+          break;
+        }
+      encode_time = MIN (encode_time, g_timer_elapsed (timer, NULL));
+      if (!compressed)
+        break;
+
+      g_timer_start (timer);
+      g_free (decoded);
+      decoded = g_malloc (width * height * 4);
+      pvr_texture_decompress_into (codec->format, compressed, width, height,
+                                   &options, decoded, width * 4);
+      decode_time = MIN (decode_time, g_timer_elapsed (timer, NULL));
+    }
+  g_timer_destroy (timer);
+  result->peak_kb = rss < 0 ? 0 : bench_read_status ("VmHWM:") - rss;
+
+  if (!compressed)
+    {
+      g_printerr ("%s couldn't compress %s\n", codec->name, image->name);
+      g_free (padded);
+      return FALSE;
+    }
+
+  result->encode_mps = megapixels / MAX (encode_time, 1e-9);
+  result->decode_mps = megapixels / MAX (decode_time, 1e-9);
+
+  /* only the image counts, not the padding */
+  result->alpha_error = 0;
+  for (y = 0; y < image->height; y++)
+    for (x = 0; x < image->width; x++)
+      {
+        const guchar *a = image->pixels + (y * image->width + x) * 4;
+        const guchar *b = decoded + (y * width + x) * 4;
+
+        for (c = 0; c < 4; c++)
+          sums[c] += (a[c] - b[c]) * (a[c] - b[c]);
+        result->alpha_error = MAX (result->alpha_error, ABS (a[3] - b[3]));
+      }
+  for (c = 0; c < 4; c++)
+    result->psnr[c] = sums[c] == 0 ? PVR_PSNR_MAX :
+      MIN (PVR_PSNR_MAX,
+           10 * log10 (255.0 * 255.0 * image->width * image->height /
+                       sums[c]));
+
+  g_free (padded);
+  g_free (compressed);
+  g_free (decoded);
+  return TRUE;
+}
+
+/* Prints which numbers got worse than the baseline, and returns how many
+ * did */
+static gint
+bench_compare (GKeyFile          *baseline,
+               const gchar       *group,
+               const BenchResult *result)
+{
+  static const gchar *channels[] = { "psnr_r", "psnr_g", "psnr_b", "psnr_a" };
+  gint worse = 0, c;
+  gdouble old;
+
+  if (!g_key_file_has_group (baseline, group))
+    {
+      g_print ("  %s: not in the baseline\n", group);
+      return 0;
+    }
+
+  for (c = 0; c < 4; c++)
+    {
+      old = g_key_file_get_double (baseline, group, channels[c], NULL);
+      if (result->psnr[c] < old - bench_psnr_tolerance)
+        {
+          g_print ("  %s: %s down from %.2f to %.2f dB\n",
+                   group, channels[c], old, result->psnr[c]);
+          worse++;
+        }
+    }
+
+  old = g_key_file_get_integer (baseline, group, "alpha_error", NULL);
+  if (result->alpha_error > old)
+    {
+      g_print ("  %s: alpha error up from %d to %d\n",
+               group, (gint) old, result->alpha_error);
+      worse++;
+    }
+
+  old = g_key_file_get_double (baseline, group, "encode_mps", NULL);
+  if (result->encode_mps < old * (1 - bench_speed_tolerance / 100))
+    {
+      g_print ("  %s: encoding down from %.2f to %.2f MP/s\n",
+               group, old, result->encode_mps);
+      worse++;
+    }
+
+  old = g_key_file_get_double (baseline, group, "decode_mps", NULL);
+  if (result->decode_mps < old * (1 - bench_speed_tolerance / 100))
+    {
+      g_print ("  %s: decoding down from %.2f to %.2f MP/s\n",
+               group, old, result->decode_mps);
+      worse++;
+    }
+
+  /* a few pages either way is noise */
+  old = g_key_file_get_double (baseline, group, "peak_kb", NULL);
+  if (result->peak_kb > old * (1 + bench_memory_tolerance / 100) + 64)
+    {
+      g_print ("  %s: peak memory up from %.0f to %.0f kB\n",
+               group, old, result->peak_kb);
+      worse++;
+    }
+
+  return worse;
+}
+
+static void
+bench_save (GKeyFile          *results,
+            const gchar       *group,
+            const BenchResult *result)
+{
+  g_key_file_set_double (results, group, "encode_mps", result->encode_mps);
+  g_key_file_set_double (results, group, "decode_mps", result->decode_mps);
+  g_key_file_set_double (results, group, "peak_kb", result->peak_kb);
+  g_key_file_set_double (results, group, "psnr_r", result->psnr[0]);
+  g_key_file_set_double (results, group, "psnr_g", result->psnr[1]);
+  g_key_file_set_double (results, group, "psnr_b", result->psnr[2]);
+  g_key_file_set_double (results, group, "psnr_a", result->psnr[3]);
+  g_key_file_set_integer (results, group, "alpha_error", result->alpha_error);
+}
+
+static gboolean
+bench_parse_simd (const gchar *name,
+                  PvrSimd     *simd)
+{
+  static const gchar *names[] = { "auto", "none", "sse2", "avx2", "neon" };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
+    if (!g_ascii_strcasecmp (name, names[i]))
+      {
+        *simd = PVR_SIMD_AUTO + i;
+        return TRUE;
+      }
+
+  return FALSE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GPtrArray *images;
+  GKeyFile *baseline = NULL, *results;
+  PvrTextureOptions options;
+  gchar **codec_names;
+  gint worse = 0, failed = 0, i, j;
+  guint k;
+
+  g_type_init ();
+
+  context = g_option_context_new ("[IMAGE...] - benchmark the PVR codecs");
+  g_option_context_add_main_entries (context, bench_options, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (context);
+
+  /* the codecs set the dither the same way hd_pvr_texture_save does */
+  pvr_texture_options_init (&options);
+  options.n_threads = MAX (bench_threads, 0);
+  if (bench_simd && !bench_parse_simd (bench_simd, &options.simd))
+    {
+      g_printerr ("Unknown --simd %s\n", bench_simd);
+      return EXIT_FAILURE;
+    }
+
+  if (bench_baseline)
+    {
+      baseline = g_key_file_new ();
+      if (!g_key_file_load_from_file (baseline, bench_baseline,
+                                      G_KEY_FILE_NONE, &error))
+        {
+          g_printerr ("Couldn't read %s. %s\n", bench_baseline,
+                      error->message);
+          return EXIT_FAILURE;
+        }
+    }
+  results = g_key_file_new ();
+
+  images = g_ptr_array_new ();
+  if (!bench_no_synthetic)
+    {
+      g_ptr_array_add (images, bench_make_gradient ());
+      g_ptr_array_add (images, bench_make_photo ("photo", 800, 480));
+      /* wide enough that a row of blocks doesn't fit in the cache */
+      g_ptr_array_add (images, bench_make_photo ("photo-2048", 2048, 1024));
+      g_ptr_array_add (images, bench_make_ui ());
+      g_ptr_array_add (images, bench_make_icon ("icon-64", 64, FALSE));
+      g_ptr_array_add (images, bench_make_icon ("icon-48-binary", 48, TRUE));
+      g_ptr_array_add (images, bench_make_noise ());
+    }
+  for (i = 1; i < argc; i++)
+    {
+      BenchImage *image = bench_load_image (argv[i]);
+
+      if (!image)
+        return EXIT_FAILURE;
+      g_ptr_array_add (images, image);
+    }
+
+  codec_names = g_strsplit (bench_codec_list ? bench_codec_list :
+                            BENCH_DEFAULT_CODECS, ",", -1);
+
+  g_print ("%-16s %-12s %9s %8s %8s %8s %6s %6s %6s %6s %4s\n",
+           "image", "codec", "size", "enc MP/s", "dec MP/s", "peak kB",
+           "R dB", "G dB", "B dB", "A dB", "A err");
+  for (k = 0; k < images->len; k++)
+    {
+      BenchImage *image = g_ptr_array_index (images, k);
+      gchar *size = g_strdup_printf ("%dx%d", image->width, image->height);
+
+      for (j = 0; codec_names[j]; j++)
+        {
+          const BenchCodec *codec = NULL;
+          BenchResult result;
+          gchar *group;
+          guint c;
+
+          for (c = 0; c < G_N_ELEMENTS (bench_codecs); c++)
+            if (!strcmp (codec_names[j], bench_codecs[c].name))
+              codec = &bench_codecs[c];
+          if (!codec)
+            {
+              g_printerr ("Unknown codec %s\n", codec_names[j]);
+              return EXIT_FAILURE;
+            }
+
+          if (!bench_run (image, codec, &options, &result))
+            {
+              failed++;
+              continue;
+            }
+
+          g_print ("%-16s %-12s %9s %8.2f %8.2f %8.0f "
+                   "%6.2f %6.2f %6.2f %6.2f %4d\n",
+                   image->name, codec->name, size,
+                   result.encode_mps, result.decode_mps, result.peak_kb,
+                   result.psnr[0], result.psnr[1], result.psnr[2],
+                   result.psnr[3], result.alpha_error);
+
+          group = g_strdup_printf ("%s %s %s", image->name, size, codec->name);
+          bench_save (results, group, &result);
+          if (baseline)
+            worse += bench_compare (baseline, group, &result);
+          g_free (group);
+        }
+
+      g_free (size);
+    }
+
+  if (bench_save_baseline)
+    {
+      gchar *data = g_key_file_to_data (results, NULL, NULL);
+
+      if (!g_file_set_contents (bench_save_baseline, data, -1, &error))
+        {
+          g_printerr ("Couldn't save %s. %s\n", bench_save_baseline,
+                      error->message);
+          g_error_free (error);
+          failed++;
+        }
+      g_free (data);
+    }
+
+  if (baseline)
+    {
+      g_print ("%d results worse than %s\n", worse, bench_baseline);
+      g_key_file_free (baseline);
+    }
+
+  g_key_file_free (results);
+  g_strfreev (codec_names);
+  for (k = 0; k < images->len; k++)
+    bench_image_free (g_ptr_array_index (images, k));
+  g_ptr_array_free (images, TRUE);
+
+  return worse || failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
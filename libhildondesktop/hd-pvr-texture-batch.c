@@ -0,0 +1,697 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Compresses a lot of images to textures at once, for building themes.
+ *
+ * Each worker thread loads an image, compresses it with an encoder of its
+ * own and writes it to a file from the batch's PvrTextureWriter, without
+ * syncing. The thread running the batch hands the finished textures back
+ * to the writer, which every so often syncs a whole group of them at
+ * once and then puts them in place. So there is one sync per group
+ * rather than one per texture, and a texture is never in place before
+ * it is on disk.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hd-pvr-texture.h"
+#include "hd-pvr-texture-private.h"
+#include "pvr-texture.h"
+
+/* One image to compress */
+typedef struct
+{
+  gchar   *input;
+  gchar   *output;
+  /* filled in by the worker: the writer's file holding the texture, or
+   * -1 and why there isn't one */
+  gint     fd;
+  gsize    size;
+  guint64  pixels;
+  GError  *error;
+} BatchItem;
+
+struct _HDPvrTextureBatch
+{
+  HDPvrTextureFormat     format;
+  HDPvrTextureSaveFlags  flags;
+  guint                  n_workers;
+  GPtrArray             *items;
+  /* while running, the encoders not in use and the items done */
+  GAsyncQueue           *encoders;
+  GAsyncQueue           *done;
+  /* and where the textures go, which the workers share */
+  PvrTextureWriter      *writer;
+  GMutex                *writer_lock;
+  /* set when the batch has failed, so the workers skip what's left */
+  gint                   failed;
+};
+
+/* The textures handed to the writer but not yet in place, and where to
+ * report them once they are */
+typedef struct
+{
+  GPtrArray                  *items;
+  guint                       n_placed;
+  HDPvrTextureBatchErrorFunc  error_func;
+  gpointer                    user_data;
+  HDPvrTextureBatchStats     *stats;
+} BatchGroup;
+
+/**
+ * hd_pvr_texture_batch_new:
+ * @format: the format to compress to
+ * @flags: as for hd_pvr_texture_save_full()
+ * @n_workers: how many images to work on at once, or 0 for one per CPU
+ *
+ * Makes an empty batch. Add images to it with hd_pvr_texture_batch_add(),
+ * hd_pvr_texture_batch_add_manifest() or hd_pvr_texture_batch_add_dir(),
+ * then compress them with hd_pvr_texture_batch_run().
+ *
+ * Returns: the batch, to be freed with hd_pvr_texture_batch_free()
+ */
+HDPvrTextureBatch *
+hd_pvr_texture_batch_new (HDPvrTextureFormat    format,
+                          HDPvrTextureSaveFlags flags,
+                          guint                 n_workers)
+{
+  HDPvrTextureBatch *batch;
+
+  batch = g_new0 (HDPvrTextureBatch, 1);
+  batch->format = format;
+  batch->flags = flags;
+  batch->n_workers = n_workers;
+  batch->items = g_ptr_array_new ();
+
+  if (!batch->n_workers)
+    {
+      glong n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+      batch->n_workers = n_cpus > 0 ? n_cpus : 1;
+    }
+
+  return batch;
+}
+
+static void
+batch_item_free (BatchItem *item)
+{
+  g_free (item->input);
+  g_free (item->output);
+  if (item->error)
+    g_error_free (item->error);
+  g_free (item);
+}
+
+/**
+ * hd_pvr_texture_batch_free:
+ * @batch: a #HDPvrTextureBatch
+ *
+ * Frees the batch.
+ */
+void
+hd_pvr_texture_batch_free (HDPvrTextureBatch *batch)
+{
+  guint i;
+
+  g_return_if_fail (batch != NULL);
+
+  for (i = 0; i < batch->items->len; i++)
+    batch_item_free (g_ptr_array_index (batch->items, i));
+  g_ptr_array_free (batch->items, TRUE);
+  g_free (batch);
+}
+
+/* input with its extension changed to .pvr, in output_dir if given */
+static gchar *
+batch_output_name (const gchar *input,
+                   const gchar *output_dir)
+{
+  gchar *base, *name, *dot, *slash, *output;
+
+  base = output_dir ? g_path_get_basename (input) : g_strdup (input);
+  slash = strrchr (base, G_DIR_SEPARATOR);
+  dot = strrchr (base, '.');
+  if (dot && dot > (slash ? slash + 1 : base))
+    *dot = '\0';
+
+  name = g_strconcat (base, ".pvr", NULL);
+  g_free (base);
+  if (!output_dir)
+    return name;
+
+  output = g_build_filename (output_dir, name, NULL);
+  g_free (name);
+  return output;
+}
+
+/**
+ * hd_pvr_texture_batch_add:
+ * @batch: a #HDPvrTextureBatch
+ * @input: an image gdk-pixbuf can load
+ * @output: the texture to compress it to, or %NULL for @input with its
+ * extension changed to .pvr
+ *
+ * Adds an image to the batch.
+ */
+void
+hd_pvr_texture_batch_add (HDPvrTextureBatch *batch,
+                          const gchar       *input,
+                          const gchar       *output)
+{
+  BatchItem *item;
+
+  g_return_if_fail (batch != NULL);
+  g_return_if_fail (input != NULL);
+
+  item = g_new0 (BatchItem, 1);
+  item->input = g_strdup (input);
+  item->fd = -1;
+  item->output = output ? g_strdup (output) :
+                          batch_output_name (input, NULL);
+  g_ptr_array_add (batch->items, item);
+}
+
+/**
+ * hd_pvr_texture_batch_add_manifest:
+ * @batch: a #HDPvrTextureBatch
+ * @manifest: a file listing images
+ * @error: return location for an error, or %NULL
+ *
+ * Adds the images listed in @manifest to the batch. Each line of it
+ * names an image, optionally followed by a tab and the texture to
+ * compress it to, as for hd_pvr_texture_batch_add(). Blank lines and
+ * lines starting with # are skipped. Relative paths are taken from the
+ * directory @manifest is in.
+ *
+ * Returns: %TRUE if @manifest could be read
+ */
+gboolean
+hd_pvr_texture_batch_add_manifest (HDPvrTextureBatch  *batch,
+                                   const gchar        *manifest,
+                                   GError            **error)
+{
+  gchar *contents, *dir;
+  gchar **lines;
+  guint i;
+
+  g_return_val_if_fail (batch != NULL, FALSE);
+  g_return_val_if_fail (manifest != NULL, FALSE);
+
+  if (!g_file_get_contents (manifest, &contents, NULL, error))
+    return FALSE;
+
+  dir = g_path_get_dirname (manifest);
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  for (i = 0; lines[i]; i++)
+    {
+      gchar *line = lines[i];
+      gchar *tab, *input, *output = NULL;
+
+      tab = strchr (line, '\t');
+      if (tab)
+        {
+          *tab = '\0';
+          output = g_strstrip (tab + 1);
+        }
+      line = g_strstrip (line);
+      if (!*line || *line == '#')
+        continue;
+
+      input = g_path_is_absolute (line) ? g_strdup (line) :
+                                          g_build_filename (dir, line, NULL);
+      if (output && *output && !g_path_is_absolute (output))
+        output = g_build_filename (dir, output, NULL);
+      else if (output && *output)
+        output = g_strdup (output);
+      else
+        output = NULL;
+
+      hd_pvr_texture_batch_add (batch, input, output);
+      g_free (input);
+      g_free (output);
+    }
+
+  g_strfreev (lines);
+  g_free (dir);
+  return TRUE;
+}
+
+/* TRUE if gdk-pixbuf loads files named like this, other than textures */
+static gboolean
+batch_is_image (const gchar  *name,
+                gchar       **extensions)
+{
+  const gchar *dot = strrchr (name, '.');
+  guint i;
+
+  if (!dot || dot == name || !g_ascii_strcasecmp (dot + 1, "pvr"))
+    return FALSE;
+
+  for (i = 0; extensions[i]; i++)
+    if (!g_ascii_strcasecmp (dot + 1, extensions[i]))
+      return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+batch_add_dir (HDPvrTextureBatch  *batch,
+               const gchar        *dir,
+               const gchar        *output_dir,
+               gchar             **extensions,
+               GError            **error)
+{
+  GDir *gdir;
+  const gchar *name;
+  gboolean ret = TRUE;
+
+  gdir = g_dir_open (dir, 0, error);
+  if (!gdir)
+    return FALSE;
+
+  while (ret && (name = g_dir_read_name (gdir)))
+    {
+      gchar *path = g_build_filename (dir, name, NULL);
+
+      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+        {
+          gchar *sub_dir = g_build_filename (output_dir, name, NULL);
+
+          ret = batch_add_dir (batch, path, sub_dir, extensions, error);
+          g_free (sub_dir);
+        }
+      else if (batch_is_image (name, extensions))
+        {
+          gchar *output = batch_output_name (path, output_dir);
+
+          hd_pvr_texture_batch_add (batch, path, output);
+          g_free (output);
+        }
+
+      g_free (path);
+    }
+
+  g_dir_close (gdir);
+  return ret;
+}
+
+/**
+ * hd_pvr_texture_batch_add_dir:
+ * @batch: a #HDPvrTextureBatch
+ * @dir: a directory of images
+ * @output_dir: where to put the textures, or %NULL to put them next to
+ * the images
+ * @error: return location for an error, or %NULL
+ *
+ * Adds every image gdk-pixbuf can load in @dir and the directories below
+ * it to the batch. Each is compressed to a texture with the same name
+ * but a .pvr extension, in the same place under @output_dir as it was
+ * under @dir.
+ *
+ * Returns: %TRUE if the directories could be read
+ */
+gboolean
+hd_pvr_texture_batch_add_dir (HDPvrTextureBatch  *batch,
+                              const gchar        *dir,
+                              const gchar        *output_dir,
+                              GError            **error)
+{
+  GSList *formats, *l;
+  GPtrArray *extensions;
+  gboolean ret;
+  guint i;
+
+  g_return_val_if_fail (batch != NULL, FALSE);
+  g_return_val_if_fail (dir != NULL, FALSE);
+
+  /* the extensions of every format gdk-pixbuf has a loader for */
+  extensions = g_ptr_array_new ();
+  formats = gdk_pixbuf_get_formats ();
+  for (l = formats; l; l = l->next)
+    {
+      gchar **format_extensions = gdk_pixbuf_format_get_extensions (l->data);
+
+      for (i = 0; format_extensions[i]; i++)
+        g_ptr_array_add (extensions, format_extensions[i]);
+      g_free (format_extensions);
+    }
+  g_ptr_array_add (extensions, NULL);
+  g_slist_free (formats);
+
+  ret = batch_add_dir (batch, dir, output_dir ? output_dir : dir,
+                       (gchar **) extensions->pdata, error);
+
+  g_strfreev ((gchar **) g_ptr_array_free (extensions, FALSE));
+  return ret;
+}
+
+/* TRUE if the item's texture is newer than its image */
+static gboolean
+batch_item_is_up_to_date (BatchItem *item)
+{
+  struct stat input_st, output_st;
+
+  if (g_stat (item->input, &input_st) != 0 ||
+      g_stat (item->output, &output_st) != 0)
+    return FALSE;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  if (output_st.st_mtime == input_st.st_mtime)
+    return output_st.st_mtim.tv_nsec > input_st.st_mtim.tv_nsec;
+#endif
+  /* an image changed in the same second as its texture was written may
+   * be the newer, so only a later second counts */
+  return output_st.st_mtime > input_st.st_mtime;
+}
+
+/* Throws away the file holding the item's texture */
+static void
+batch_item_discard (HDPvrTextureBatch *batch,
+                    BatchItem         *item)
+{
+  if (item->fd != -1)
+    {
+      g_mutex_lock (batch->writer_lock);
+      pvr_texture_writer_abort (batch->writer, item->fd);
+      g_mutex_unlock (batch->writer_lock);
+      item->fd = -1;
+    }
+}
+
+/* Writes the texture to a file from the writer for the item's output */
+static gboolean
+batch_item_write (HDPvrTextureBatch *batch,
+                  BatchItem         *item,
+                  const guchar      *texture)
+{
+  gchar *dir;
+
+  dir = g_path_get_dirname (item->output);
+  if (g_mkdir_with_parents (dir, 0755) != 0)
+    {
+      hd_pvr_texture_set_file_error (&item->error,
+                                     "Could not make directory %s", dir);
+      g_free (dir);
+      return FALSE;
+    }
+  g_free (dir);
+
+  g_mutex_lock (batch->writer_lock);
+  item->fd = pvr_texture_writer_begin (batch->writer, item->output,
+                                       &item->error);
+  g_mutex_unlock (batch->writer_lock);
+  if (item->fd == -1)
+    return FALSE;
+
+  if (!hd_pvr_texture_write_all (item->fd, texture, item->size))
+    {
+      hd_pvr_texture_set_file_error (&item->error, "Could not write %s",
+                                     item->output);
+      batch_item_discard (batch, item);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Run by the workers, or by hd_pvr_texture_batch_run itself if there are
+ * no threads */
+static void
+batch_item_run (gpointer data,
+                gpointer user_data)
+{
+  BatchItem *item = data;
+  HDPvrTextureBatch *batch = user_data;
+  HDPvrEncoder *encoder;
+  GdkPixbuf *pixbuf;
+  const guchar *texture;
+
+  if (g_atomic_int_get (&batch->failed))
+    {
+      g_async_queue_push (batch->done, item);
+      return;
+    }
+
+  pixbuf = gdk_pixbuf_new_from_file (item->input, &item->error);
+  if (pixbuf)
+    {
+      encoder = g_async_queue_pop (batch->encoders);
+      texture = hd_pvr_encoder_compress (encoder, pixbuf, NULL, 0,
+                                         &item->size, &item->error);
+      if (texture && batch_item_write (batch, item, texture))
+        item->pixels = (guint64) gdk_pixbuf_get_width (pixbuf) *
+                       gdk_pixbuf_get_height (pixbuf);
+      g_async_queue_push (batch->encoders, encoder);
+
+      g_object_unref (pixbuf);
+    }
+
+  g_async_queue_push (batch->done, item);
+}
+
+static void
+batch_item_failed (BatchItem                  *item,
+                   HDPvrTextureBatchErrorFunc  error_func,
+                   gpointer                    user_data,
+                   HDPvrTextureBatchStats     *stats)
+{
+  stats->n_failed++;
+  if (error_func)
+    error_func (item->input, item->output, item->error, user_data);
+}
+
+/* Called by the writer as it puts each of the group's textures in place,
+ * in the order they were handed to it */
+static void
+batch_item_placed (const gchar  *filename,
+                   const GError *error,
+                   gpointer      data)
+{
+  BatchGroup *group = data;
+  BatchItem *item = g_ptr_array_index (group->items, group->n_placed++);
+  HDPvrTextureBatchStats *stats = group->stats;
+
+  if (error)
+    {
+      item->error = g_error_copy (error);
+      batch_item_failed (item, group->error_func, group->user_data, stats);
+      return;
+    }
+
+  stats->n_compressed++;
+  stats->pixels += item->pixels;
+  stats->bytes_written += item->size;
+}
+
+/* After a call to the writer, counts the sync if it put the group's
+ * textures in place */
+static gboolean
+batch_group_check (BatchGroup *group,
+                   gboolean    synced)
+{
+  if (group->n_placed)
+    {
+      if (synced)
+        group->stats->n_syncs++;
+      g_ptr_array_set_size (group->items, 0);
+      group->n_placed = 0;
+    }
+
+  return synced;
+}
+
+/* Takes in an item a worker has finished with, and hands its texture to
+ * the writer. Only the writer failing to sync is an error; a texture
+ * that can't be put in place fails on its own */
+static gboolean
+batch_item_done (HDPvrTextureBatch  *batch,
+                 BatchItem          *item,
+                 BatchGroup         *group,
+                 GError            **error)
+{
+  gboolean ret;
+
+  if (item->fd == -1)
+    {
+      if (!item->error)
+        g_set_error (&item->error, hd_pvr_texture_error_quark (),
+                     HD_PVR_TEXTURE_ERROR_UNKNOWN,
+                     "Could not compress %s", item->input);
+      batch_item_failed (item, group->error_func, group->user_data,
+                         group->stats);
+      return TRUE;
+    }
+
+  g_ptr_array_add (group->items, item);
+  g_mutex_lock (batch->writer_lock);
+  ret = pvr_texture_writer_commit (batch->writer, item->fd, error);
+  g_mutex_unlock (batch->writer_lock);
+  item->fd = -1;
+
+  return batch_group_check (group, ret);
+}
+
+/**
+ * hd_pvr_texture_batch_run:
+ * @batch: a #HDPvrTextureBatch
+ * @force: %TRUE to compress every image, even those with textures newer
+ * than them
+ * @error_func: called for each image that fails, or %NULL
+ * @user_data: data for @error_func
+ * @stats: return location for what was done, or %NULL
+ * @error: return location for an error, or %NULL
+ *
+ * Compresses the images of the batch, each as hd_pvr_texture_save_full()
+ * would. They are loaded and compressed on a pool of worker threads.
+ * The textures are synced to disk a group at a time, which is much
+ * quicker than syncing each on its own, and only put in place once
+ * they are. An image whose texture is newer is skipped unless @force is
+ * %TRUE.
+ *
+ * An image that can't be loaded, compressed or put in place doesn't stop
+ * the others; it is counted in @stats and passed to @error_func.
+ *
+ * Returns: %FALSE if the textures could not be synced, in which case
+ * the batch stops. Those of the group being synced are passed to
+ * @error_func, and the rest not yet in place are thrown away
+ */
+gboolean
+hd_pvr_texture_batch_run (HDPvrTextureBatch           *batch,
+                          gboolean                     force,
+                          HDPvrTextureBatchErrorFunc   error_func,
+                          gpointer                     user_data,
+                          HDPvrTextureBatchStats      *stats,
+                          GError                     **error)
+{
+  HDPvrTextureBatchStats own_stats;
+  GThreadPool *pool = NULL;
+  HDPvrEncoder *encoder;
+  BatchGroup group;
+  BatchItem *item;
+  GTimer *timer;
+  guint n_running = 0, i;
+  gboolean ret = TRUE;
+
+  g_return_val_if_fail (batch != NULL, FALSE);
+
+  if (!stats)
+    stats = &own_stats;
+  memset (stats, 0, sizeof (*stats));
+  timer = g_timer_new ();
+
+  group.items = g_ptr_array_new ();
+  group.n_placed = 0;
+  group.error_func = error_func;
+  group.user_data = user_data;
+  group.stats = stats;
+
+  batch->writer = pvr_texture_writer_new (PVR_SYNC_DEFERRED);
+  batch->writer_lock = g_mutex_new ();
+  pvr_texture_writer_set_func (batch->writer, batch_item_placed, &group);
+
+  /* one single threaded encoder for each worker, as the workers already
+   * keep every CPU busy */
+  batch->encoders = g_async_queue_new ();
+  batch->done = g_async_queue_new ();
+  for (i = 0; i < batch->n_workers; i++)
+    g_async_queue_push (batch->encoders,
+                        hd_pvr_encoder_new_with_threads (batch->format,
+                                                         batch->flags, 1));
+
+  if (g_thread_supported () && batch->n_workers > 1)
+    pool = g_thread_pool_new (batch_item_run, batch,
+                              batch->n_workers, TRUE, NULL);
+
+  for (i = 0; ret && i < batch->items->len; i++)
+    {
+      item = g_ptr_array_index (batch->items, i);
+
+      if (!force && batch_item_is_up_to_date (item))
+        {
+          stats->n_skipped++;
+          continue;
+        }
+
+      if (pool)
+        g_thread_pool_push (pool, item, NULL);
+      else
+        batch_item_run (item, batch);
+      n_running++;
+
+      /* take in whatever has finished meanwhile */
+      while (ret && (item = g_async_queue_try_pop (batch->done)))
+        {
+          n_running--;
+          ret = batch_item_done (batch, item, &group, error);
+        }
+    }
+
+  /* after a failure, the workers skip the images not yet started */
+  if (!ret)
+    g_atomic_int_set (&batch->failed, TRUE);
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  while (n_running > 0)
+    {
+      item = g_async_queue_pop (batch->done);
+      n_running--;
+      if (ret)
+        ret = batch_item_done (batch, item, &group, error);
+      else
+        batch_item_discard (batch, item);
+    }
+
+  /* the rest, or after a failure nothing more */
+  if (ret)
+    ret = batch_group_check (&group,
+                             pvr_texture_writer_sync (batch->writer, error));
+  pvr_texture_writer_free (batch->writer);
+  g_mutex_free (batch->writer_lock);
+
+  while ((encoder = g_async_queue_try_pop (batch->encoders)))
+    hd_pvr_encoder_free (encoder);
+  g_async_queue_unref (batch->encoders);
+  g_async_queue_unref (batch->done);
+  batch->encoders = batch->done = NULL;
+  batch->writer = NULL;
+  batch->writer_lock = NULL;
+  batch->failed = FALSE;
+  g_ptr_array_free (group.items, TRUE);
+
+  stats->seconds = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return ret;
+}
@@ -0,0 +1,468 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* A cache of compressed textures, so that saving the same pixels with the
+ * same settings again (reselecting a wallpaper, say) is just a link.
+ *
+ * Each entry is a .pvr file in the cache directory, named after a hash of
+ * everything that goes into it. Entries are hard linked into place where
+ * possible, so they take no extra space while the saved copy is around.
+ * Both are only ever replaced by renaming over them, never rewritten, so
+ * sharing the inode is safe. When an entry was last used is kept as the
+ * modification time of an empty stamp file next to it, rather than of
+ * the entry itself, which would change the saved texture's too. The
+ * least recently used entries are removed when the directory grows past
+ * its limit.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "hd-pvr-texture.h"
+#include "hd-pvr-texture-cache.h"
+#include "hd-pvr-texture-private.h"
+
+/* Bump when the compressor changes what it writes, so old entries are no
+ * longer found */
+#define HD_PVR_TEXTURE_CACHE_VERSION 4
+
+#define HD_PVR_TEXTURE_CACHE_SUFFIX ".pvr"
+#define HD_PVR_TEXTURE_CACHE_STAMP_SUFFIX ".used"
+#define HD_PVR_TEXTURE_CACHE_TMP_SUFFIX ".tmp"
+
+/* How long a temporary file may sit in the cache before it is taken to
+ * be left over from a crash, whoever made it */
+#define HD_PVR_TEXTURE_CACHE_TMP_MAX_AGE (60 * 60)
+
+#define HASH_PRIME G_GUINT64_CONSTANT (0x9e3779b97f4a7c15)
+
+static gchar   *hd_pvr_texture_cache_dir = NULL;
+static guint64  hd_pvr_texture_cache_max_size = 0;
+static gint     hd_pvr_texture_cache_hits = 0;
+static gint     hd_pvr_texture_cache_misses = 0;
+static gint     hd_pvr_texture_cache_serial = 0;
+
+/* An entry found while working out what to evict */
+typedef struct
+{
+  gchar  *path;
+  guint64 size;
+  time_t  used;
+} CacheEntry;
+
+/**
+ * hd_pvr_texture_cache_init:
+ * @cache_dir: the directory to keep compressed textures in, or %NULL to
+ * turn the cache off
+ * @max_size: how many bytes the directory may hold
+ *
+ * Makes hd_pvr_texture_save() and hd_pvr_texture_save_full() remember
+ * what they have compressed, and link the result into place when the
+ * same pixels are saved again with the same settings. The cache is off
+ * until this is called. It should be called before any textures are
+ * saved, and not while other threads may be saving them.
+ */
+void
+hd_pvr_texture_cache_init (const gchar *cache_dir,
+                           guint64      max_size)
+{
+  g_free (hd_pvr_texture_cache_dir);
+  hd_pvr_texture_cache_dir = NULL;
+  hd_pvr_texture_cache_max_size = max_size;
+
+  if (!cache_dir)
+    return;
+
+  if (g_mkdir_with_parents (cache_dir, 0755) != 0)
+    {
+      g_warning ("Couldn't create texture cache %s. %s",
+                 cache_dir, g_strerror (errno));
+      return;
+    }
+
+  hd_pvr_texture_cache_dir = g_strdup (cache_dir);
+}
+
+/**
+ * hd_pvr_texture_cache_get_stats:
+ * @hits: return location for the number of saves the cache answered,
+ * or %NULL
+ * @misses: return location for the number of saves that had to
+ * compress, or %NULL
+ *
+ * Gets the cache counters, counted since the process started or
+ * hd_pvr_texture_cache_reset_stats() was last called.
+ */
+void
+hd_pvr_texture_cache_get_stats (guint *hits,
+                                guint *misses)
+{
+  if (hits)
+    *hits = g_atomic_int_get (&hd_pvr_texture_cache_hits);
+  if (misses)
+    *misses = g_atomic_int_get (&hd_pvr_texture_cache_misses);
+}
+
+/**
+ * hd_pvr_texture_cache_reset_stats:
+ *
+ * Sets the counters hd_pvr_texture_cache_get_stats() gives back to 0.
+ */
+void
+hd_pvr_texture_cache_reset_stats (void)
+{
+  g_atomic_int_set (&hd_pvr_texture_cache_hits, 0);
+  g_atomic_int_set (&hd_pvr_texture_cache_misses, 0);
+}
+
+static guint64
+hash_bytes (guint64       hash,
+            const guchar *data,
+            gsize         len)
+{
+  /* 8 bytes at a time where we can, which is most of it */
+  while (len >= 8)
+    {
+      guint64 word;
+
+      memcpy (&word, data, 8);
+      hash = (hash ^ word) * HASH_PRIME;
+      hash ^= hash >> 32;
+      data += 8;
+      len -= 8;
+    }
+
+  while (len--)
+    hash = (hash ^ *data++) * HASH_PRIME;
+
+  return hash ^ (hash >> 29);
+}
+
+/* Works out the name of the cache entry for the given pixels and
+ * settings. Returns NULL if the cache is off. */
+gchar *
+hd_pvr_texture_cache_key (const guchar *pixels,
+                          guint         width,
+                          guint         height,
+                          guint         rowstride,
+                          guint         n_channels,
+                          guint         format,
+                          guint         flags)
+{
+  guint32 settings[6];
+  guint64 hash;
+  guint y;
+
+  if (!hd_pvr_texture_cache_dir)
+    return NULL;
+
+  settings[0] = HD_PVR_TEXTURE_CACHE_VERSION;
+  settings[1] = width;
+  settings[2] = height;
+  settings[3] = n_channels;
+  settings[4] = format;
+  settings[5] = flags;
+  hash = hash_bytes (0, (const guchar *) settings, sizeof (settings));
+
+  /* only the pixels, not the padding at the end of each row */
+  for (y = 0; y < height; y++)
+    hash = hash_bytes (hash, pixels + y * rowstride, width * n_channels);
+
+  return g_strdup_printf ("%08x%08x-%ux%u" HD_PVR_TEXTURE_CACHE_SUFFIX,
+                          (guint32) (hash >> 32), (guint32) hash,
+                          width, height);
+}
+
+/* Makes dest a copy of src, by a hard link if it can. dest is replaced
+ * atomically, so anyone reading it sees the old file or the new one */
+static gboolean
+link_or_copy (const gchar *src,
+              const gchar *dest)
+{
+  gchar *tmp;
+  gboolean ret;
+
+  tmp = g_strdup_printf ("%s.%d-%d" HD_PVR_TEXTURE_CACHE_TMP_SUFFIX,
+                         dest, (gint) getpid (),
+                         g_atomic_int_exchange_and_add
+                           (&hd_pvr_texture_cache_serial, 1));
+
+  ret = link (src, tmp) == 0;
+  if (!ret)
+    {
+      /* another filesystem, or one without hard links. The copy is
+       * synced before it goes in place, as a freshly compressed texture
+       * would be, so a crash can't leave dest empty */
+      gchar *contents;
+      gsize length;
+      gint fd;
+
+      ret = g_file_get_contents (src, &contents, &length, NULL);
+      if (ret)
+        {
+          fd = g_open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          ret = fd != -1 &&
+                hd_pvr_texture_write_all (fd, (const guchar *) contents,
+                                          length) &&
+                fdatasync (fd) == 0;
+          if (fd != -1 && close (fd) != 0)
+            ret = FALSE;
+          g_free (contents);
+        }
+    }
+
+  if (ret && g_rename (tmp, dest) != 0)
+    ret = FALSE;
+
+  /* rename leaves tmp behind if dest was already a link to src */
+  g_unlink (tmp);
+
+  g_free (tmp);
+  return ret;
+}
+
+/* Marks the entry at path as just used */
+static void
+cache_entry_touch (const gchar *path)
+{
+  gchar *stamp;
+
+  stamp = g_strconcat (path, HD_PVR_TEXTURE_CACHE_STAMP_SUFFIX, NULL);
+  if (utime (stamp, NULL) != 0)
+    {
+      gint fd = g_open (stamp, O_WRONLY | O_CREAT, 0644);
+
+      if (fd != -1)
+        close (fd);
+    }
+  g_free (stamp);
+}
+
+/* When the entry at path was last used: its stamp if it has one, or
+ * when it was stored */
+static time_t
+cache_entry_used (const gchar       *path,
+                  const struct stat *st)
+{
+  struct stat stamp_st;
+  gchar *stamp;
+  time_t used = st->st_mtime;
+
+  stamp = g_strconcat (path, HD_PVR_TEXTURE_CACHE_STAMP_SUFFIX, NULL);
+  if (g_stat (stamp, &stamp_st) == 0)
+    used = MAX (used, stamp_st.st_mtime);
+  g_free (stamp);
+
+  return used;
+}
+
+/* Links the entry for key into place as file, if there is one */
+gboolean
+hd_pvr_texture_cache_fetch (const gchar *key,
+                            const gchar *file)
+{
+  gchar *path;
+  gboolean ret;
+
+  if (!key || !hd_pvr_texture_cache_dir)
+    return FALSE;
+
+  path = g_build_filename (hd_pvr_texture_cache_dir, key, NULL);
+  ret = g_file_test (path, G_FILE_TEST_IS_REGULAR) &&
+        link_or_copy (path, file);
+
+  if (ret)
+    {
+      cache_entry_touch (path);
+      g_atomic_int_inc (&hd_pvr_texture_cache_hits);
+    }
+  else
+    g_atomic_int_inc (&hd_pvr_texture_cache_misses);
+
+  g_free (path);
+  return ret;
+}
+
+static gint
+cache_entry_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  const CacheEntry *entry_a = a;
+  const CacheEntry *entry_b = b;
+
+  if (entry_a->used != entry_b->used)
+    return entry_a->used < entry_b->used ? -1 : 1;
+  return strcmp (entry_a->path, entry_b->path);
+}
+
+/* Whether the temporary file name, made by link_or_copy(), was left
+ * behind by a crash rather than being about to go in place. link() and
+ * creating a copy both set its ctime, so one that hasn't changed in a
+ * while is stale even if its pid has been reused */
+static gboolean
+cache_tmp_is_stale (const gchar       *name,
+                    const struct stat *st)
+{
+  const gchar *pid_start;
+  gchar *end;
+  glong pid;
+
+  if (time (NULL) - st->st_ctime > HD_PVR_TEXTURE_CACHE_TMP_MAX_AGE)
+    return TRUE;
+
+  /* "<entry>.<pid>-<n>.tmp" */
+  pid_start = strstr (name, HD_PVR_TEXTURE_CACHE_SUFFIX ".");
+  if (!pid_start)
+    return FALSE;
+  pid = strtol (pid_start + strlen (HD_PVR_TEXTURE_CACHE_SUFFIX "."), &end,
+                10);
+  if (*end != '-' || pid <= 0 || pid == getpid ())
+    return FALSE;
+
+  return kill ((pid_t) pid, 0) != 0 && errno == ESRCH;
+}
+
+/* Whether the stamp at path has lost the entry it was for */
+static gboolean
+cache_stamp_is_orphan (const gchar *path)
+{
+  gchar *entry_path;
+  gboolean ret;
+
+  entry_path = g_strndup (path, strlen (path) -
+                          strlen (HD_PVR_TEXTURE_CACHE_STAMP_SUFFIX));
+  ret = !g_file_test (entry_path, G_FILE_TEST_EXISTS);
+  g_free (entry_path);
+
+  return ret;
+}
+
+/* Removes the least recently used entries until the cache fits in its
+ * limit again. Temporary files left by a crash and stamps whose entry
+ * has gone are removed first, and the ones still in use count against
+ * the limit along with the entries */
+static void
+cache_evict (void)
+{
+  GDir *dir;
+  GArray *entries;
+  const gchar *name;
+  guint64 total = 0;
+  guint i;
+
+  dir = g_dir_open (hd_pvr_texture_cache_dir, 0, NULL);
+  if (!dir)
+    return;
+
+  entries = g_array_new (FALSE, FALSE, sizeof (CacheEntry));
+  while ((name = g_dir_read_name (dir)))
+    {
+      CacheEntry entry;
+      struct stat st;
+      gboolean is_tmp, is_stamp;
+
+      is_tmp = g_str_has_suffix (name, HD_PVR_TEXTURE_CACHE_TMP_SUFFIX);
+      is_stamp = g_str_has_suffix (name, HD_PVR_TEXTURE_CACHE_SUFFIX
+                                   HD_PVR_TEXTURE_CACHE_STAMP_SUFFIX);
+      if (!is_tmp && !is_stamp &&
+          !g_str_has_suffix (name, HD_PVR_TEXTURE_CACHE_SUFFIX))
+        continue;
+
+      entry.path = g_build_filename (hd_pvr_texture_cache_dir, name, NULL);
+      if (g_stat (entry.path, &st) != 0)
+        {
+          g_free (entry.path);
+          continue;
+        }
+
+      if (is_tmp || is_stamp)
+        {
+          gboolean stale = is_tmp ? cache_tmp_is_stale (name, &st)
+                                  : cache_stamp_is_orphan (entry.path);
+
+          if (!stale || g_unlink (entry.path) != 0)
+            total += st.st_size;
+          g_free (entry.path);
+          continue;
+        }
+
+      entry.size = st.st_size;
+      entry.used = cache_entry_used (entry.path, &st);
+      total += entry.size;
+      g_array_append_val (entries, entry);
+    }
+  g_dir_close (dir);
+
+  if (total > hd_pvr_texture_cache_max_size)
+    g_array_sort (entries, cache_entry_compare);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      CacheEntry *entry = &g_array_index (entries, CacheEntry, i);
+
+      if (total > hd_pvr_texture_cache_max_size &&
+          g_unlink (entry->path) == 0)
+        {
+          gchar *stamp = g_strconcat (entry->path,
+                                      HD_PVR_TEXTURE_CACHE_STAMP_SUFFIX,
+                                      NULL);
+
+          g_unlink (stamp);
+          g_free (stamp);
+          total -= entry->size;
+        }
+      g_free (entry->path);
+    }
+
+  g_array_free (entries, TRUE);
+}
+
+/* Adds the freshly saved file to the cache as the entry for key */
+void
+hd_pvr_texture_cache_store (const gchar *key,
+                            const gchar *file)
+{
+  gchar *path;
+
+  if (!key || !hd_pvr_texture_cache_dir)
+    return;
+
+  path = g_build_filename (hd_pvr_texture_cache_dir, key, NULL);
+  if (link_or_copy (file, path))
+    {
+      cache_entry_touch (path);
+      cache_evict ();
+    }
+  g_free (path);
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_PVR_TEXTURE_CACHE_H__
+#define __HD_PVR_TEXTURE_CACHE_H__
+
+/* Used by hd_pvr_texture_save_full to look up and fill the cache set up
+ * with hd_pvr_texture_cache_init */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gchar    *hd_pvr_texture_cache_key   (const guchar *pixels,
+                                      guint         width,
+                                      guint         height,
+                                      guint         rowstride,
+                                      guint         n_channels,
+                                      guint         format,
+                                      guint         flags);
+
+gboolean  hd_pvr_texture_cache_fetch (const gchar  *key,
+                                      const gchar  *file);
+
+void      hd_pvr_texture_cache_store (const gchar  *key,
+                                      const gchar  *file);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,633 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Texture packs: many PVR textures in one file, so that a set of small
+ * ones such as status icons costs one open and one mapping rather than
+ * one of each per texture.
+ *
+ * A pack is laid out as
+ *
+ *   PackHeader
+ *   PackEntry[n_textures], sorted by name
+ *   the names, each ending in a nul
+ *   the textures, each a whole .pvr file, header and all
+ *
+ * Each texture is placed so that its data, after its PVR header, starts
+ * on a multiple of the alignment in the PackHeader. Everything is in the
+ * byte order of the machine that wrote it, as PVR headers are.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hd-pvr-texture.h"
+#include "hd-pvr-texture-private.h"
+#include "pvr-texture.h"
+
+#define PACK_MAGIC   ('P' | 'V'<<8 | 'R'<<16 | 'P'<<24)
+#define PACK_VERSION 1
+/* where the data of each texture starts: enough for any vector unit, and
+ * for a cache line */
+#define PACK_ALIGNMENT 64
+
+typedef struct
+{
+  guint32 magic;       /* PACK_MAGIC */
+  guint32 version;     /* PACK_VERSION */
+  guint32 n_textures;
+  guint32 alignment;   /* of the data of each texture */
+  guint32 names_size;  /* of the name table, in bytes */
+} PackHeader;
+
+typedef struct
+{
+  guint32 name;        /* offset of the name in the name table */
+  guint32 offset;      /* of the texture's PVR header in the pack */
+  guint32 size;        /* of the texture, PVR header included */
+} PackEntry;
+
+struct _HDPvrTexturePack
+{
+  GMappedFile     *file;
+  const guchar    *data;
+  guint            n_textures;
+  const PackEntry *entries;
+  const gchar     *names;
+};
+
+/* A texture waiting to go in a pack */
+typedef struct
+{
+  gchar  *name;
+  guchar *data;
+  gsize   size;
+} PackTexture;
+
+struct _HDPvrTexturePackWriter
+{
+  GPtrArray             *textures;
+  /* for hd_pvr_texture_pack_writer_add_pixbuf, kept for the next pixbuf
+   * with the same settings */
+  HDPvrEncoder          *encoder;
+  HDPvrTextureFormat     format;
+  HDPvrTextureSaveFlags  flags;
+};
+
+/**
+ * hd_pvr_texture_pack_writer_new:
+ *
+ * Makes a writer for a texture pack: a single file holding many textures,
+ * each found by name. Add textures to it with
+ * hd_pvr_texture_pack_writer_add_file() and
+ * hd_pvr_texture_pack_writer_add_pixbuf(), then write it with
+ * hd_pvr_texture_pack_writer_save().
+ *
+ * Returns: the writer, to be freed with hd_pvr_texture_pack_writer_free()
+ */
+HDPvrTexturePackWriter *
+hd_pvr_texture_pack_writer_new (void)
+{
+  HDPvrTexturePackWriter *writer;
+
+  writer = g_new0 (HDPvrTexturePackWriter, 1);
+  writer->textures = g_ptr_array_new ();
+
+  return writer;
+}
+
+/**
+ * hd_pvr_texture_pack_writer_free:
+ * @writer: a #HDPvrTexturePackWriter
+ *
+ * Frees the writer, and the textures added to it.
+ */
+void
+hd_pvr_texture_pack_writer_free (HDPvrTexturePackWriter *writer)
+{
+  guint i;
+
+  g_return_if_fail (writer != NULL);
+
+  for (i = 0; i < writer->textures->len; i++)
+    {
+      PackTexture *texture = g_ptr_array_index (writer->textures, i);
+
+      g_free (texture->name);
+      g_free (texture->data);
+      g_free (texture);
+    }
+  g_ptr_array_free (writer->textures, TRUE);
+
+  if (writer->encoder)
+    hd_pvr_encoder_free (writer->encoder);
+  g_free (writer);
+}
+
+/* Checks data is a texture we can read, and if so takes it */
+static gboolean
+pack_writer_add (HDPvrTexturePackWriter  *writer,
+                 const gchar             *name,
+                 guchar                  *data,
+                 gsize                    size,
+                 GError                 **error)
+{
+  HDPvrTexture *check;
+  PackTexture *texture;
+
+  check = hd_pvr_texture_new_for_data (data, size, name, error);
+  if (!check)
+    {
+      g_free (data);
+      return FALSE;
+    }
+  hd_pvr_texture_free (check);
+
+  texture = g_new0 (PackTexture, 1);
+  texture->name = g_strdup (name);
+  texture->data = data;
+  texture->size = size;
+  g_ptr_array_add (writer->textures, texture);
+
+  return TRUE;
+}
+
+/**
+ * hd_pvr_texture_pack_writer_add_file:
+ * @writer: a #HDPvrTexturePackWriter
+ * @name: what to call the texture in the pack
+ * @file: a texture file, as written by hd_pvr_texture_save_full()
+ * @error: return location for a #GError, or %NULL
+ *
+ * Adds a copy of a texture file to the pack.
+ *
+ * Returns: %TRUE if @file is a texture that could be read
+ */
+gboolean
+hd_pvr_texture_pack_writer_add_file (HDPvrTexturePackWriter  *writer,
+                                     const gchar             *name,
+                                     const gchar             *file,
+                                     GError                 **error)
+{
+  GError *read_error = NULL;
+  gchar *data;
+  gsize size;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (name != NULL && *name, FALSE);
+  g_return_val_if_fail (file != NULL, FALSE);
+
+  if (!g_file_get_contents (file, &data, &size, &read_error))
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_OPEN,
+                   "Could not open %s", file, read_error->message);
+      g_error_free (read_error);
+      return FALSE;
+    }
+
+  return pack_writer_add (writer, name, (guchar *) data, size, error);
+}
+
+/**
+ * hd_pvr_texture_pack_writer_add_pixbuf:
+ * @writer: a #HDPvrTexturePackWriter
+ * @name: what to call the texture in the pack
+ * @pixbuf: the pixbuf to compress
+ * @format: as for hd_pvr_texture_save_full()
+ * @flags: as for hd_pvr_texture_save_full()
+ * @error: return location for a #GError, or %NULL
+ *
+ * Compresses @pixbuf and adds it to the pack, as if it had been saved
+ * with hd_pvr_texture_save_full() and then added with
+ * hd_pvr_texture_pack_writer_add_file().
+ *
+ * Returns: %TRUE if the pixbuf could be compressed
+ */
+gboolean
+hd_pvr_texture_pack_writer_add_pixbuf (HDPvrTexturePackWriter  *writer,
+                                       const gchar             *name,
+                                       GdkPixbuf               *pixbuf,
+                                       HDPvrTextureFormat       format,
+                                       HDPvrTextureSaveFlags    flags,
+                                       GError                 **error)
+{
+  const guchar *texture;
+  gsize size;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (name != NULL && *name, FALSE);
+  g_return_val_if_fail (GDK_IS_PIXBUF (pixbuf), FALSE);
+
+  if (writer->encoder &&
+      (writer->format != format || writer->flags != flags))
+    {
+      hd_pvr_encoder_free (writer->encoder);
+      writer->encoder = NULL;
+    }
+  if (!writer->encoder)
+    {
+      writer->encoder = hd_pvr_encoder_new (format, flags);
+      writer->format = format;
+      writer->flags = flags;
+    }
+
+  texture = hd_pvr_encoder_compress (writer->encoder, pixbuf, NULL, 0,
+                                     &size, error);
+  if (!texture)
+    return FALSE;
+
+  return pack_writer_add (writer, name, g_memdup (texture, size), size,
+                          error);
+}
+
+static gint
+pack_texture_compare (gconstpointer a,
+                      gconstpointer b)
+{
+  const PackTexture *texture_a = *(const PackTexture **) a;
+  const PackTexture *texture_b = *(const PackTexture **) b;
+
+  return strcmp (texture_a->name, texture_b->name);
+}
+
+/* Writes the pack to fd: the header, index and names in one go, then
+ * each texture after enough padding to align its data */
+static gboolean
+pack_writer_write (HDPvrTexturePackWriter  *writer,
+                   gint                     fd,
+                   const gchar             *file,
+                   GError                 **error)
+{
+  static const guchar zeros[PACK_ALIGNMENT];
+  GPtrArray *textures = writer->textures;
+  PackHeader *header;
+  PackEntry *entries;
+  gchar *names;
+  guchar *head;
+  gsize head_size, names_size = 0;
+  guint64 offset;
+  guint i;
+
+  for (i = 0; i < textures->len; i++)
+    {
+      PackTexture *texture = g_ptr_array_index (textures, i);
+
+      names_size += strlen (texture->name) + 1;
+    }
+
+  head_size = sizeof (PackHeader) + textures->len * sizeof (PackEntry) +
+              names_size;
+  head = g_malloc0 (head_size);
+  header = (PackHeader *) head;
+  entries = (PackEntry *) (head + sizeof (PackHeader));
+  names = (gchar *) (entries + textures->len);
+
+  header->magic = PACK_MAGIC;
+  header->version = PACK_VERSION;
+  header->n_textures = textures->len;
+  header->alignment = PACK_ALIGNMENT;
+  header->names_size = names_size;
+
+  offset = head_size;
+  for (i = 0; i < textures->len; i++)
+    {
+      PackTexture *texture = g_ptr_array_index (textures, i);
+      guint64 data_offset;
+
+      entries[i].name = names - (gchar *) (entries + textures->len);
+      strcpy (names, texture->name);
+      names += strlen (texture->name) + 1;
+
+      data_offset = offset + sizeof (PVR_TEXTURE_HEADER);
+      data_offset = (data_offset + PACK_ALIGNMENT - 1) &
+                    ~(guint64) (PACK_ALIGNMENT - 1);
+      entries[i].offset = data_offset - sizeof (PVR_TEXTURE_HEADER);
+      entries[i].size = texture->size;
+      offset = entries[i].offset + (guint64) texture->size;
+
+      if (offset > G_MAXUINT32)
+        {
+          g_set_error (error, hd_pvr_texture_error_quark (),
+                       HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+                       "%s would be more than 4GB", file);
+          g_free (head);
+          return FALSE;
+        }
+    }
+
+  if (!hd_pvr_texture_write_all (fd, head, head_size))
+    {
+      hd_pvr_texture_set_file_error (error, "Could not write %s", file);
+      g_free (head);
+      return FALSE;
+    }
+
+  offset = head_size;
+  for (i = 0; i < textures->len; i++)
+    {
+      PackTexture *texture = g_ptr_array_index (textures, i);
+
+      if (!hd_pvr_texture_write_all (fd, zeros, entries[i].offset - offset) ||
+          !hd_pvr_texture_write_all (fd, texture->data, texture->size))
+        {
+          hd_pvr_texture_set_file_error (error, "Could not write %s", file);
+          g_free (head);
+          return FALSE;
+        }
+      offset = entries[i].offset + texture->size;
+    }
+
+  g_free (head);
+  return TRUE;
+}
+
+/**
+ * hd_pvr_texture_pack_writer_save:
+ * @writer: a #HDPvrTexturePackWriter
+ * @file: the file to write the pack to
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes the textures added so far to @file as a pack, for
+ * hd_pvr_texture_pack_load(). The pack is written the way textures are,
+ * to a file that is synced before it replaces @file, so readers of @file
+ * see either the old pack or the whole new one.
+ *
+ * Returns: %TRUE if the pack was written
+ */
+gboolean
+hd_pvr_texture_pack_writer_save (HDPvrTexturePackWriter  *writer,
+                                 const gchar             *file,
+                                 GError                 **error)
+{
+  PvrTextureWriter *pack_file;
+  gboolean ret;
+  gint fd;
+  guint i;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (file != NULL, FALSE);
+
+  g_ptr_array_sort (writer->textures, pack_texture_compare);
+  for (i = 1; i < writer->textures->len; i++)
+    {
+      PackTexture *texture = g_ptr_array_index (writer->textures, i);
+
+      if (pack_texture_compare (&writer->textures->pdata[i - 1],
+                                &writer->textures->pdata[i]) == 0)
+        {
+          g_set_error (error, hd_pvr_texture_error_quark (),
+                       HD_PVR_TEXTURE_ERROR_INVALID,
+                       "There is more than one texture called %s",
+                       texture->name);
+          return FALSE;
+        }
+    }
+
+  pack_file = pvr_texture_writer_new (PVR_SYNC_IMMEDIATE);
+  fd = pvr_texture_writer_begin (pack_file, file, error);
+  ret = fd != -1;
+  if (ret && pack_writer_write (writer, fd, file, error))
+    ret = pvr_texture_writer_commit (pack_file, fd, error);
+  else if (ret)
+    {
+      pvr_texture_writer_abort (pack_file, fd);
+      ret = FALSE;
+    }
+  pvr_texture_writer_free (pack_file);
+
+  return ret;
+}
+
+/* Checks the header, index and names, so that lookups can trust them */
+static gboolean
+pack_check (HDPvrTexturePack  *pack,
+            gsize              length,
+            const gchar       *file,
+            GError           **error)
+{
+  PackHeader header;
+  guint64 names_offset, end;
+  guint i;
+
+  if (length < sizeof (header))
+    goto invalid;
+
+  memcpy (&header, pack->data, sizeof (header));
+  if (header.magic != PACK_MAGIC)
+    goto invalid;
+  if (header.version != PACK_VERSION)
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+                   "%s is a version %u texture pack, only version %u is "
+                   "supported", file, header.version, PACK_VERSION);
+      return FALSE;
+    }
+
+  names_offset = sizeof (header) +
+                 (guint64) header.n_textures * sizeof (PackEntry);
+  end = names_offset + header.names_size;
+  if (end > length ||
+      (header.names_size && pack->data[end - 1] != '\0') ||
+      (header.n_textures && !header.names_size) ||
+      header.alignment == 0 ||
+      (header.alignment & (header.alignment - 1)) != 0)
+    goto invalid;
+
+  pack->n_textures = header.n_textures;
+  pack->entries = (const PackEntry *) (pack->data + sizeof (header));
+  pack->names = (const gchar *) pack->data + names_offset;
+
+  for (i = 0; i < pack->n_textures; i++)
+    {
+      const PackEntry *entry = &pack->entries[i];
+
+      /* the textures come after the names, each with its data aligned,
+       * so none of them can be read from the index */
+      if (entry->name >= header.names_size ||
+          entry->offset < end ||
+          (guint64) entry->offset + entry->size > length ||
+          (entry->offset + sizeof (PVR_TEXTURE_HEADER)) %
+            header.alignment != 0 ||
+          (i > 0 && strcmp (pack->names + pack->entries[i - 1].name,
+                            pack->names + entry->name) >= 0))
+        goto invalid;
+    }
+
+  return TRUE;
+
+invalid:
+  g_set_error (error, hd_pvr_texture_error_quark (),
+               HD_PVR_TEXTURE_ERROR_INVALID,
+               "%s is not a valid texture pack", file);
+  return FALSE;
+}
+
+/**
+ * hd_pvr_texture_pack_load:
+ * @file: a pack written by hd_pvr_texture_pack_writer_save()
+ * @error: return location for a #GError, or %NULL
+ *
+ * Maps a texture pack into memory and checks its index. Its textures are
+ * then found with hd_pvr_texture_pack_lookup(), without reading or
+ * copying anything else.
+ *
+ * Returns: the pack, to be freed with hd_pvr_texture_pack_free(), or
+ * %NULL if the file could not be read or is not a texture pack
+ */
+HDPvrTexturePack *
+hd_pvr_texture_pack_load (const gchar  *file,
+                          GError      **error)
+{
+  HDPvrTexturePack *pack;
+  GError *map_error = NULL;
+
+  g_return_val_if_fail (file != NULL, NULL);
+
+  pack = g_new0 (HDPvrTexturePack, 1);
+  pack->file = g_mapped_file_new (file, FALSE, &map_error);
+  if (!pack->file)
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_OPEN,
+                   "Could not open %s: %s", file, map_error->message);
+      g_error_free (map_error);
+      g_free (pack);
+      return NULL;
+    }
+
+  pack->data = (const guchar *) g_mapped_file_get_contents (pack->file);
+  if (!pack_check (pack, g_mapped_file_get_length (pack->file), file, error))
+    {
+      hd_pvr_texture_pack_free (pack);
+      return NULL;
+    }
+
+  return pack;
+}
+
+/**
+ * hd_pvr_texture_pack_free:
+ * @pack: a pack from hd_pvr_texture_pack_load()
+ *
+ * Unmaps the pack. Textures from hd_pvr_texture_pack_lookup() must be
+ * freed first.
+ */
+void
+hd_pvr_texture_pack_free (HDPvrTexturePack *pack)
+{
+  if (!pack)
+    return;
+
+  if (pack->file)
+    g_mapped_file_free (pack->file);
+  g_free (pack);
+}
+
+/**
+ * hd_pvr_texture_pack_get_n_textures:
+ * @pack: a pack from hd_pvr_texture_pack_load()
+ *
+ * Returns: how many textures are in the pack
+ */
+guint
+hd_pvr_texture_pack_get_n_textures (HDPvrTexturePack *pack)
+{
+  g_return_val_if_fail (pack != NULL, 0);
+
+  return pack->n_textures;
+}
+
+/**
+ * hd_pvr_texture_pack_get_name:
+ * @pack: a pack from hd_pvr_texture_pack_load()
+ * @index: which texture, from 0 to one less than
+ * hd_pvr_texture_pack_get_n_textures()
+ *
+ * Gets the name of a texture, for listing the pack. The names are in
+ * strcmp() order.
+ *
+ * Returns: the name, which belongs to @pack
+ */
+const gchar *
+hd_pvr_texture_pack_get_name (HDPvrTexturePack *pack,
+                              guint             index)
+{
+  g_return_val_if_fail (pack != NULL, NULL);
+  g_return_val_if_fail (index < pack->n_textures, NULL);
+
+  return pack->names + pack->entries[index].name;
+}
+
+/**
+ * hd_pvr_texture_pack_lookup:
+ * @pack: a pack from hd_pvr_texture_pack_load()
+ * @name: the name the texture was added with
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finds a texture in the pack by a binary search of its index. The
+ * texture is a view of the pack: hd_pvr_texture_get_level() gives
+ * pointers straight into it, as it does for hd_pvr_texture_load().
+ *
+ * Returns: the texture, to be freed with hd_pvr_texture_free() before
+ * @pack is, or %NULL if there is none called @name
+ */
+HDPvrTexture *
+hd_pvr_texture_pack_lookup (HDPvrTexturePack  *pack,
+                            const gchar       *name,
+                            GError           **error)
+{
+  guint low, high;
+
+  g_return_val_if_fail (pack != NULL, NULL);
+  g_return_val_if_fail (name != NULL, NULL);
+
+  low = 0;
+  high = pack->n_textures;
+  while (low < high)
+    {
+      guint mid = low + (high - low) / 2;
+      const PackEntry *entry = &pack->entries[mid];
+      gint cmp = strcmp (name, pack->names + entry->name);
+
+      if (cmp == 0)
+        return hd_pvr_texture_new_for_data (pack->data + entry->offset,
+                                            entry->size, name, error);
+      if (cmp < 0)
+        high = mid;
+      else
+        low = mid + 1;
+    }
+
+  g_set_error (error, hd_pvr_texture_error_quark (),
+               HD_PVR_TEXTURE_ERROR_NOT_FOUND,
+               "There is no texture called %s in the pack", name);
+  return NULL;
+}
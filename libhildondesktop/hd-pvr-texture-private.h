@@ -0,0 +1,64 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_PVR_TEXTURE_PRIVATE_H__
+#define __HD_PVR_TEXTURE_PRIVATE_H__
+
+/* Parts of hd-pvr-texture.c used by the rest of the hd_pvr_texture API,
+ * but not by applications */
+
+#include "hd-pvr-texture.h"
+#include "pvr-texture.h"
+
+G_BEGIN_DECLS
+
+HDPvrEncoder *hd_pvr_encoder_new_with_threads (HDPvrTextureFormat    format,
+                                               HDPvrTextureSaveFlags flags,
+                                               guint                 n_threads);
+
+HDPvrTexture *hd_pvr_texture_new_for_data     (const guchar          *data,
+                                               gsize                  length,
+                                               const gchar           *name,
+                                               GError               **error);
+
+gboolean      hd_pvr_texture_check_header     (const PVR_TEXTURE_HEADER *head,
+                                               const gchar           *name,
+                                               gsize                 *length,
+                                               GError               **error);
+
+gboolean      hd_pvr_texture_decode_with_threads (HDPvrTexture       *texture,
+                                                  guint               level,
+                                                  guchar             *pixels,
+                                                  guint               rowstride,
+                                                  guint               n_threads,
+                                                  GError            **error);
+
+gboolean      hd_pvr_texture_write_all        (gint                   fd,
+                                               const guchar          *data,
+                                               gsize                  size);
+
+void          hd_pvr_texture_set_file_error   (GError               **error,
+                                               const gchar           *message,
+                                               const gchar           *filename);
+
+G_END_DECLS
+
+#endif
@@ -26,166 +26,1354 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "hd-pvr-texture.h"
+#include "hd-pvr-texture-cache.h"
+#include "hd-pvr-texture-private.h"
 #include "pvr-texture.h"
 
-/* Save the given pixbuf as a PVRTC4 texture. PVRTC4 textures must be 2^n
- * in width and height, so any texture not of these dimensions will be
- * padded with black (zero alpha if alpha is used).
+/* One level of a loaded texture, pointing into the mapped file */
+typedef struct
+{
+  const guchar *data;
+  gsize         size;
+  guint         width;
+  guint         height;
+  gint          data_width;
+  gint          data_height;
+} HDPvrTextureLevel;
+
+struct _HDPvrTexture
+{
+  GMappedFile       *file;
+  PvrFormat          format;
+  guint              n_levels;
+  HDPvrTextureLevel *levels;
+};
+
+struct _HDPvrEncoder
+{
+  PvrTextureEncoder     *encoder;
+  HDPvrTextureFormat     format;
+  HDPvrTextureSaveFlags  flags;
+  /* where textures go if the caller doesn't say, grown as needed */
+  guchar                *buffer;
+  gsize                  buffer_size;
+};
+
+/* All the background saves of one file. Only the newest may replace it;
+ * the older ones give up as soon as they notice */
+typedef struct
+{
+  gchar  *file;
+  guint   n_jobs;
+  gint    generation;
+  /* held while a save puts its texture in place */
+  GMutex *commit_lock;
+} SaveSlot;
+
+/* A save running in the background, from hd_pvr_texture_save_async */
+typedef struct
+{
+  gint                      ref_count;
+  gchar                    *file;
+  GdkPixbuf                *pixbuf;
+  HDPvrTextureFormat        format;
+  HDPvrTextureSaveFlags     flags;
+  GCancellable             *cancellable;
+  HDPvrTextureProgressFunc  progress_callback;
+  gpointer                  progress_data;
+  /* the latest fraction done, in millionths, and whether the main loop
+   * has yet to be told it */
+  gint                      progress;
+  gint                      progress_pending;
+  /* the other saves of the same file, and which of them this is */
+  SaveSlot                 *slot;
+  gint                      generation;
+} SaveJob;
+
+#define SAVE_JOB_PROGRESS_SCALE 1000000
+
+G_LOCK_DEFINE_STATIC (save_slots);
+static GHashTable *save_slots = NULL;
+
+GQuark
+hd_pvr_texture_error_quark (void)
+{
+  return g_quark_from_static_string ("hd-pvr-texture-error-quark");
+}
+
+/* TRUE if every pixel of the pixbuf is opaque */
+static gboolean
+pixbuf_is_opaque (GdkPixbuf *pixbuf)
+{
+  guint width, height, rowstride, x, y;
+  const guchar *pixels;
+
+  if (!gdk_pixbuf_get_has_alpha (pixbuf))
+    return TRUE;
+
+  width     = gdk_pixbuf_get_width (pixbuf);
+  height    = gdk_pixbuf_get_height (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  pixels    = gdk_pixbuf_get_pixels (pixbuf);
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      if (pixels[y*rowstride + x*4 + 3] != 255)
+        return FALSE;
+
+  return TRUE;
+}
+
+/* The codec settings for the given flags */
+static void
+save_options_init (PvrTextureOptions      *options,
+                   HDPvrTextureSaveFlags   flags)
+{
+  /* An ordered dither carries nothing from block to block, so the rows
+   * can be shared out between all CPUs */
+  pvr_texture_options_init (options);
+  options->dither = PVR_DITHER_ORDERED;
+  options->mipmaps = (flags & HD_PVR_TEXTURE_SAVE_MIPMAPS) != 0;
+  if (flags & HD_PVR_TEXTURE_SAVE_FAST)
+    {
+      options->quality = PVR_QUALITY_FAST;
+      options->etc1_mode = PVR_ETC1_FAST;
+    }
+}
+
+/* The codec format to save the pixbuf in */
+static PvrFormat
+save_format (GdkPixbuf          *pixbuf,
+             HDPvrTextureFormat  format)
+{
+  if (format == HD_PVR_TEXTURE_FORMAT_AUTO)
+    format = pixbuf_is_opaque (pixbuf) ? HD_PVR_TEXTURE_FORMAT_ETC1 :
+                                         HD_PVR_TEXTURE_FORMAT_PVRTC4;
+  switch (format)
+    {
+    case HD_PVR_TEXTURE_FORMAT_PVRTC2:
+      return PVR_FORMAT_PVRTC2;
+    case HD_PVR_TEXTURE_FORMAT_ETC1:
+      return PVR_FORMAT_ETC1;
+    default:
+      return PVR_FORMAT_PVRTC4;
+    }
+}
+
+/* Save the given pixbuf as a compressed texture - ETC1 if it is opaque,
+ * otherwise PVRTC4. PVRTC4 textures must be 2^n in width and height, so
+ * any texture not of these dimensions is padded by repeating its edges
+ * and then wrapping around.
+ *
+ * Compression is spread over the CPUs, which needs g_thread_init () to
+ * have been called first; without it the texture is compressed on one
+ * thread.
  */
 gboolean
 hd_pvr_texture_save (const gchar  *file,
                      GdkPixbuf    *pixbuf,
                      GError      **error)
 {
-  guint width, height, bpp;
-  guint compress_width, compress_height;
-  guchar *compressed = 0;
-  const guchar *pixels = 0;
-  const guchar *uncompressed = 0;
-  guchar *allocated = 0;
-  guint compressed_size = 0;
+  return hd_pvr_texture_save_full (file, pixbuf,
+                                   HD_PVR_TEXTURE_FORMAT_AUTO,
+                                   HD_PVR_TEXTURE_SAVE_DEFAULT, error);
+}
 
-  if (!file || !pixbuf)
+static SaveJob *
+save_job_ref (SaveJob *job)
+{
+  g_atomic_int_inc (&job->ref_count);
+  return job;
+}
+
+static void
+save_job_unref (gpointer data)
+{
+  SaveJob *job = data;
+
+  if (!g_atomic_int_dec_and_test (&job->ref_count))
+    return;
+
+  g_free (job->file);
+  g_object_unref (job->pixbuf);
+  if (job->cancellable)
+    g_object_unref (job->cancellable);
+  g_free (job);
+}
+
+/* Joins the saves of job->file, superseding all the earlier ones */
+static void
+save_job_join_slot (SaveJob *job)
+{
+  SaveSlot *slot;
+
+  G_LOCK (save_slots);
+
+  if (!save_slots)
+    save_slots = g_hash_table_new (g_str_hash, g_str_equal);
+
+  slot = g_hash_table_lookup (save_slots, job->file);
+  if (!slot)
+    {
+      slot = g_new0 (SaveSlot, 1);
+      slot->file = g_strdup (job->file);
+      slot->commit_lock = g_mutex_new ();
+      g_hash_table_insert (save_slots, slot->file, slot);
+    }
+
+  slot->n_jobs++;
+  job->slot = slot;
+  job->generation = g_atomic_int_exchange_and_add (&slot->generation, 1) + 1;
+
+  G_UNLOCK (save_slots);
+}
+
+static void
+save_job_leave_slot (SaveJob *job)
+{
+  SaveSlot *slot = job->slot;
+
+  G_LOCK (save_slots);
+
+  if (--slot->n_jobs == 0)
+    {
+      g_hash_table_remove (save_slots, slot->file);
+      g_mutex_free (slot->commit_lock);
+      g_free (slot->file);
+      g_free (slot);
+    }
+  job->slot = NULL;
+
+  G_UNLOCK (save_slots);
+}
+
+/* TRUE if the job has been cancelled, or a newer save of the same file
+ * has started */
+static gboolean
+save_job_is_outdated (SaveJob *job)
+{
+  return (job->cancellable && g_cancellable_is_cancelled (job->cancellable)) ||
+         g_atomic_int_get (&job->slot->generation) != job->generation;
+}
+
+static void
+save_job_set_cancelled (SaveJob  *job,
+                        GError  **error)
+{
+  if (job->cancellable &&
+      g_cancellable_set_error_if_cancelled (job->cancellable, error))
+    return;
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+               "Saving %s was superseded by a newer save", job->file);
+}
+
+static gboolean
+save_job_report_progress (gpointer data)
+{
+  SaveJob *job = data;
+
+  g_atomic_int_set (&job->progress_pending, FALSE);
+  job->progress_callback ((gdouble) g_atomic_int_get (&job->progress) /
+                          SAVE_JOB_PROGRESS_SCALE,
+                          job->progress_data);
+
+  return FALSE;
+}
+
+/* Called by the encoder after each band of blocks. The main loop only
+ * hears of the latest fraction, however many bands it missed */
+static gboolean
+save_job_progress (gdouble  fraction,
+                   gpointer data)
+{
+  SaveJob *job = data;
+
+  if (save_job_is_outdated (job))
     return FALSE;
 
+  if (job->progress_callback)
+    {
+      g_atomic_int_set (&job->progress, fraction * SAVE_JOB_PROGRESS_SCALE);
+      /* the same priority as the completion, so they come in order */
+      if (g_atomic_int_compare_and_exchange (&job->progress_pending,
+                                             FALSE, TRUE))
+        g_idle_add_full (G_PRIORITY_DEFAULT, save_job_report_progress,
+                         save_job_ref (job), save_job_unref);
+    }
+
+  return TRUE;
+}
+
+/* Takes the commit lock if the job is still wanted, so that it can put
+ * its texture in place without an older save overwriting it after */
+static gboolean
+save_job_begin_commit (SaveJob  *job,
+                       GError  **error)
+{
+  if (!job)
+    return TRUE;
+
+  g_mutex_lock (job->slot->commit_lock);
+  if (!save_job_is_outdated (job))
+    return TRUE;
+
+  g_mutex_unlock (job->slot->commit_lock);
+  save_job_set_cancelled (job, error);
+  return FALSE;
+}
+
+static void
+save_job_end_commit (SaveJob *job)
+{
+  if (job)
+    g_mutex_unlock (job->slot->commit_lock);
+}
+
+/* Saves the pixbuf, for hd_pvr_texture_save_full() if job is NULL, or
+ * else in the background for hd_pvr_texture_save_async() */
+static gboolean
+save_pixbuf (const gchar            *file,
+             GdkPixbuf              *pixbuf,
+             HDPvrTextureFormat      format,
+             HDPvrTextureSaveFlags   flags,
+             SaveJob                *job,
+             GError                **error)
+{
+  guint width, height, bpp, rowstride;
+  const guchar *pixels = 0;
+  PvrTextureOptions options;
+  PvrFormat pvr_format;
+  PvrStreamEncoder *encoder;
+  GError *encode_error = NULL;
+  gchar *cache_key;
+  gboolean ret;
+
   width           = gdk_pixbuf_get_width (pixbuf);
   height          = gdk_pixbuf_get_height (pixbuf);
   bpp             = gdk_pixbuf_get_bits_per_sample (pixbuf) *
                     gdk_pixbuf_get_n_channels (pixbuf);
+  rowstride       = gdk_pixbuf_get_rowstride (pixbuf);
   pixels          = gdk_pixbuf_get_pixels (pixbuf);
-  uncompressed    = pixels;
 
   /* GDK usually only returns 8 bit pixels. this is all we want to deal with */
   if (bpp != 32 && bpp != 24)
     return FALSE;
 
-  /* work out what size width + height we need */
-  compress_width = 4;
-  compress_height = 4;
-  while (compress_width < width)
-    compress_width *= 2;
-  while (compress_height < height)
-    compress_height *= 2;
-
-  /* If we had to change something, we need to allocate another memory
-   * area and copy the data across */
-  if (bpp == 24 || compress_width!=width || compress_height!=height)
-    {
-      gint x, y;
-      guchar *uc;
-      const guchar *p;
-      uncompressed = uc = allocated = g_malloc(4*compress_width*compress_height);
-      p = pixels;
-      /* Copy, padding the right-hand edge with the last colour value, then the
-       * first. Poor-man's tiling */
-      if (bpp == 24)
+  /* the same pixels saved the same way before? */
+  cache_key = hd_pvr_texture_cache_key (pixels, width, height, rowstride,
+                                        bpp / 8, format, flags);
+  if (cache_key)
+    {
+      if (!save_job_begin_commit (job, error))
         {
-          /* for 24 bit we have to loop over everything as we need to pad
-           * it all out */
-          for (y=0;y<height;y++)
-            {
-              const guchar *line_start = p;
-              guint mid = (compress_width+width)/2;
-              for (x=0;x<width;x++)
-                {
-                  uc[0] = p[0];
-                  uc[1] = p[1];
-                  uc[2] = p[2];
-                  uc[3] = 255;
-                  uc += 4;
-                  p += 3;
-                }
-              for (x=width;x<mid;x++)
-                {
-                  uc[0] = p[-3];
-                  uc[1] = p[-2];
-                  uc[2] = p[-1];
-                  uc[3] = 255;
-                  uc += 4;
-                }
-              for (x=mid;x<compress_width;x++)
-                {
-                  uc[0] = line_start[0];
-                  uc[1] = line_start[1];
-                  uc[2] = line_start[2];
-                  uc[3] = 255;
-                  uc += 4;
-                }
-            }
+          g_free (cache_key);
+          return FALSE;
         }
-      else
+      ret = hd_pvr_texture_cache_fetch (cache_key, file);
+      save_job_end_commit (job);
+      if (ret)
         {
-          /* for 32 bit we just do memcpy's */
-          for (y=0;y<height;y++)
-            {
-              const guchar *line_start = p;
-              guint mid = (compress_width+width)/2;
-
-              memcpy(uc, p, width*4);
-              uc += width*4;
-              p += width*4;
-
-              for (x=width;x<mid;x++)
-                {
-                  memcpy(uc, &p[-4], 4);
-                  uc += 4;
-                }
-              for (x=mid;x<compress_width;x++)
-                {
-                  memcpy(uc, line_start, 4);
-                  uc += 4;
-                }
-            }
+          g_free (cache_key);
+          return TRUE;
         }
-      /* Now pad the last few lines by copying the last line
-       * over and over */
-      guint mid = (compress_height+height)/2;
-      for (y=height;y<mid;y++)
+    }
+
+  save_options_init (&options, flags);
+  if (job)
+    {
+      options.progress = save_job_progress;
+      options.progress_data = job;
+    }
+
+  pvr_format = save_format (pixbuf, format);
+
+  /* The encoder pads the image out to 2^n itself and only keeps a band of
+   * rows in memory at once, so we can hand it the pixbuf as it is */
+  encoder = pvr_texture_stream_encoder_new (file, pvr_format,
+                                            width, height, bpp / 8,
+                                            &options, error);
+  if (!encoder)
+    {
+      g_free (cache_key);
+      return FALSE;
+    }
+
+  if (!pvr_texture_stream_encoder_write_rows (encoder, pixels, rowstride,
+                                              height, &encode_error))
+    {
+      pvr_texture_stream_encoder_abort (encoder);
+      /* no error means the job stopped it */
+      if (encode_error)
+        g_propagate_error (error, encode_error);
+      else if (job)
+        save_job_set_cancelled (job, error);
+      g_free (cache_key);
+      return FALSE;
+    }
+
+  if (!save_job_begin_commit (job, error))
+    {
+      pvr_texture_stream_encoder_abort (encoder);
+      g_free (cache_key);
+      return FALSE;
+    }
+
+  ret = pvr_texture_stream_encoder_finish (encoder, error);
+  if (ret)
+    hd_pvr_texture_cache_store (cache_key, file);
+
+  save_job_end_commit (job);
+
+  g_free (cache_key);
+  return ret;
+}
+
+/* As hd_pvr_texture_save, but in the given format. With
+ * HD_PVR_TEXTURE_SAVE_MIPMAPS a chain of mipmaps is written after the
+ * texture, so that scaled down views of it don't have to sample the whole
+ * thing. The mipmaps are made from the padded texture as the rows are
+ * compressed, so this is still one pass over the pixbuf.
+ */
+gboolean
+hd_pvr_texture_save_full (const gchar            *file,
+                          GdkPixbuf              *pixbuf,
+                          HDPvrTextureFormat      format,
+                          HDPvrTextureSaveFlags   flags,
+                          GError                **error)
+{
+  if (!file || !pixbuf)
+    return FALSE;
+
+  return save_pixbuf (file, pixbuf, format, flags, NULL, error);
+}
+
+static void
+save_job_run (GSimpleAsyncResult *result,
+              GObject            *object,
+              GCancellable       *cancellable)
+{
+  SaveJob *job = g_simple_async_result_get_op_res_gpointer (result);
+  GError *error = NULL;
+
+  /* queued behind a newer save of the same file? */
+  if (save_job_is_outdated (job))
+    save_job_set_cancelled (job, &error);
+  else if (!save_pixbuf (job->file, job->pixbuf, job->format, job->flags,
+                         job, &error) && !error)
+    g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "Could not save %s as a texture", job->file);
+
+  if (error)
+    {
+      g_simple_async_result_set_from_error (result, error);
+      g_error_free (error);
+    }
+
+  save_job_leave_slot (job);
+}
+
+/**
+ * hd_pvr_texture_save_async:
+ * @file: the file to save to
+ * @pixbuf: the pixbuf to save, which must not change until the save
+ * has finished
+ * @format: as for hd_pvr_texture_save_full()
+ * @flags: as for hd_pvr_texture_save_full()
+ * @io_priority: where the save goes in the queue of background work, such
+ * as %G_PRIORITY_DEFAULT
+ * @cancellable: a #GCancellable, or %NULL
+ * @progress_callback: called in the main loop as the texture is
+ * compressed, or %NULL
+ * @progress_data: data for @progress_callback
+ * @callback: called in the main loop when the save is done
+ * @user_data: data for @callback
+ *
+ * Saves @pixbuf like hd_pvr_texture_save_full(), but in another thread,
+ * so that the main loop carries on while it is compressed and synced.
+ * The compression stops between bands of blocks as soon as @cancellable
+ * is cancelled, leaving @file as it was.
+ *
+ * Starting another save of the same @file supersedes this one: it stops
+ * in the same way, and finishes with %G_IO_ERROR_CANCELLED. So there is
+ * no need to keep track of saves that are out of date; just save again.
+ *
+ * Call hd_pvr_texture_save_finish() from @callback for the result.
+ */
+void
+hd_pvr_texture_save_async (const gchar              *file,
+                           GdkPixbuf                *pixbuf,
+                           HDPvrTextureFormat        format,
+                           HDPvrTextureSaveFlags     flags,
+                           gint                      io_priority,
+                           GCancellable             *cancellable,
+                           HDPvrTextureProgressFunc  progress_callback,
+                           gpointer                  progress_data,
+                           GAsyncReadyCallback       callback,
+                           gpointer                  user_data)
+{
+  GSimpleAsyncResult *result;
+  SaveJob *job;
+
+  g_return_if_fail (file != NULL);
+  g_return_if_fail (GDK_IS_PIXBUF (pixbuf));
+
+  job = g_new0 (SaveJob, 1);
+  job->ref_count = 1;
+  job->file = g_strdup (file);
+  job->pixbuf = g_object_ref (pixbuf);
+  job->format = format;
+  job->flags = flags;
+  job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  job->progress_callback = progress_callback;
+  job->progress_data = progress_data;
+  save_job_join_slot (job);
+
+  result = g_simple_async_result_new (NULL, callback, user_data,
+                                      hd_pvr_texture_save_async);
+  g_simple_async_result_set_op_res_gpointer (result, job, save_job_unref);
+  /* save_job_run reports cancelling itself, and has to run to leave the
+   * slot */
+  g_simple_async_result_set_handle_cancellation (result, FALSE);
+  g_simple_async_result_run_in_thread (result, save_job_run,
+                                       io_priority, cancellable);
+  g_object_unref (result);
+}
+
+/**
+ * hd_pvr_texture_save_finish:
+ * @result: the #GAsyncResult given to the callback
+ * @error: return location for an error, or %NULL
+ *
+ * Finishes a save started with hd_pvr_texture_save_async().
+ *
+ * Returns: %TRUE if the texture was saved
+ */
+gboolean
+hd_pvr_texture_save_finish (GAsyncResult  *result,
+                            GError       **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  g_return_val_if_fail (g_simple_async_result_get_source_tag (simple) ==
+                        hd_pvr_texture_save_async, FALSE);
+
+  return !g_simple_async_result_propagate_error (simple, error);
+}
+
+/**
+ * hd_pvr_encoder_new:
+ * @format: the format to compress to
+ * @flags: as for hd_pvr_texture_save_full()
+ *
+ * Makes an encoder for compressing a lot of pixbufs into memory one after
+ * another, such as thumbnails or icons. It keeps its threads and buffers
+ * from one pixbuf to the next, so once it has done the biggest it makes
+ * no more allocations.
+ *
+ * Returns: the encoder, to be freed with hd_pvr_encoder_free()
+ */
+HDPvrEncoder *
+hd_pvr_encoder_new (HDPvrTextureFormat    format,
+                    HDPvrTextureSaveFlags flags)
+{
+  return hd_pvr_encoder_new_with_threads (format, flags, 0);
+}
+
+/* As hd_pvr_encoder_new, but compressing each texture with n_threads
+ * threads, or one per CPU for 0. The batch compressor gives its workers
+ * one each, as it already has a texture going on every CPU */
+HDPvrEncoder *
+hd_pvr_encoder_new_with_threads (HDPvrTextureFormat    format,
+                                 HDPvrTextureSaveFlags flags,
+                                 guint                 n_threads)
+{
+  HDPvrEncoder *encoder;
+  PvrTextureOptions options;
+
+  save_options_init (&options, flags);
+  options.n_threads = n_threads;
+
+  encoder = g_new0 (HDPvrEncoder, 1);
+  encoder->encoder = pvr_texture_encoder_new (&options);
+  encoder->format = format;
+  encoder->flags = flags;
+
+  return encoder;
+}
+
+/**
+ * hd_pvr_encoder_free:
+ * @encoder: a #HDPvrEncoder
+ *
+ * Frees the encoder, and the texture it last compressed into its own
+ * buffer.
+ */
+void
+hd_pvr_encoder_free (HDPvrEncoder *encoder)
+{
+  g_return_if_fail (encoder != NULL);
+
+  pvr_texture_encoder_free (encoder->encoder);
+  g_free (encoder->buffer);
+  g_free (encoder);
+}
+
+/* Checks the pixbuf is one we can compress */
+static gboolean
+encoder_check_pixbuf (GdkPixbuf  *pixbuf,
+                      GError    **error)
+{
+  if (gdk_pixbuf_get_bits_per_sample (pixbuf) == 8 &&
+      (gdk_pixbuf_get_n_channels (pixbuf) == 3 ||
+       gdk_pixbuf_get_n_channels (pixbuf) == 4))
+    return TRUE;
+
+  g_set_error (error, hd_pvr_texture_error_quark (),
+               HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+               "Only 8 bit RGB and RGBA pixbufs can be compressed");
+  return FALSE;
+}
+
+/**
+ * hd_pvr_encoder_get_size:
+ * @encoder: a #HDPvrEncoder
+ * @pixbuf: a pixbuf
+ *
+ * Returns: the size of buffer hd_pvr_encoder_compress() needs for
+ * @pixbuf
+ */
+gsize
+hd_pvr_encoder_get_size (HDPvrEncoder *encoder,
+                         GdkPixbuf    *pixbuf)
+{
+  g_return_val_if_fail (encoder != NULL, 0);
+  g_return_val_if_fail (GDK_IS_PIXBUF (pixbuf), 0);
+
+  return pvr_texture_encoder_get_size (encoder->encoder,
+                                       save_format (pixbuf, encoder->format),
+                                       gdk_pixbuf_get_width (pixbuf),
+                                       gdk_pixbuf_get_height (pixbuf));
+}
+
+/**
+ * hd_pvr_encoder_compress:
+ * @encoder: a #HDPvrEncoder
+ * @pixbuf: the pixbuf to compress
+ * @buffer: where to put the texture, or %NULL to use the encoder's own
+ * buffer. It must be 4 byte aligned, as anything from g_malloc() is
+ * @buffer_size: how big @buffer is
+ * @size: return location for the size of the texture, or %NULL
+ * @error: return location for an error, or %NULL
+ *
+ * Compresses @pixbuf into a PVR texture in memory, the same as the file
+ * hd_pvr_texture_save_full() would write. If @buffer is %NULL the texture
+ * is put in a buffer belonging to the encoder, which is overwritten by
+ * the next call.
+ *
+ * Returns: the texture, or %NULL if the pixbuf can't be compressed or
+ * @buffer is too small
+ */
+const guchar *
+hd_pvr_encoder_compress (HDPvrEncoder  *encoder,
+                         GdkPixbuf     *pixbuf,
+                         guchar        *buffer,
+                         gsize          buffer_size,
+                         gsize         *size,
+                         GError       **error)
+{
+  PvrFormat format;
+  gsize needed;
+
+  g_return_val_if_fail (encoder != NULL, NULL);
+  g_return_val_if_fail (GDK_IS_PIXBUF (pixbuf), NULL);
+
+  if (!encoder_check_pixbuf (pixbuf, error))
+    return NULL;
+
+  format = save_format (pixbuf, encoder->format);
+  needed = pvr_texture_encoder_get_size (encoder->encoder, format,
+                                         gdk_pixbuf_get_width (pixbuf),
+                                         gdk_pixbuf_get_height (pixbuf));
+
+  if (!buffer)
+    {
+      if (needed > encoder->buffer_size)
+        {
+          g_free (encoder->buffer);
+          encoder->buffer = g_malloc (needed);
+          encoder->buffer_size = needed;
+        }
+      buffer = encoder->buffer;
+      buffer_size = encoder->buffer_size;
+    }
+
+  if (buffer_size < needed)
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_NO_SPACE,
+                   "The texture needs %lu bytes, but there are only %lu",
+                   (gulong) needed, (gulong) buffer_size);
+      return NULL;
+    }
+
+  if (!pvr_texture_encoder_compress (encoder->encoder, format,
+                                     gdk_pixbuf_get_pixels (pixbuf),
+                                     gdk_pixbuf_get_width (pixbuf),
+                                     gdk_pixbuf_get_height (pixbuf),
+                                     gdk_pixbuf_get_rowstride (pixbuf),
+                                     gdk_pixbuf_get_n_channels (pixbuf),
+                                     buffer))
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_UNKNOWN,
+                   "Could not compress the texture");
+      return NULL;
+    }
+
+  if (size)
+    *size = needed;
+  return buffer;
+}
+
+/* One size being made by hd_pvr_texture_save_variants, box filtered
+ * from the rows of the pixbuf as they go past */
+typedef struct
+{
+  PvrStreamEncoder *encoder;
+  guint             width;
+  guint             x_step;
+  guint             y_step;
+  guint             n_summed;
+  guint32          *sums;
+  guchar           *row;
+} SaveVariant;
+
+/* Source rows are handed to every size in bands of this many, so each is
+ * still in the cache when the smaller sizes read it */
+#define SAVE_VARIANTS_BAND_ROWS 16
+
+/* Adds a row of the pixbuf to the variant's box filter, and passes the
+ * variant's row to its encoder once it has been summed */
+static gboolean
+save_variant_add_row (SaveVariant   *variant,
+                      const guchar  *src,
+                      guint          n_channels,
+                      GError       **error)
+{
+  guint32 *sum = variant->sums;
+  guint n_values = variant->width * n_channels;
+  guint n, x, k, c;
+
+  for (x = 0; x < variant->width; x++, sum += n_channels)
+    for (k = 0; k < variant->x_step; k++, src += n_channels)
+      for (c = 0; c < n_channels; c++)
+        sum[c] += src[c];
+
+  if (++variant->n_summed < variant->y_step)
+    return TRUE;
+
+  n = variant->x_step * variant->y_step;
+  for (x = 0; x < n_values; x++)
+    variant->row[x] = (variant->sums[x] + n / 2) / n;
+  memset (variant->sums, 0, n_values * sizeof (guint32));
+  variant->n_summed = 0;
+
+  return pvr_texture_stream_encoder_write_rows (variant->encoder,
+                                                variant->row, n_values,
+                                                1, error);
+}
+
+/**
+ * hd_pvr_texture_save_variants:
+ * @pixbuf: the pixbuf to save
+ * @variants: the sizes to save it at, and where to
+ * @n_variants: how many sizes there are
+ * @format: as for hd_pvr_texture_save_full()
+ * @flags: as for hd_pvr_texture_save_full()
+ * @error: return location for a #GError, or %NULL
+ *
+ * Saves @pixbuf at several sizes, such as a background at full, half and
+ * quarter size for previews, in one pass over its pixels. Each size must
+ * be the size of @pixbuf divided by a whole number, and is box filtered
+ * down from it. The rows of each size go straight to its own encoder as
+ * they are made, so there is never a scaled copy of the whole pixbuf.
+ * Each file is the same as hd_pvr_texture_save_full() would write for
+ * the box filtered pixbuf; the format for %HD_PVR_TEXTURE_FORMAT_AUTO is
+ * picked once, from @pixbuf.
+ *
+ * The files are synced to disk together once they are all written, and
+ * if anything fails before then none of them are changed.
+ *
+ * Returns: %TRUE if every size was saved
+ */
+gboolean
+hd_pvr_texture_save_variants (GdkPixbuf                  *pixbuf,
+                              const HDPvrTextureVariant  *variants,
+                              guint                       n_variants,
+                              HDPvrTextureFormat          format,
+                              HDPvrTextureSaveFlags       flags,
+                              GError                    **error)
+{
+  PvrTextureOptions options;
+  PvrTextureWriter *writer;
+  PvrFormat pvr_format;
+  SaveVariant *sizes;
+  const guchar *pixels;
+  guint width, height, rowstride, n_channels;
+  guint i, y, band;
+  gboolean ret = TRUE;
+  GError *encode_error = NULL;
+
+  g_return_val_if_fail (GDK_IS_PIXBUF (pixbuf), FALSE);
+  g_return_val_if_fail (variants != NULL || n_variants == 0, FALSE);
+
+  if (!encoder_check_pixbuf (pixbuf, error))
+    return FALSE;
+
+  width      = gdk_pixbuf_get_width (pixbuf);
+  height     = gdk_pixbuf_get_height (pixbuf);
+  rowstride  = gdk_pixbuf_get_rowstride (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  pixels     = gdk_pixbuf_get_pixels (pixbuf);
+
+  for (i = 0; i < n_variants; i++)
+    if (variants[i].width <= 0 || variants[i].height <= 0 ||
+        width % variants[i].width || height % variants[i].height)
+      {
+        g_set_error (error, hd_pvr_texture_error_quark (),
+                     HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+                     "Can't make %dx%d from %ux%u, as it is not divided by "
+                     "a whole number", variants[i].width, variants[i].height,
+                     width, height);
+        return FALSE;
+      }
+
+  save_options_init (&options, flags);
+  pvr_format = save_format (pixbuf, format);
+  writer = pvr_texture_writer_new (PVR_SYNC_TOGETHER);
+  options.writer = writer;
+
+  sizes = g_new0 (SaveVariant, n_variants);
+  for (i = 0; i < n_variants && ret; i++)
+    {
+      SaveVariant *variant = &sizes[i];
+
+      variant->width = variants[i].width;
+      variant->x_step = width / variants[i].width;
+      variant->y_step = height / variants[i].height;
+      variant->encoder = pvr_texture_stream_encoder_new (variants[i].file,
+                                                         pvr_format,
+                                                         variants[i].width,
+                                                         variants[i].height,
+                                                         n_channels,
+                                                         &options, error);
+      if (!variant->encoder)
+        ret = FALSE;
+      else if (variant->x_step > 1 || variant->y_step > 1)
         {
-          memcpy(&allocated[compress_width*4*y],
-                 &allocated[compress_width*4*(height-1)],
-                 compress_width*4);
+          variant->sums = g_new0 (guint32, variant->width * n_channels);
+          variant->row = g_malloc (variant->width * n_channels);
         }
-      for (y=mid;y<compress_height;y++)
+    }
+
+  /* a band of rows at a time, to every size: the full size ones take
+   * the rows as they are, the others sum them */
+  for (y = 0; y < height && ret; y += band)
+    {
+      band = MIN (SAVE_VARIANTS_BAND_ROWS, height - y);
+
+      for (i = 0; i < n_variants && ret; i++)
         {
-          memcpy(&allocated[compress_width*4*y],
-                 &allocated[0],
-                 compress_width*4);
+          SaveVariant *variant = &sizes[i];
+          guint row;
+
+          if (!variant->sums)
+            ret = pvr_texture_stream_encoder_write_rows (variant->encoder,
+                                                         pixels +
+                                                         y * rowstride,
+                                                         rowstride, band,
+                                                         &encode_error);
+          else
+            for (row = y; row < y + band && ret; row++)
+              ret = save_variant_add_row (variant, pixels + row * rowstride,
+                                          n_channels, &encode_error);
         }
     }
 
-  /* now, compress the data */
-  compressed = pvr_texture_compress_pvrtc4(
-                        uncompressed, compress_width, compress_height,
-                        &compressed_size);
+  for (i = 0; i < n_variants; i++)
+    {
+      SaveVariant *variant = &sizes[i];
+
+      if (!variant->encoder)
+        continue;
+
+      if (ret)
+        ret = pvr_texture_stream_encoder_finish (variant->encoder,
+                                                 &encode_error);
+      else
+        pvr_texture_stream_encoder_abort (variant->encoder);
+
+      g_free (variant->sums);
+      g_free (variant->row);
+    }
+  g_free (sizes);
+
+  if (ret)
+    ret = pvr_texture_writer_sync (writer, &encode_error);
+  pvr_texture_writer_free (writer);
+
+  if (encode_error)
+    g_propagate_error (error, encode_error);
+
+  return ret;
+}
+
+static gboolean
+is_power_2 (guint x)
+{
+  return x && !(x & (x - 1));
+}
+
+/* Checks the header describes a texture we can read, and fills in the
+ * texture's format and the sizes of its levels. The levels' data isn't
+ * set */
+static gboolean
+texture_check_header (HDPvrTexture              *texture,
+                      const PVR_TEXTURE_HEADER  *head,
+                      const gchar               *file,
+                      GError                   **error)
+{
+  guint max_levels, i;
+  gsize offset;
+
+  if (head->dwHeaderSize != sizeof (PVR_TEXTURE_HEADER) ||
+      head->dwPVR != ('P' | 'V'<<8 | 'R'<<16 | '!'<<24))
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_INVALID,
+                   "%s is not a PVR texture", file);
+      return FALSE;
+    }
+
+  switch (head->dwpfFlags & PVR_FLAG_FORMAT_MASK)
+    {
+    case MGLPT_PVRTC4:
+    case OGL_PVRTC4:
+      texture->format = PVR_FORMAT_PVRTC4;
+      break;
+    case MGLPT_PVRTC2:
+    case OGL_PVRTC2:
+      texture->format = PVR_FORMAT_PVRTC2;
+      break;
+    case ETC_RGB_4BPP:
+      texture->format = PVR_FORMAT_ETC1;
+      break;
+    default:
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+                   "%s has unsupported pixel format 0x%x", file,
+                   head->dwpfFlags & PVR_FLAG_FORMAT_MASK);
+      return FALSE;
+    }
+
+  if (head->dwNumSurfs > 1)
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+                   "%s has %u surfaces, only single textures are supported",
+                   file, head->dwNumSurfs);
+      return FALSE;
+    }
 
-  /* free data if we created it above */
-  if (allocated)
-    g_free(allocated);
+  /* the size limit keeps all the sizes below well inside a gint */
+  if (head->dwWidth == 0 || head->dwHeight == 0 ||
+      head->dwWidth > 1 << 15 || head->dwHeight > 1 << 15 ||
+      (texture->format != PVR_FORMAT_ETC1 &&
+       (!is_power_2 (head->dwWidth) || !is_power_2 (head->dwHeight))))
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_INVALID,
+                   "%s has invalid size %ux%u", file,
+                   head->dwWidth, head->dwHeight);
+      return FALSE;
+    }
 
-  if (!compressed)
+  /* each mipmap halves the size, until both sides are 1 */
+  for (max_levels = 1;
+       (head->dwWidth | head->dwHeight) >> max_levels;
+       max_levels++);
+  if (head->dwMipMapCount >= max_levels)
     {
-      g_set_error (error,
-                   GDK_PIXBUF_ERROR,
-                   GDK_PIXBUF_ERROR_FAILED,
-                   "Could not compress to pvr texture.");
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_INVALID,
+                   "%s has %u mipmaps, a %ux%u texture can only have %u",
+                   file, head->dwMipMapCount,
+                   head->dwWidth, head->dwHeight, max_levels - 1);
       return FALSE;
     }
 
-  /* and finally write it out to a file! */
-  if (!pvr_texture_save_pvrtc4_atomically (file,
-                                           compressed,
-                                           compressed_size,
-                                           compress_width,
-                                           compress_height,
-                                           error))
+  texture->n_levels = head->dwMipMapCount + 1;
+  texture->levels = g_new0 (HDPvrTextureLevel, texture->n_levels);
+
+  offset = sizeof (PVR_TEXTURE_HEADER);
+  for (i = 0; i < texture->n_levels; i++)
     {
-      g_free (compressed);
+      HDPvrTextureLevel *level = &texture->levels[i];
+
+      level->width = MAX (1, head->dwWidth >> i);
+      level->height = MAX (1, head->dwHeight >> i);
+      level->size = pvr_texture_level_size (texture->format,
+                                            level->width, level->height,
+                                            &level->data_width,
+                                            &level->data_height);
+      offset += level->size;
+    }
+
+  if (offset - sizeof (PVR_TEXTURE_HEADER) != head->dwDataSize)
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_INVALID,
+                   "%s should have %lu bytes of texture data, "
+                   "but has %u in the header", file,
+                   (gulong) (offset - sizeof (PVR_TEXTURE_HEADER)),
+                   head->dwDataSize);
       return FALSE;
     }
 
-  g_free (compressed);
   return TRUE;
 }
+
+/* Checks that head, on its own, describes a texture we can read, and
+ * gives the length of the whole file it describes. name is only used
+ * for errors */
+gboolean
+hd_pvr_texture_check_header (const PVR_TEXTURE_HEADER  *head,
+                             const gchar               *name,
+                             gsize                     *length,
+                             GError                   **error)
+{
+  HDPvrTexture texture = { 0 };
+  gboolean ret;
+
+  ret = texture_check_header (&texture, head, name, error);
+  g_free (texture.levels);
+  if (ret && length)
+    *length = sizeof (PVR_TEXTURE_HEADER) + head->dwDataSize;
+
+  return ret;
+}
+
+/**
+ * hd_pvr_texture_load:
+ * @file: the file to load
+ * @error: return location for a #GError, or %NULL
+ *
+ * Maps a PVRTC4, PVRTC2 or ETC1 texture file, as written by
+ * hd_pvr_texture_save_full(), into memory and checks its header. Nothing
+ * is copied or decompressed: hd_pvr_texture_get_level() gives pointers
+ * straight into the file, ready to hand to glCompressedTexImage2D.
+ *
+ * Returns: the texture, to be freed with hd_pvr_texture_free(), or %NULL
+ * if the file could not be read or is not a texture we understand
+ */
+HDPvrTexture *
+hd_pvr_texture_load (const gchar  *file,
+                     GError      **error)
+{
+  HDPvrTexture *texture;
+  GMappedFile *mapped;
+  GError *map_error = NULL;
+
+  g_return_val_if_fail (file != NULL, NULL);
+
+  mapped = g_mapped_file_new (file, FALSE, &map_error);
+  if (!mapped)
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_OPEN,
+                   "Could not open %s: %s", file, map_error->message);
+      g_error_free (map_error);
+      return NULL;
+    }
+
+  texture = hd_pvr_texture_new_for_data (
+                (const guchar *) g_mapped_file_get_contents (mapped),
+                g_mapped_file_get_length (mapped), file, error);
+  if (!texture)
+    {
+      g_mapped_file_free (mapped);
+      return NULL;
+    }
+
+  texture->file = mapped;
+  return texture;
+}
+
+/* Checks the PVR texture in data, and makes a texture whose levels point
+ * into it. The data must stay around until the texture is freed. name is
+ * only used for errors */
+HDPvrTexture *
+hd_pvr_texture_new_for_data (const guchar  *data,
+                             gsize          length,
+                             const gchar   *name,
+                             GError       **error)
+{
+  HDPvrTexture *texture;
+  PVR_TEXTURE_HEADER head;
+  gsize offset;
+  guint i;
+
+  if (length < sizeof (head))
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_INVALID,
+                   "%s is too short to be a PVR texture", name);
+      return NULL;
+    }
+
+  /* copied out, so we don't care how the header is aligned */
+  memcpy (&head, data, sizeof (head));
+
+  texture = g_new0 (HDPvrTexture, 1);
+  if (!texture_check_header (texture, &head, name, error))
+    {
+      hd_pvr_texture_free (texture);
+      return NULL;
+    }
+
+  if (length - sizeof (head) < head.dwDataSize)
+    {
+      g_set_error (error, hd_pvr_texture_error_quark (),
+                   HD_PVR_TEXTURE_ERROR_INVALID,
+                   "%s should have %u bytes of texture data, "
+                   "but has %lu", name, head.dwDataSize,
+                   (gulong) (length - sizeof (head)));
+      hd_pvr_texture_free (texture);
+      return NULL;
+    }
+
+  offset = sizeof (head);
+  for (i = 0; i < texture->n_levels; i++)
+    {
+      texture->levels[i].data = data + offset;
+      offset += texture->levels[i].size;
+    }
+
+  return texture;
+}
+
+/* Sets error from errno for a file operation. message has one %s, for
+ * filename, and the reason errno gives is added after it */
+void
+hd_pvr_texture_set_file_error (GError      **error,
+                               const gchar  *message,
+                               const gchar  *filename)
+{
+  gint saved_errno = errno;
+  gchar *what;
+
+  what = g_strdup_printf (message, filename);
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+               "%s: %s", what, g_strerror (saved_errno));
+  g_free (what);
+}
+
+/* write all of data, carrying on after short writes */
+gboolean
+hd_pvr_texture_write_all (gint          fd,
+                          const guchar *data,
+                          gsize         size)
+{
+  while (size > 0)
+    {
+      ssize_t written = write (fd, data, size);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      data += written;
+      size -= written;
+    }
+
+  return TRUE;
+}
+
+/**
+ * hd_pvr_texture_free:
+ * @texture: a texture from hd_pvr_texture_load() or
+ * hd_pvr_texture_pack_lookup()
+ *
+ * Unmaps the texture. Pointers from hd_pvr_texture_get_level() are no
+ * longer valid afterwards. For a texture from a pack only the view is
+ * freed; the data stays mapped until hd_pvr_texture_pack_free().
+ */
+void
+hd_pvr_texture_free (HDPvrTexture *texture)
+{
+  if (!texture)
+    return;
+
+  if (texture->file)
+    g_mapped_file_free (texture->file);
+  g_free (texture->levels);
+  g_free (texture);
+}
+
+/**
+ * hd_pvr_texture_get_format:
+ * @texture: a texture from hd_pvr_texture_load()
+ *
+ * Returns: the compressed format of the texture
+ */
+HDPvrTextureFormat
+hd_pvr_texture_get_format (HDPvrTexture *texture)
+{
+  g_return_val_if_fail (texture != NULL, HD_PVR_TEXTURE_FORMAT_AUTO);
+
+  switch (texture->format)
+    {
+    case PVR_FORMAT_PVRTC2:
+      return HD_PVR_TEXTURE_FORMAT_PVRTC2;
+    case PVR_FORMAT_ETC1:
+      return HD_PVR_TEXTURE_FORMAT_ETC1;
+    default:
+      return HD_PVR_TEXTURE_FORMAT_PVRTC4;
+    }
+}
+
+/**
+ * hd_pvr_texture_get_n_levels:
+ * @texture: a texture from hd_pvr_texture_load()
+ *
+ * Returns: the number of levels in the texture: 1 for the full size
+ * texture, plus 1 for each mipmap
+ */
+guint
+hd_pvr_texture_get_n_levels (HDPvrTexture *texture)
+{
+  g_return_val_if_fail (texture != NULL, 0);
+
+  return texture->n_levels;
+}
+
+/**
+ * hd_pvr_texture_get_level:
+ * @texture: a texture from hd_pvr_texture_load()
+ * @level: the level, 0 for the full size texture
+ * @width: return location for the width of the level, or %NULL
+ * @height: return location for the height of the level, or %NULL
+ * @size: return location for the size of the compressed data, or %NULL
+ *
+ * Gets the compressed data of one level, without copying it. Levels that
+ * are smaller than the format allows (8x8 for PVRTC4, 16x8 for PVRTC2, or
+ * not whole ETC1 blocks) are stored padded, so @size may be more than
+ * @width and @height suggest.
+ *
+ * Returns: the data, which belongs to @texture
+ */
+const guchar *
+hd_pvr_texture_get_level (HDPvrTexture *texture,
+                          guint         level,
+                          guint        *width,
+                          guint        *height,
+                          gsize        *size)
+{
+  g_return_val_if_fail (texture != NULL, NULL);
+  g_return_val_if_fail (level < texture->n_levels, NULL);
+
+  if (width)
+    *width = texture->levels[level].width;
+  if (height)
+    *height = texture->levels[level].height;
+  if (size)
+    *size = texture->levels[level].size;
+
+  return texture->levels[level].data;
+}
+
+/**
+ * hd_pvr_texture_decode:
+ * @texture: a texture from hd_pvr_texture_load()
+ * @level: the level to decode, 0 for the full size texture
+ * @pixels: where to put the pixels, which must have room for the size
+ * hd_pvr_texture_get_level() gives
+ * @rowstride: the distance in bytes between rows of @pixels, a multiple
+ * of 4
+ * @error: return location for a #GError, or %NULL
+ *
+ * Decompresses one level of the texture to RGBA8888, using all CPUs.
+ *
+ * Returns: %TRUE if the level was decoded
+ */
+gboolean
+hd_pvr_texture_decode (HDPvrTexture  *texture,
+                       guint          level,
+                       guchar        *pixels,
+                       guint          rowstride,
+                       GError       **error)
+{
+  return hd_pvr_texture_decode_with_threads (texture, level, pixels,
+                                             rowstride, 0, error);
+}
+
+/* As hd_pvr_texture_decode, but on n_threads threads, or one per CPU for
+ * 0, for callers that shouldn't start threads of their own */
+gboolean
+hd_pvr_texture_decode_with_threads (HDPvrTexture  *texture,
+                                    guint          level,
+                                    guchar        *pixels,
+                                    guint          rowstride,
+                                    guint          n_threads,
+                                    GError       **error)
+{
+  const HDPvrTextureLevel *l;
+  PvrTextureOptions options;
+  guchar *padded = NULL;
+  gboolean ret;
+  guint y;
+
+  g_return_val_if_fail (texture != NULL, FALSE);
+  g_return_val_if_fail (level < texture->n_levels, FALSE);
+  g_return_val_if_fail (pixels != NULL, FALSE);
+
+  l = &texture->levels[level];
+  g_return_val_if_fail (rowstride >= l->width * 4 && (rowstride & 3) == 0,
+                        FALSE);
+
+  pvr_texture_options_init (&options);
+  options.n_threads = n_threads;
+
+  /* levels stored bigger than they are go through a buffer first */
+  if ((guint) l->data_width == l->width && (guint) l->data_height == l->height)
+    ret = pvr_texture_decompress_into (texture->format, l->data,
+                                       l->data_width, l->data_height,
+                                       &options, pixels, rowstride);
+  else
+    {
+      padded = g_malloc (l->data_width * l->data_height * 4);
+      ret = pvr_texture_decompress_into (texture->format, l->data,
+                                         l->data_width, l->data_height,
+                                         &options, padded,
+                                         l->data_width * 4);
+      if (ret)
+        for (y = 0; y < l->height; y++)
+          memcpy (pixels + y * rowstride, padded + y * l->data_width * 4,
+                  l->width * 4);
+      g_free (padded);
+    }
+
+  if (!ret)
+    g_set_error (error, hd_pvr_texture_error_quark (),
+                 HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+                 "Could not decode level %u of texture", level);
+
+  return ret;
+}
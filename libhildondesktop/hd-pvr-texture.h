@@ -23,13 +23,282 @@
 #define __HD_PVR_TEXTURE_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 G_BEGIN_DECLS
 
-gboolean hd_pvr_texture_save (const gchar  *file,
-                              GdkPixbuf    *pixbuf,
-                              GError      **error);
+/**
+ * HDPvrTextureFormat:
+ * @HD_PVR_TEXTURE_FORMAT_AUTO: ETC1 for opaque pixbufs, otherwise PVRTC4
+ * @HD_PVR_TEXTURE_FORMAT_PVRTC4: 4 bits per pixel
+ * @HD_PVR_TEXTURE_FORMAT_PVRTC2: 2 bits per pixel, for textures where
+ * memory and upload bandwidth matter more than quality
+ * @HD_PVR_TEXTURE_FORMAT_ETC1: 4 bits per pixel without alpha. Better
+ * quality than PVRTC4, and without mipmaps it needs no padding to a
+ * power of 2
+ *
+ * The compressed format hd_pvr_texture_save_full() writes, or that
+ * hd_pvr_texture_get_format() found.
+ **/
+typedef enum
+{
+  HD_PVR_TEXTURE_FORMAT_AUTO,
+  HD_PVR_TEXTURE_FORMAT_PVRTC4,
+  HD_PVR_TEXTURE_FORMAT_PVRTC2,
+  HD_PVR_TEXTURE_FORMAT_ETC1
+} HDPvrTextureFormat;
+
+/**
+ * HDPvrTextureSaveFlags:
+ * @HD_PVR_TEXTURE_SAVE_DEFAULT: just the full size texture
+ * @HD_PVR_TEXTURE_SAVE_MIPMAPS: also store box filtered mipmaps, down to
+ * the smallest texture the format allows
+ * @HD_PVR_TEXTURE_SAVE_FAST: compress PVRTC as quickly as possible, at
+ * some cost in quality. For textures that are only shown briefly, such
+ * as snapshots
+ *
+ * Options for hd_pvr_texture_save_full().
+ **/
+typedef enum
+{
+  HD_PVR_TEXTURE_SAVE_DEFAULT = 0,
+  HD_PVR_TEXTURE_SAVE_MIPMAPS = 1 << 0,
+  HD_PVR_TEXTURE_SAVE_FAST    = 1 << 1
+} HDPvrTextureSaveFlags;
+
+/**
+ * HDPvrTextureErrorCode:
+ * @HD_PVR_TEXTURE_ERROR_UNKNOWN: something else went wrong
+ * @HD_PVR_TEXTURE_ERROR_OPEN: the file could not be read
+ * @HD_PVR_TEXTURE_ERROR_INVALID: the file is not a valid PVR texture
+ * @HD_PVR_TEXTURE_ERROR_UNSUPPORTED: the texture is valid, but in a format
+ * or layout this library doesn't handle
+ * @HD_PVR_TEXTURE_ERROR_NO_SPACE: the buffer given is too small
+ * @HD_PVR_TEXTURE_ERROR_NOT_FOUND: the pack has no texture of that name
+ *
+ * Errors from hd_pvr_texture_load(), hd_pvr_texture_decode(),
+ * hd_pvr_encoder_compress() and the texture pack functions.
+ **/
+typedef enum
+{
+  HD_PVR_TEXTURE_ERROR_UNKNOWN = 0,
+  HD_PVR_TEXTURE_ERROR_OPEN,
+  HD_PVR_TEXTURE_ERROR_INVALID,
+  HD_PVR_TEXTURE_ERROR_UNSUPPORTED,
+  HD_PVR_TEXTURE_ERROR_NO_SPACE,
+  HD_PVR_TEXTURE_ERROR_NOT_FOUND
+} HDPvrTextureErrorCode;
+
+/**
+ * HDPvrTextureProgressFunc:
+ * @fraction: how much of the texture has been compressed, from 0 to 1
+ * @user_data: the data given to hd_pvr_texture_save_async()
+ *
+ * Tells the caller of hd_pvr_texture_save_async() how far it has got.
+ * Called from the main loop.
+ **/
+typedef void (*HDPvrTextureProgressFunc) (gdouble  fraction,
+                                          gpointer user_data);
+
+/**
+ * HDPvrTextureBatchErrorFunc:
+ * @input: the image that could not be compressed
+ * @output: the texture it was to be compressed to
+ * @error: what went wrong
+ * @user_data: the data given to hd_pvr_texture_batch_run()
+ *
+ * Called by hd_pvr_texture_batch_run(), in the thread that called it,
+ * for each image of the batch that fails.
+ **/
+typedef void (*HDPvrTextureBatchErrorFunc) (const gchar  *input,
+                                            const gchar  *output,
+                                            const GError *error,
+                                            gpointer      user_data);
+
+/**
+ * HDPvrTextureBatchStats:
+ * @n_compressed: how many textures were written
+ * @n_skipped: how many images were left alone, as their textures were
+ * newer than them
+ * @n_failed: how many images could not be loaded or compressed
+ * @n_syncs: how many times the written textures were synced to disk
+ * @pixels: how many pixels the compressed images had between them
+ * @bytes_written: the total size of the written textures
+ * @seconds: how long the batch took
+ *
+ * What hd_pvr_texture_batch_run() did.
+ **/
+typedef struct
+{
+  guint   n_compressed;
+  guint   n_skipped;
+  guint   n_failed;
+  guint   n_syncs;
+  guint64 pixels;
+  guint64 bytes_written;
+  gdouble seconds;
+} HDPvrTextureBatchStats;
+
+/**
+ * HDPvrTextureVariant:
+ * @file: where to save this size of the pixbuf
+ * @width: the width of this size: the pixbuf's width divided by a whole
+ * number
+ * @height: the height of this size: the pixbuf's height divided by a
+ * whole number
+ *
+ * One of the sizes hd_pvr_texture_save_variants() makes.
+ **/
+typedef struct
+{
+  const gchar *file;
+  gint         width;
+  gint         height;
+} HDPvrTextureVariant;
+
+typedef struct _HDPvrTexture HDPvrTexture;
+typedef struct _HDPvrEncoder HDPvrEncoder;
+typedef struct _HDPvrTextureBatch HDPvrTextureBatch;
+typedef struct _HDPvrTexturePack HDPvrTexturePack;
+typedef struct _HDPvrTexturePackWriter HDPvrTexturePackWriter;
+
+GQuark   hd_pvr_texture_error_quark (void);
+
+gboolean hd_pvr_texture_save      (const gchar            *file,
+                                   GdkPixbuf              *pixbuf,
+                                   GError                **error);
+
+gboolean hd_pvr_texture_save_full (const gchar            *file,
+                                   GdkPixbuf              *pixbuf,
+                                   HDPvrTextureFormat      format,
+                                   HDPvrTextureSaveFlags   flags,
+                                   GError                **error);
+
+gboolean hd_pvr_texture_save_variants (GdkPixbuf                 *pixbuf,
+                                       const HDPvrTextureVariant *variants,
+                                       guint                      n_variants,
+                                       HDPvrTextureFormat         format,
+                                       HDPvrTextureSaveFlags      flags,
+                                       GError                   **error);
+
+void     hd_pvr_texture_save_async  (const gchar              *file,
+                                     GdkPixbuf                *pixbuf,
+                                     HDPvrTextureFormat        format,
+                                     HDPvrTextureSaveFlags     flags,
+                                     gint                      io_priority,
+                                     GCancellable             *cancellable,
+                                     HDPvrTextureProgressFunc  progress_callback,
+                                     gpointer                  progress_data,
+                                     GAsyncReadyCallback       callback,
+                                     gpointer                  user_data);
+
+gboolean hd_pvr_texture_save_finish (GAsyncResult             *result,
+                                     GError                  **error);
+
+HDPvrEncoder       *hd_pvr_encoder_new          (HDPvrTextureFormat     format,
+                                                 HDPvrTextureSaveFlags  flags);
+
+void                hd_pvr_encoder_free         (HDPvrEncoder          *encoder);
+
+gsize               hd_pvr_encoder_get_size     (HDPvrEncoder          *encoder,
+                                                 GdkPixbuf             *pixbuf);
+
+const guchar       *hd_pvr_encoder_compress     (HDPvrEncoder          *encoder,
+                                                 GdkPixbuf             *pixbuf,
+                                                 guchar                *buffer,
+                                                 gsize                  buffer_size,
+                                                 gsize                 *size,
+                                                 GError               **error);
+
+HDPvrTextureBatch  *hd_pvr_texture_batch_new          (HDPvrTextureFormat          format,
+                                                       HDPvrTextureSaveFlags       flags,
+                                                       guint                       n_workers);
+
+void                hd_pvr_texture_batch_free         (HDPvrTextureBatch          *batch);
+
+void                hd_pvr_texture_batch_add          (HDPvrTextureBatch          *batch,
+                                                       const gchar                *input,
+                                                       const gchar                *output);
+
+gboolean            hd_pvr_texture_batch_add_manifest (HDPvrTextureBatch          *batch,
+                                                       const gchar                *manifest,
+                                                       GError                    **error);
+
+gboolean            hd_pvr_texture_batch_add_dir      (HDPvrTextureBatch          *batch,
+                                                       const gchar                *dir,
+                                                       const gchar                *output_dir,
+                                                       GError                    **error);
+
+gboolean            hd_pvr_texture_batch_run          (HDPvrTextureBatch          *batch,
+                                                       gboolean                    force,
+                                                       HDPvrTextureBatchErrorFunc  error_func,
+                                                       gpointer                    user_data,
+                                                       HDPvrTextureBatchStats     *stats,
+                                                       GError                    **error);
+
+HDPvrTexture       *hd_pvr_texture_load         (const gchar   *file,
+                                                 GError       **error);
+
+void                hd_pvr_texture_free         (HDPvrTexture  *texture);
+
+HDPvrTextureFormat  hd_pvr_texture_get_format   (HDPvrTexture  *texture);
+
+guint               hd_pvr_texture_get_n_levels (HDPvrTexture  *texture);
+
+const guchar       *hd_pvr_texture_get_level    (HDPvrTexture  *texture,
+                                                 guint          level,
+                                                 guint         *width,
+                                                 guint         *height,
+                                                 gsize         *size);
+
+gboolean            hd_pvr_texture_decode       (HDPvrTexture  *texture,
+                                                 guint          level,
+                                                 guchar        *pixels,
+                                                 guint          rowstride,
+                                                 GError       **error);
+
+HDPvrTexturePackWriter *hd_pvr_texture_pack_writer_new        (void);
+
+void                    hd_pvr_texture_pack_writer_free       (HDPvrTexturePackWriter  *writer);
+
+gboolean                hd_pvr_texture_pack_writer_add_file   (HDPvrTexturePackWriter  *writer,
+                                                               const gchar             *name,
+                                                               const gchar             *file,
+                                                               GError                 **error);
+
+gboolean                hd_pvr_texture_pack_writer_add_pixbuf (HDPvrTexturePackWriter  *writer,
+                                                               const gchar             *name,
+                                                               GdkPixbuf               *pixbuf,
+                                                               HDPvrTextureFormat       format,
+                                                               HDPvrTextureSaveFlags    flags,
+                                                               GError                 **error);
+
+gboolean                hd_pvr_texture_pack_writer_save       (HDPvrTexturePackWriter  *writer,
+                                                               const gchar             *file,
+                                                               GError                 **error);
+
+HDPvrTexturePack       *hd_pvr_texture_pack_load              (const gchar             *file,
+                                                               GError                 **error);
+
+void                    hd_pvr_texture_pack_free              (HDPvrTexturePack        *pack);
+
+guint                   hd_pvr_texture_pack_get_n_textures    (HDPvrTexturePack        *pack);
+
+const gchar            *hd_pvr_texture_pack_get_name          (HDPvrTexturePack        *pack,
+                                                               guint                    index);
+
+HDPvrTexture           *hd_pvr_texture_pack_lookup            (HDPvrTexturePack        *pack,
+                                                               const gchar             *name,
+                                                               GError                 **error);
+
+void                hd_pvr_texture_cache_init        (const gchar *cache_dir,
+                                                      guint64      max_size);
+
+void                hd_pvr_texture_cache_get_stats   (guint       *hits,
+                                                      guint       *misses);
+
+void                hd_pvr_texture_cache_reset_stats (void);
 
 G_END_DECLS
 
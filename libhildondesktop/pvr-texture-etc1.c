@@ -0,0 +1,339 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ETC1 block compression + decompression.
+ *
+ * Each 4x4 block is split into two halves, side by side or (if the flip
+ * bit is set) one above the other. Each half has a base colour and picks
+ * one of 8 tables of intensity modifiers, and each pixel then picks one
+ * of the 4 modifiers in its half's table to add to the base colour. The
+ * base colours are either both stored in 4 bits per channel, or the
+ * first in 5 bits and the second as a 3 bit difference from it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pvr-texture-private.h"
+
+#include <string.h>
+
+static const gint etc1_modifiers[8][4] = {
+  {   2,   8,   -2,   -8 },
+  {   5,  17,   -5,  -17 },
+  {   9,  29,   -9,  -29 },
+  {  13,  42,  -13,  -42 },
+  {  18,  60,  -18,  -60 },
+  {  24,  80,  -24,  -80 },
+  {  33, 106,  -33, -106 },
+  {  47, 183,  -47, -183 }
+};
+
+/* The 8 pixels of one half of a block, and where each one's bits go */
+typedef struct {
+  Color  pixels[8];
+  guint  shift[8];
+  gint   average[3];
+} Etc1Half;
+
+/* The best fit found for one half */
+typedef struct {
+  guint   error;
+  guint   table;
+  gint    base[3];    /* quantised to 4 or 5 bits */
+  guchar  index[8];
+} Etc1Fit;
+
+static inline gint
+etc1_clamp (gint v)
+{
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline gint
+etc1_expand (gint v,
+             guint bits)
+{
+  return bits == 4 ? (v << 4) | v : (v << 3) | (v >> 2);
+}
+
+static void
+etc1_gather (const Color *pixels,
+             guint        pixel_stride,
+             gboolean     flip,
+             guint        half,
+             Etc1Half    *out)
+{
+  guint i, x, y;
+  gint sum[3] = { 0, 0, 0 };
+
+  for (i = 0; i < 8; i++)
+    {
+      const Color *col;
+
+      if (flip)
+        {
+          x = i & 3;
+          y = (i >> 2) + half * 2;
+        }
+      else
+        {
+          x = (i & 1) + half * 2;
+          y = i >> 1;
+        }
+
+      col = &pixels[x + y*pixel_stride];
+      out->pixels[i] = *col;
+      /* pixels are numbered down the columns */
+      out->shift[i] = x*4 + y;
+      sum[0] += col->red;
+      sum[1] += col->green;
+      sum[2] += col->blue;
+    }
+
+  for (i = 0; i < 3; i++)
+    out->average[i] = (sum[i] + 4) / 8;
+}
+
+/* Finds the best table and modifiers for the given base colour, and puts
+ * them in fit if they beat what is already there */
+static void
+etc1_fit_base (const Etc1Half *half,
+               const gint      base[3],
+               guint           bits,
+               Etc1Fit        *fit)
+{
+  gint r = etc1_expand (base[0], bits);
+  gint g = etc1_expand (base[1], bits);
+  gint b = etc1_expand (base[2], bits);
+  guint table;
+
+  for (table = 0; table < 8; table++)
+    {
+      guchar index[8];
+      guint error = 0;
+      guint i, m;
+
+      for (i = 0; i < 8 && error < fit->error; i++)
+        {
+          const Color *col = &half->pixels[i];
+          guint best = G_MAXUINT;
+
+          for (m = 0; m < 4; m++)
+            {
+              gint mod = etc1_modifiers[table][m];
+              gint dr = etc1_clamp (r + mod) - col->red;
+              gint dg = etc1_clamp (g + mod) - col->green;
+              gint db = etc1_clamp (b + mod) - col->blue;
+              guint diff = dr*dr + dg*dg + db*db;
+
+              if (diff < best)
+                {
+                  best = diff;
+                  index[i] = m;
+                }
+            }
+          error += best;
+        }
+
+      if (error < fit->error)
+        {
+          fit->error = error;
+          fit->table = table;
+          memcpy (fit->base, base, sizeof (fit->base));
+          memcpy (fit->index, index, sizeof (fit->index));
+        }
+    }
+}
+
+/* Fits a half with base colours of the given number of bits, limited to
+ * lo..hi in each channel. The average colour is always tried; with
+ * PVR_ETC1_QUALITY so are the colours one step either side of it in each
+ * channel */
+static void
+etc1_fit_half (const Etc1Half *half,
+               guint           bits,
+               const gint      lo[3],
+               const gint      hi[3],
+               PvrEtc1Mode     mode,
+               Etc1Fit        *fit)
+{
+  gint max = (1 << bits) - 1;
+  gint base[3];
+  guint c;
+
+  fit->error = G_MAXUINT;
+
+  for (c = 0; c < 3; c++)
+    base[c] = CLAMP ((half->average[c] * max + 127) / 255, lo[c], hi[c]);
+  etc1_fit_base (half, base, bits, fit);
+
+  if (mode == PVR_ETC1_QUALITY)
+    {
+      gint centre[3];
+      gint step;
+
+      memcpy (centre, base, sizeof (centre));
+      for (c = 0; c < 3; c++)
+        for (step = -1; step <= 1; step += 2)
+          {
+            memcpy (base, centre, sizeof (base));
+            base[c] += step;
+            if (base[c] >= lo[c] && base[c] <= hi[c])
+              etc1_fit_base (half, base, bits, fit);
+          }
+    }
+}
+
+static void
+etc1_pack (const Etc1Fit  *fit0,
+           const Etc1Fit  *fit1,
+           const Etc1Half *half0,
+           const Etc1Half *half1,
+           gboolean        differential,
+           gboolean        flip,
+           guchar         *block)
+{
+  guint32 bits = 0;
+  guint c, i;
+
+  for (c = 0; c < 3; c++)
+    {
+      if (differential)
+        block[c] = (fit0->base[c] << 3) |
+                   ((fit1->base[c] - fit0->base[c]) & 7);
+      else
+        block[c] = (fit0->base[c] << 4) | fit1->base[c];
+    }
+  block[3] = (fit0->table << 5) | (fit1->table << 2) |
+             (differential ? 2 : 0) | (flip ? 1 : 0);
+
+  /* the high bits of each index go in the top half of the word */
+  for (i = 0; i < 8; i++)
+    {
+      bits |= ((fit0->index[i] >> 1) << (16 + half0->shift[i])) |
+              ((fit0->index[i] & 1) << half0->shift[i]);
+      bits |= ((fit1->index[i] >> 1) << (16 + half1->shift[i])) |
+              ((fit1->index[i] & 1) << half1->shift[i]);
+    }
+
+  block[4] = bits >> 24;
+  block[5] = bits >> 16;
+  block[6] = bits >> 8;
+  block[7] = bits;
+}
+
+void
+_pvr_texture_etc1_encode_block (const Color *pixels,
+                                guint        pixel_stride,
+                                PvrEtc1Mode  mode,
+                                guchar      *block)
+{
+  static const gint lo4[3] = { 0, 0, 0 };
+  static const gint hi4[3] = { 15, 15, 15 };
+  static const gint lo5[3] = { 0, 0, 0 };
+  static const gint hi5[3] = { 31, 31, 31 };
+  guint best_error = G_MAXUINT;
+  guint flip;
+
+  for (flip = 0; flip < 2; flip++)
+    {
+      Etc1Half half0, half1;
+      Etc1Fit fit0, fit1;
+      gint lo[3], hi[3];
+      guint c;
+
+      etc1_gather (pixels, pixel_stride, flip, 0, &half0);
+      etc1_gather (pixels, pixel_stride, flip, 1, &half1);
+
+      /* two independent 4 bit colours */
+      etc1_fit_half (&half0, 4, lo4, hi4, mode, &fit0);
+      etc1_fit_half (&half1, 4, lo4, hi4, mode, &fit1);
+      if (fit0.error + fit1.error < best_error)
+        {
+          best_error = fit0.error + fit1.error;
+          etc1_pack (&fit0, &fit1, &half0, &half1, FALSE, flip, block);
+        }
+
+      /* a 5 bit colour and one within -4..3 of it */
+      etc1_fit_half (&half0, 5, lo5, hi5, mode, &fit0);
+      for (c = 0; c < 3; c++)
+        {
+          lo[c] = MAX (0, fit0.base[c] - 4);
+          hi[c] = MIN (31, fit0.base[c] + 3);
+        }
+      etc1_fit_half (&half1, 5, lo, hi, mode, &fit1);
+      if (fit0.error + fit1.error < best_error)
+        {
+          best_error = fit0.error + fit1.error;
+          etc1_pack (&fit0, &fit1, &half0, &half1, TRUE, flip, block);
+        }
+    }
+}
+
+void
+_pvr_texture_etc1_decode_block (const guchar *block,
+                                Color        *out,
+                                guint         out_stride)
+{
+  gboolean differential = block[3] & 2;
+  gboolean flip = block[3] & 1;
+  guint tables[2] = { block[3] >> 5, (block[3] >> 2) & 7 };
+  guint32 bits = (block[4] << 24) | (block[5] << 16) |
+                 (block[6] << 8) | block[7];
+  gint base[2][3];
+  guint c, x, y;
+
+  for (c = 0; c < 3; c++)
+    {
+      if (differential)
+        {
+          gint b0 = block[c] >> 3;
+          /* sign extend the 3 bit difference */
+          gint d = ((gint) (block[c] & 7) ^ 4) - 4;
+
+          base[0][c] = etc1_expand (b0, 5);
+          base[1][c] = etc1_expand ((b0 + d) & 31, 5);
+        }
+      else
+        {
+          base[0][c] = etc1_expand (block[c] >> 4, 4);
+          base[1][c] = etc1_expand (block[c] & 15, 4);
+        }
+    }
+
+  for (y = 0; y < 4; y++)
+    for (x = 0; x < 4; x++)
+      {
+        guint half = flip ? y >= 2 : x >= 2;
+        guint shift = x*4 + y;
+        guint m = (((bits >> (16 + shift)) & 1) << 1) | ((bits >> shift) & 1);
+        gint mod = etc1_modifiers[tables[half]][m];
+        Color *col = &out[x + y*out_stride];
+
+        col->red = etc1_clamp (base[half][0] + mod);
+        col->green = etc1_clamp (base[half][1] + mod);
+        col->blue = etc1_clamp (base[half][2] + mod);
+        col->alpha = 255;
+      }
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef PVRTEXTUREPRIVATE_H_
+#define PVRTEXTUREPRIVATE_H_
+/* internals shared between the parts of the PVR texture codec */
+
+#include "pvr-texture.h"
+
+typedef struct Color {
+  guchar red;
+  guchar green;
+  guchar blue;
+  guchar alpha;
+} Color;
+
+/* Works out the 2 bit modulation value for each of the 16 pixels of a
+ * block, packed the way PVRTC4 stores them (pixel 0,0 in the bottom two
+ * bits). pixels points at the top-left pixel of the block, and rows of
+ * the block are pixel_stride Colors apart. low and high point at the
+ * block colours of the block up and to the left of this one, in grids
+ * that are block_stride Colors wide. */
+typedef guint32 (*PvrModulateBlockFunc) (const Color *pixels,
+                                         guint        pixel_stride,
+                                         const Color *low,
+                                         const Color *high,
+                                         guint        block_stride);
+
+/* Decodes the 16 pixels of a block from its modulation word, writing
+ * them to out, whose rows are out_stride Colors apart. punch_through is
+ * the block's modulation mode bit. low and high are as for
+ * PvrModulateBlockFunc. */
+typedef void (*PvrDecodeBlockFunc) (guint32      modulation,
+                                    gboolean     punch_through,
+                                    const Color *low,
+                                    const Color *high,
+                                    guint        block_stride,
+                                    Color       *out,
+                                    guint        out_stride);
+
+/* Returns the vector version of the modulation kernel for simd, or the
+ * best one this CPU can run for PVR_SIMD_AUTO. Returns NULL if there is
+ * no such kernel, in which case the scalar one should be used. */
+PvrModulateBlockFunc _pvr_texture_simd_get_modulate_block (PvrSimd simd);
+
+/* The same for the block decoding kernel */
+PvrDecodeBlockFunc   _pvr_texture_simd_get_decode_block   (PvrSimd simd);
+
+/* Compresses the 4x4 pixels at pixels, whose rows are pixel_stride
+ * Colors apart, into the 8 bytes of an ETC1 block. Alpha is ignored. */
+void _pvr_texture_etc1_encode_block (const Color *pixels,
+                                     guint        pixel_stride,
+                                     PvrEtc1Mode  mode,
+                                     guchar      *block);
+
+/* Decodes an ETC1 block into 4x4 opaque pixels */
+void _pvr_texture_etc1_decode_block (const guchar *block,
+                                     Color        *out,
+                                     guint         out_stride);
+
+#endif /*PVRTEXTUREPRIVATE_H_*/
@@ -0,0 +1,771 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Vector versions of the PVRTC4 modulation kernel (find_best for a whole
+ * block) and block decoder. They must give exactly the same answer as the
+ * scalar code in pvr-texture.c, which is the reference:
+ *
+ *  - colours are interpolated as ((a*(255-amt)) + (b*amt)) >> 8, which
+ *    never leaves 0-255 so needs no clamping, except that amt==0 gives a
+ *    exactly
+ *  - the difference is the sum of absolute channel differences
+ *  - ties go to the highest candidate
+ *  - a quadrant whose eight block colours are all the same gives 0
+ *
+ * Every kernel does one row of 4 pixels at a time. The left two pixels
+ * of a row take their colours from one quadrant and the right two from
+ * the next, with horizontal weights 128, 192 | 0, 64.
+ */
+
+#include "pvr-texture-private.h"
+
+#include <string.h>
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_PVR_SSE2 1
+#define HAVE_PVR_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define HAVE_PVR_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* vertical weight for each row of pixels in the block */
+static const guint16 y_weights[4] = { 128, 192, 0, 64 };
+
+static inline guint32
+load_color (const Color *col)
+{
+  guint32 v;
+
+  memcpy (&v, col, sizeof (v));
+  return v;
+}
+
+/* Same test as the start of find_best, for the quadrant whose top-left
+ * block colours are low[0] and high[0] */
+static inline gboolean
+quadrant_is_flat (const Color *low,
+                  const Color *high,
+                  guint        block_stride)
+{
+  guint32 c = load_color (&low[0]);
+
+  return load_color (&low[1]) == c &&
+         load_color (&low[block_stride]) == c &&
+         load_color (&low[block_stride+1]) == c &&
+         load_color (&high[0]) == c &&
+         load_color (&high[1]) == c &&
+         load_color (&high[block_stride]) == c &&
+         load_color (&high[block_stride+1]) == c;
+}
+
+/* Bits of the modulation word that belong to quadrants which are flat,
+ * and so must be 0 */
+static inline guint32
+flat_mask (const Color *low,
+           const Color *high,
+           guint        block_stride)
+{
+  guint32 mask = 0;
+
+  /* quadrant 0,0 holds pixels 0-1 x 0-1, 1,0 holds 2-3 x 0-1 ... */
+  if (quadrant_is_flat (low, high, block_stride))
+    mask |= 0x00000F0F;
+  if (quadrant_is_flat (low+1, high+1, block_stride))
+    mask |= 0x0000F0F0;
+  if (quadrant_is_flat (low+block_stride, high+block_stride, block_stride))
+    mask |= 0x0F0F0000;
+  if (quadrant_is_flat (low+block_stride+1, high+block_stride+1,
+                        block_stride))
+    mask |= 0xF0F00000;
+
+  return mask;
+}
+
+/* Pack four 0-3 values in the bytes of v into 8 bits, first one lowest */
+static inline guint32
+pack_row (guint32 v)
+{
+  return (v & 0x03) |
+         ((v >> 6) & 0x0C) |
+         ((v >> 12) & 0x30) |
+         ((v >> 18) & 0xC0);
+}
+
+#if HAVE_PVR_SSE2
+
+#define PVR_TARGET_SSE2 __attribute__ ((target ("sse2")))
+#define PVR_TARGET_AVX2 __attribute__ ((target ("avx2")))
+
+/* load a colour as 4 16 bit lanes, twice over */
+static inline PVR_TARGET_SSE2 __m128i
+sse2_load_color_x2 (const Color *col)
+{
+  __m128i v = _mm_cvtsi32_si128 (load_color (col));
+
+  v = _mm_unpacklo_epi8 (v, _mm_setzero_si128 ());
+  return _mm_unpacklo_epi64 (v, v);
+}
+
+/* color_interp on 16 bit lanes. zero has all bits set in the lanes where
+ * amt is 0 */
+static inline PVR_TARGET_SSE2 __m128i
+sse2_interp (__m128i a,
+             __m128i b,
+             __m128i amt,
+             __m128i namt,
+             __m128i zero)
+{
+  __m128i r = _mm_srli_epi16 (_mm_add_epi16 (_mm_mullo_epi16 (a, namt),
+                                             _mm_mullo_epi16 (b, amt)), 8);
+
+  return _mm_or_si128 (_mm_and_si128 (zero, a), _mm_andnot_si128 (zero, r));
+}
+
+static inline PVR_TARGET_SSE2 __m128i
+sse2_abs_diff (__m128i a,
+               __m128i b)
+{
+  return _mm_or_si128 (_mm_subs_epu16 (a, b), _mm_subs_epu16 (b, a));
+}
+
+/* sums each group of 4 lanes from two registers of 2 pixels each,
+ * giving 4 32 bit lanes, one per pixel */
+static inline PVR_TARGET_SSE2 __m128i
+sse2_sum_pixels (__m128i left,
+                 __m128i right)
+{
+  const __m128i ones = _mm_set1_epi16 (1);
+  __m128i l = _mm_shuffle_epi32 (_mm_madd_epi16 (left, ones),
+                                 _MM_SHUFFLE (3, 1, 2, 0));
+  __m128i r = _mm_shuffle_epi32 (_mm_madd_epi16 (right, ones),
+                                 _MM_SHUFFLE (3, 1, 2, 0));
+
+  return _mm_add_epi32 (_mm_unpacklo_epi64 (l, r),
+                        _mm_unpackhi_epi64 (l, r));
+}
+
+/* pick the candidate with the smallest difference, favouring the later
+ * one on ties just like find_best */
+static inline PVR_TARGET_SSE2 guint32
+sse2_select (__m128i d0,
+             __m128i d1,
+             __m128i d2,
+             __m128i d3)
+{
+  __m128i r0 = _mm_and_si128 (_mm_and_si128 (_mm_cmplt_epi32 (d0, d1),
+                                             _mm_cmplt_epi32 (d0, d2)),
+                              _mm_cmplt_epi32 (d0, d3));
+  __m128i r1 = _mm_and_si128 (_mm_cmplt_epi32 (d1, d2),
+                              _mm_cmplt_epi32 (d1, d3));
+  __m128i r2 = _mm_cmplt_epi32 (d2, d3);
+  __m128i res = _mm_set1_epi32 (3);
+
+  res = _mm_or_si128 (_mm_and_si128 (r2, _mm_set1_epi32 (2)),
+                      _mm_andnot_si128 (r2, res));
+  res = _mm_or_si128 (_mm_and_si128 (r1, _mm_set1_epi32 (1)),
+                      _mm_andnot_si128 (r1, res));
+  res = _mm_andnot_si128 (r0, res);
+
+  res = _mm_packs_epi32 (res, res);
+  res = _mm_packus_epi16 (res, res);
+  return pack_row (_mm_cvtsi128_si32 (res));
+}
+
+/* interpolate the colours of one quadrant to 2 pixels */
+static inline PVR_TARGET_SSE2 __m128i
+sse2_spatial (const Color *col,
+              guint        block_stride,
+              __m128i      ax,
+              __m128i      nax,
+              __m128i      zx,
+              __m128i      ay,
+              __m128i      nay,
+              __m128i      zy)
+{
+  __m128i tmpa, tmpb;
+
+  tmpa = sse2_interp (sse2_load_color_x2 (&col[0]),
+                      sse2_load_color_x2 (&col[1]), ax, nax, zx);
+  tmpb = sse2_interp (sse2_load_color_x2 (&col[block_stride]),
+                      sse2_load_color_x2 (&col[block_stride+1]), ax, nax, zx);
+  return sse2_interp (tmpa, tmpb, ay, nay, zy);
+}
+
+static PVR_TARGET_SSE2 guint32
+modulate_block_sse2 (const Color *pixels,
+                     guint        pixel_stride,
+                     const Color *low,
+                     const Color *high,
+                     guint        block_stride)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i full = _mm_set1_epi16 (255);
+  const __m128i m96 = _mm_set1_epi16 (96), n96 = _mm_set1_epi16 (159);
+  const __m128i m160 = _mm_set1_epi16 (160), n160 = _mm_set1_epi16 (95);
+  /* horizontal weights for the left and right pair of pixels */
+  const __m128i axl = _mm_set_epi16 (192, 192, 192, 192, 128, 128, 128, 128);
+  const __m128i axr = _mm_set_epi16 (64, 64, 64, 64, 0, 0, 0, 0);
+  const __m128i naxl = _mm_sub_epi16 (full, axl);
+  const __m128i naxr = _mm_sub_epi16 (full, axr);
+  const __m128i zxr = _mm_cmpeq_epi16 (axr, zero);
+  guint32 result = 0;
+  gint by;
+
+  for (by = 0; by < 4; by++)
+    {
+      const Color *l = &low[((by+2)>>2) * block_stride];
+      const Color *h = &high[((by+2)>>2) * block_stride];
+      __m128i ay = _mm_set1_epi16 (y_weights[by]);
+      __m128i nay = _mm_sub_epi16 (full, ay);
+      __m128i zy = _mm_cmpeq_epi16 (ay, zero);
+      __m128i px, pl, pr;
+      __m128i cll, chl, clml, chml, clr, chr, clmr, chmr;
+
+      px = _mm_loadu_si128 ((const __m128i *) &pixels[by * pixel_stride]);
+      pl = _mm_unpacklo_epi8 (px, zero);
+      pr = _mm_unpackhi_epi8 (px, zero);
+
+      cll = sse2_spatial (l, block_stride, axl, naxl, zero, ay, nay, zy);
+      chl = sse2_spatial (h, block_stride, axl, naxl, zero, ay, nay, zy);
+      clr = sse2_spatial (l+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+      chr = sse2_spatial (h+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+
+      /* mid-colours, 3/8 and 5/8 */
+      clml = sse2_interp (cll, chl, m96, n96, zero);
+      chml = sse2_interp (cll, chl, m160, n160, zero);
+      clmr = sse2_interp (clr, chr, m96, n96, zero);
+      chmr = sse2_interp (clr, chr, m160, n160, zero);
+
+      result |= sse2_select (
+          sse2_sum_pixels (sse2_abs_diff (pl, cll), sse2_abs_diff (pr, clr)),
+          sse2_sum_pixels (sse2_abs_diff (pl, clml), sse2_abs_diff (pr, clmr)),
+          sse2_sum_pixels (sse2_abs_diff (pl, chml), sse2_abs_diff (pr, chmr)),
+          sse2_sum_pixels (sse2_abs_diff (pl, chl), sse2_abs_diff (pr, chr)))
+          << (by * 8);
+    }
+
+  return result & ~flat_mask (low, high, block_stride);
+}
+
+/* load the colours of two quadrants side by side, each twice over */
+static inline PVR_TARGET_AVX2 __m256i
+avx2_load_color_x4 (const Color *col)
+{
+  return _mm256_inserti128_si256 (
+      _mm256_castsi128_si256 (sse2_load_color_x2 (&col[0])),
+      sse2_load_color_x2 (&col[1]), 1);
+}
+
+static inline PVR_TARGET_AVX2 __m256i
+avx2_interp (__m256i a,
+             __m256i b,
+             __m256i amt,
+             __m256i namt,
+             __m256i zero)
+{
+  __m256i r = _mm256_srli_epi16 (
+      _mm256_add_epi16 (_mm256_mullo_epi16 (a, namt),
+                        _mm256_mullo_epi16 (b, amt)), 8);
+
+  return _mm256_blendv_epi8 (r, a, zero);
+}
+
+/* one difference per pixel for a whole row */
+static inline PVR_TARGET_AVX2 __m128i
+avx2_diff (__m256i a,
+           __m256i b)
+{
+  __m256i d = _mm256_or_si256 (_mm256_subs_epu16 (a, b),
+                               _mm256_subs_epu16 (b, a));
+
+  d = _mm256_madd_epi16 (d, _mm256_set1_epi16 (1));
+  d = _mm256_hadd_epi32 (d, d);
+  d = _mm256_permute4x64_epi64 (d, _MM_SHUFFLE (3, 1, 2, 0));
+  return _mm256_castsi256_si128 (d);
+}
+
+static PVR_TARGET_AVX2 guint32
+modulate_block_avx2 (const Color *pixels,
+                     guint        pixel_stride,
+                     const Color *low,
+                     const Color *high,
+                     guint        block_stride)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i full = _mm256_set1_epi16 (255);
+  const __m256i m96 = _mm256_set1_epi16 (96), n96 = _mm256_set1_epi16 (159);
+  const __m256i m160 = _mm256_set1_epi16 (160), n160 = _mm256_set1_epi16 (95);
+  const __m256i ax = _mm256_set_epi16 (64, 64, 64, 64, 0, 0, 0, 0,
+                                       192, 192, 192, 192, 128, 128, 128, 128);
+  const __m256i nax = _mm256_sub_epi16 (full, ax);
+  const __m256i zx = _mm256_cmpeq_epi16 (ax, zero);
+  guint32 result = 0;
+  gint by;
+
+  for (by = 0; by < 4; by++)
+    {
+      const Color *l = &low[((by+2)>>2) * block_stride];
+      const Color *h = &high[((by+2)>>2) * block_stride];
+      __m256i ay = _mm256_set1_epi16 (y_weights[by]);
+      __m256i nay = _mm256_sub_epi16 (full, ay);
+      __m256i zy = _mm256_cmpeq_epi16 (ay, zero);
+      __m256i px, tmpa, tmpb, cl, ch, clm, chm;
+
+      px = _mm256_cvtepu8_epi16 (
+          _mm_loadu_si128 ((const __m128i *) &pixels[by * pixel_stride]));
+
+      tmpa = avx2_interp (avx2_load_color_x4 (&l[0]),
+                          avx2_load_color_x4 (&l[1]), ax, nax, zx);
+      tmpb = avx2_interp (avx2_load_color_x4 (&l[block_stride]),
+                          avx2_load_color_x4 (&l[block_stride+1]),
+                          ax, nax, zx);
+      cl = avx2_interp (tmpa, tmpb, ay, nay, zy);
+
+      tmpa = avx2_interp (avx2_load_color_x4 (&h[0]),
+                          avx2_load_color_x4 (&h[1]), ax, nax, zx);
+      tmpb = avx2_interp (avx2_load_color_x4 (&h[block_stride]),
+                          avx2_load_color_x4 (&h[block_stride+1]),
+                          ax, nax, zx);
+      ch = avx2_interp (tmpa, tmpb, ay, nay, zy);
+
+      clm = avx2_interp (cl, ch, m96, n96, zero);
+      chm = avx2_interp (cl, ch, m160, n160, zero);
+
+      result |= sse2_select (avx2_diff (px, cl),
+                             avx2_diff (px, clm),
+                             avx2_diff (px, chm),
+                             avx2_diff (px, ch)) << (by * 8);
+    }
+
+  return result & ~flat_mask (low, high, block_stride);
+}
+
+/* pick a, b, c or d for each lane depending on whether code is 0-3 */
+static inline PVR_TARGET_SSE2 __m128i
+sse2_choose (__m128i code,
+             __m128i a,
+             __m128i b,
+             __m128i c,
+             __m128i d)
+{
+  __m128i m;
+
+  m = _mm_cmpeq_epi16 (code, _mm_set1_epi16 (2));
+  d = _mm_or_si128 (_mm_and_si128 (m, c), _mm_andnot_si128 (m, d));
+  m = _mm_cmpeq_epi16 (code, _mm_set1_epi16 (1));
+  d = _mm_or_si128 (_mm_and_si128 (m, b), _mm_andnot_si128 (m, d));
+  m = _mm_cmpeq_epi16 (code, _mm_setzero_si128 ());
+  return _mm_or_si128 (_mm_and_si128 (m, a), _mm_andnot_si128 (m, d));
+}
+
+static PVR_TARGET_SSE2 void
+decode_block_sse2 (guint32      modulation,
+                   gboolean     punch_through,
+                   const Color *low,
+                   const Color *high,
+                   guint        block_stride,
+                   Color       *out,
+                   guint        out_stride)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i full = _mm_set1_epi16 (255);
+  const __m128i axl = _mm_set_epi16 (192, 192, 192, 192, 128, 128, 128, 128);
+  const __m128i axr = _mm_set_epi16 (64, 64, 64, 64, 0, 0, 0, 0);
+  const __m128i naxl = _mm_sub_epi16 (full, axl);
+  const __m128i naxr = _mm_sub_epi16 (full, axr);
+  const __m128i zxr = _mm_cmpeq_epi16 (axr, zero);
+  /* the two mid-colours: 3/8 and 5/8, or 1/2 and 1/2 with no alpha */
+  const __m128i m1 = _mm_set1_epi16 (punch_through ? 128 : 96);
+  const __m128i m2 = _mm_set1_epi16 (punch_through ? 128 : 160);
+  const __m128i nm1 = _mm_sub_epi16 (full, m1);
+  const __m128i nm2 = _mm_sub_epi16 (full, m2);
+  const __m128i keep = punch_through ?
+      _mm_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1) : _mm_set1_epi16 (-1);
+  gint by;
+
+  for (by = 0; by < 4; by++)
+    {
+      const Color *l = &low[((by+2)>>2) * block_stride];
+      const Color *h = &high[((by+2)>>2) * block_stride];
+      __m128i ay = _mm_set1_epi16 (y_weights[by]);
+      __m128i nay = _mm_sub_epi16 (full, ay);
+      __m128i zy = _mm_cmpeq_epi16 (ay, zero);
+      guint bits = modulation >> (by * 8);
+      __m128i codel, coder;
+      __m128i cll, chl, clr, chr, left, right;
+
+      cll = sse2_spatial (l, block_stride, axl, naxl, zero, ay, nay, zy);
+      chl = sse2_spatial (h, block_stride, axl, naxl, zero, ay, nay, zy);
+      clr = sse2_spatial (l+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+      chr = sse2_spatial (h+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+
+      codel = _mm_set_epi16 ((bits >> 2) & 3, (bits >> 2) & 3,
+                             (bits >> 2) & 3, (bits >> 2) & 3,
+                             bits & 3, bits & 3, bits & 3, bits & 3);
+      coder = _mm_set_epi16 ((bits >> 6) & 3, (bits >> 6) & 3,
+                             (bits >> 6) & 3, (bits >> 6) & 3,
+                             (bits >> 4) & 3, (bits >> 4) & 3,
+                             (bits >> 4) & 3, (bits >> 4) & 3);
+
+      left = sse2_choose (codel, cll,
+                          sse2_interp (cll, chl, m1, nm1, zero),
+                          _mm_and_si128 (sse2_interp (cll, chl, m2, nm2, zero),
+                                         keep),
+                          chl);
+      right = sse2_choose (coder, clr,
+                           sse2_interp (clr, chr, m1, nm1, zero),
+                           _mm_and_si128 (sse2_interp (clr, chr, m2, nm2, zero),
+                                          keep),
+                           chr);
+
+      _mm_storeu_si128 ((__m128i *) &out[by * out_stride],
+                        _mm_packus_epi16 (left, right));
+    }
+}
+
+static PVR_TARGET_AVX2 void
+decode_block_avx2 (guint32      modulation,
+                   gboolean     punch_through,
+                   const Color *low,
+                   const Color *high,
+                   guint        block_stride,
+                   Color       *out,
+                   guint        out_stride)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i full = _mm256_set1_epi16 (255);
+  const __m256i ax = _mm256_set_epi16 (64, 64, 64, 64, 0, 0, 0, 0,
+                                       192, 192, 192, 192, 128, 128, 128, 128);
+  const __m256i nax = _mm256_sub_epi16 (full, ax);
+  const __m256i zx = _mm256_cmpeq_epi16 (ax, zero);
+  const __m256i m1 = _mm256_set1_epi16 (punch_through ? 128 : 96);
+  const __m256i m2 = _mm256_set1_epi16 (punch_through ? 128 : 160);
+  const __m256i nm1 = _mm256_sub_epi16 (full, m1);
+  const __m256i nm2 = _mm256_sub_epi16 (full, m2);
+  const __m256i keep = punch_through ?
+      _mm256_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1,
+                        0, -1, -1, -1, 0, -1, -1, -1) :
+      _mm256_set1_epi16 (-1);
+  gint by;
+
+  for (by = 0; by < 4; by++)
+    {
+      const Color *l = &low[((by+2)>>2) * block_stride];
+      const Color *h = &high[((by+2)>>2) * block_stride];
+      __m256i ay = _mm256_set1_epi16 (y_weights[by]);
+      __m256i nay = _mm256_sub_epi16 (full, ay);
+      __m256i zy = _mm256_cmpeq_epi16 (ay, zero);
+      guint bits = modulation >> (by * 8);
+      __m256i code, tmpa, tmpb, cl, ch, col, m;
+
+      tmpa = avx2_interp (avx2_load_color_x4 (&l[0]),
+                          avx2_load_color_x4 (&l[1]), ax, nax, zx);
+      tmpb = avx2_interp (avx2_load_color_x4 (&l[block_stride]),
+                          avx2_load_color_x4 (&l[block_stride+1]),
+                          ax, nax, zx);
+      cl = avx2_interp (tmpa, tmpb, ay, nay, zy);
+
+      tmpa = avx2_interp (avx2_load_color_x4 (&h[0]),
+                          avx2_load_color_x4 (&h[1]), ax, nax, zx);
+      tmpb = avx2_interp (avx2_load_color_x4 (&h[block_stride]),
+                          avx2_load_color_x4 (&h[block_stride+1]),
+                          ax, nax, zx);
+      ch = avx2_interp (tmpa, tmpb, ay, nay, zy);
+
+      code = _mm256_set_epi16 ((bits >> 6) & 3, (bits >> 6) & 3,
+                               (bits >> 6) & 3, (bits >> 6) & 3,
+                               (bits >> 4) & 3, (bits >> 4) & 3,
+                               (bits >> 4) & 3, (bits >> 4) & 3,
+                               (bits >> 2) & 3, (bits >> 2) & 3,
+                               (bits >> 2) & 3, (bits >> 2) & 3,
+                               bits & 3, bits & 3, bits & 3, bits & 3);
+
+      col = ch;
+      m = _mm256_cmpeq_epi16 (code, _mm256_set1_epi16 (2));
+      col = _mm256_blendv_epi8 (col,
+                                _mm256_and_si256 (avx2_interp (cl, ch, m2, nm2,
+                                                               zero),
+                                                  keep), m);
+      m = _mm256_cmpeq_epi16 (code, _mm256_set1_epi16 (1));
+      col = _mm256_blendv_epi8 (col, avx2_interp (cl, ch, m1, nm1, zero), m);
+      m = _mm256_cmpeq_epi16 (code, zero);
+      col = _mm256_blendv_epi8 (col, cl, m);
+
+      _mm_storeu_si128 ((__m128i *) &out[by * out_stride],
+                        _mm_packus_epi16 (_mm256_castsi256_si128 (col),
+                                          _mm256_extracti128_si256 (col, 1)));
+    }
+}
+
+#endif /* HAVE_PVR_SSE2 */
+
+#if HAVE_PVR_NEON
+
+static inline uint16x8_t
+neon_load_color_x2 (const Color *col)
+{
+  uint8x8_t v = vreinterpret_u8_u32 (vdup_n_u32 (load_color (col)));
+
+  return vmovl_u8 (v);
+}
+
+static inline uint16x8_t
+neon_interp (uint16x8_t a,
+             uint16x8_t b,
+             uint16x8_t amt,
+             uint16x8_t namt,
+             uint16x8_t zero)
+{
+  uint16x8_t r = vshrq_n_u16 (vmlaq_u16 (vmulq_u16 (a, namt), b, amt), 8);
+
+  return vbslq_u16 (zero, a, r);
+}
+
+static inline uint32x4_t
+neon_diff (uint16x8_t left_pixels,
+           uint16x8_t left,
+           uint16x8_t right_pixels,
+           uint16x8_t right)
+{
+  uint32x4_t l = vpaddlq_u16 (vabdq_u16 (left_pixels, left));
+  uint32x4_t r = vpaddlq_u16 (vabdq_u16 (right_pixels, right));
+
+  return vcombine_u32 (vpadd_u32 (vget_low_u32 (l), vget_high_u32 (l)),
+                       vpadd_u32 (vget_low_u32 (r), vget_high_u32 (r)));
+}
+
+static inline guint32
+neon_select (uint32x4_t d0,
+             uint32x4_t d1,
+             uint32x4_t d2,
+             uint32x4_t d3)
+{
+  uint32x4_t r0 = vandq_u32 (vandq_u32 (vcltq_u32 (d0, d1),
+                                        vcltq_u32 (d0, d2)),
+                             vcltq_u32 (d0, d3));
+  uint32x4_t r1 = vandq_u32 (vcltq_u32 (d1, d2), vcltq_u32 (d1, d3));
+  uint32x4_t r2 = vcltq_u32 (d2, d3);
+  uint32x4_t res = vdupq_n_u32 (3);
+  uint8x8_t packed;
+
+  res = vbslq_u32 (r2, vdupq_n_u32 (2), res);
+  res = vbslq_u32 (r1, vdupq_n_u32 (1), res);
+  res = vbicq_u32 (res, r0);
+
+  packed = vmovn_u16 (vcombine_u16 (vmovn_u32 (res), vmovn_u32 (res)));
+  return pack_row (vget_lane_u32 (vreinterpret_u32_u8 (packed), 0));
+}
+
+static inline uint16x8_t
+neon_spatial (const Color *col,
+              guint        block_stride,
+              uint16x8_t   ax,
+              uint16x8_t   nax,
+              uint16x8_t   zx,
+              uint16x8_t   ay,
+              uint16x8_t   nay,
+              uint16x8_t   zy)
+{
+  uint16x8_t tmpa, tmpb;
+
+  tmpa = neon_interp (neon_load_color_x2 (&col[0]),
+                      neon_load_color_x2 (&col[1]), ax, nax, zx);
+  tmpb = neon_interp (neon_load_color_x2 (&col[block_stride]),
+                      neon_load_color_x2 (&col[block_stride+1]), ax, nax, zx);
+  return neon_interp (tmpa, tmpb, ay, nay, zy);
+}
+
+static guint32
+modulate_block_neon (const Color *pixels,
+                     guint        pixel_stride,
+                     const Color *low,
+                     const Color *high,
+                     guint        block_stride)
+{
+  static const guint16 axl_init[8] = { 128, 128, 128, 128, 192, 192, 192, 192 };
+  static const guint16 axr_init[8] = { 0, 0, 0, 0, 64, 64, 64, 64 };
+  const uint16x8_t zero = vdupq_n_u16 (0);
+  const uint16x8_t full = vdupq_n_u16 (255);
+  const uint16x8_t m96 = vdupq_n_u16 (96), n96 = vdupq_n_u16 (159);
+  const uint16x8_t m160 = vdupq_n_u16 (160), n160 = vdupq_n_u16 (95);
+  const uint16x8_t axl = vld1q_u16 (axl_init);
+  const uint16x8_t axr = vld1q_u16 (axr_init);
+  const uint16x8_t naxl = vsubq_u16 (full, axl);
+  const uint16x8_t naxr = vsubq_u16 (full, axr);
+  const uint16x8_t zxr = vceqq_u16 (axr, zero);
+  guint32 result = 0;
+  gint by;
+
+  for (by = 0; by < 4; by++)
+    {
+      const Color *l = &low[((by+2)>>2) * block_stride];
+      const Color *h = &high[((by+2)>>2) * block_stride];
+      uint16x8_t ay = vdupq_n_u16 (y_weights[by]);
+      uint16x8_t nay = vsubq_u16 (full, ay);
+      uint16x8_t zy = vceqq_u16 (ay, zero);
+      uint8x16_t px;
+      uint16x8_t pl, pr;
+      uint16x8_t cll, chl, clml, chml, clr, chr, clmr, chmr;
+
+      px = vld1q_u8 ((const guint8 *) &pixels[by * pixel_stride]);
+      pl = vmovl_u8 (vget_low_u8 (px));
+      pr = vmovl_u8 (vget_high_u8 (px));
+
+      cll = neon_spatial (l, block_stride, axl, naxl, zero, ay, nay, zy);
+      chl = neon_spatial (h, block_stride, axl, naxl, zero, ay, nay, zy);
+      clr = neon_spatial (l+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+      chr = neon_spatial (h+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+
+      clml = neon_interp (cll, chl, m96, n96, zero);
+      chml = neon_interp (cll, chl, m160, n160, zero);
+      clmr = neon_interp (clr, chr, m96, n96, zero);
+      chmr = neon_interp (clr, chr, m160, n160, zero);
+
+      result |= neon_select (neon_diff (pl, cll, pr, clr),
+                             neon_diff (pl, clml, pr, clmr),
+                             neon_diff (pl, chml, pr, chmr),
+                             neon_diff (pl, chl, pr, chr)) << (by * 8);
+    }
+
+  return result & ~flat_mask (low, high, block_stride);
+}
+
+static void
+decode_block_neon (guint32      modulation,
+                   gboolean     punch_through,
+                   const Color *low,
+                   const Color *high,
+                   guint        block_stride,
+                   Color       *out,
+                   guint        out_stride)
+{
+  static const guint16 axl_init[8] = { 128, 128, 128, 128, 192, 192, 192, 192 };
+  static const guint16 axr_init[8] = { 0, 0, 0, 0, 64, 64, 64, 64 };
+  static const guint16 keep_init[8] = { 0xFFFF, 0xFFFF, 0xFFFF, 0,
+                                        0xFFFF, 0xFFFF, 0xFFFF, 0 };
+  const uint16x8_t zero = vdupq_n_u16 (0);
+  const uint16x8_t full = vdupq_n_u16 (255);
+  const uint16x8_t axl = vld1q_u16 (axl_init);
+  const uint16x8_t axr = vld1q_u16 (axr_init);
+  const uint16x8_t naxl = vsubq_u16 (full, axl);
+  const uint16x8_t naxr = vsubq_u16 (full, axr);
+  const uint16x8_t zxr = vceqq_u16 (axr, zero);
+  const uint16x8_t m1 = vdupq_n_u16 (punch_through ? 128 : 96);
+  const uint16x8_t m2 = vdupq_n_u16 (punch_through ? 128 : 160);
+  const uint16x8_t nm1 = vsubq_u16 (full, m1);
+  const uint16x8_t nm2 = vsubq_u16 (full, m2);
+  const uint16x8_t keep = punch_through ? vld1q_u16 (keep_init) :
+                                          vdupq_n_u16 (0xFFFF);
+  gint by;
+
+  for (by = 0; by < 4; by++)
+    {
+      const Color *l = &low[((by+2)>>2) * block_stride];
+      const Color *h = &high[((by+2)>>2) * block_stride];
+      uint16x8_t ay = vdupq_n_u16 (y_weights[by]);
+      uint16x8_t nay = vsubq_u16 (full, ay);
+      uint16x8_t zy = vceqq_u16 (ay, zero);
+      guint bits = modulation >> (by * 8);
+      guint16 codes[16];
+      uint16x8_t cl[2], ch[2], col[2];
+      gint i, side;
+
+      for (i = 0; i < 16; i++)
+        codes[i] = (bits >> ((i / 4) * 2)) & 3;
+
+      cl[0] = neon_spatial (l, block_stride, axl, naxl, zero, ay, nay, zy);
+      ch[0] = neon_spatial (h, block_stride, axl, naxl, zero, ay, nay, zy);
+      cl[1] = neon_spatial (l+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+      ch[1] = neon_spatial (h+1, block_stride, axr, naxr, zxr, ay, nay, zy);
+
+      for (side = 0; side < 2; side++)
+        {
+          uint16x8_t code = vld1q_u16 (&codes[side * 8]);
+
+          col[side] = ch[side];
+          col[side] = vbslq_u16 (vceqq_u16 (code, vdupq_n_u16 (2)),
+                                 vandq_u16 (neon_interp (cl[side], ch[side],
+                                                         m2, nm2, zero),
+                                            keep),
+                                 col[side]);
+          col[side] = vbslq_u16 (vceqq_u16 (code, vdupq_n_u16 (1)),
+                                 neon_interp (cl[side], ch[side],
+                                              m1, nm1, zero),
+                                 col[side]);
+          col[side] = vbslq_u16 (vceqq_u16 (code, zero), cl[side], col[side]);
+        }
+
+      vst1q_u8 ((guint8 *) &out[by * out_stride],
+                vcombine_u8 (vmovn_u16 (col[0]), vmovn_u16 (col[1])));
+    }
+}
+
+#endif /* HAVE_PVR_NEON */
+
+PvrModulateBlockFunc
+_pvr_texture_simd_get_modulate_block (PvrSimd simd)
+{
+#if HAVE_PVR_SSE2
+  __builtin_cpu_init ();
+
+  if ((simd == PVR_SIMD_AUTO || simd == PVR_SIMD_AVX2) &&
+      __builtin_cpu_supports ("avx2"))
+    return modulate_block_avx2;
+  if ((simd == PVR_SIMD_AUTO || simd == PVR_SIMD_SSE2) &&
+      __builtin_cpu_supports ("sse2"))
+    return modulate_block_sse2;
+#endif
+#if HAVE_PVR_NEON
+  /* if we were built for NEON the compiler is free to use it anywhere,
+   * so there is nothing to check at runtime */
+  if (simd == PVR_SIMD_AUTO || simd == PVR_SIMD_NEON)
+    return modulate_block_neon;
+#endif
+
+  return NULL;
+}
+
+PvrDecodeBlockFunc
+_pvr_texture_simd_get_decode_block (PvrSimd simd)
+{
+#if HAVE_PVR_SSE2
+  __builtin_cpu_init ();
+
+  if ((simd == PVR_SIMD_AUTO || simd == PVR_SIMD_AVX2) &&
+      __builtin_cpu_supports ("avx2"))
+    return decode_block_avx2;
+  if ((simd == PVR_SIMD_AUTO || simd == PVR_SIMD_SSE2) &&
+      __builtin_cpu_supports ("sse2"))
+    return decode_block_sse2;
+#endif
+#if HAVE_PVR_NEON
+  if (simd == PVR_SIMD_AUTO || simd == PVR_SIMD_NEON)
+    return decode_block_neon;
+#endif
+
+  return NULL;
+}
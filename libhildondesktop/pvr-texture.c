@@ -22,18 +22,47 @@
  *
  */
 
+/* for O_TMPFILE and syncfs */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "pvr-texture.h"
+#include "pvr-texture-private.h"
+#include "hd-pvr-texture-private.h"
 
 #include <glib/gstdio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <math.h>
 
 #define RAND_BLOCK 0 /* apply random noise to blocks */
 #define DITHER_BLOCK 0 /* error-diffusion dither blocks */
-#define DITHER_PIXEL 1 /* error-diffusion dither pixels */
+
+/* For the kernels specialised by DEFINE_PIXEL_CLASS_KERNELS, which rely
+ * on being inlined to drop the work their class doesn't need */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__ ((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* What the alpha of a run of pixels is like, so the encoder can skip
+ * the alpha work where there isn't any */
+typedef enum
+{
+  PIXELS_OPAQUE,  /* alpha all 255: only RGB, and 555 colours */
+  PIXELS_BINARY,  /* alpha all 0 or 255: never dithered */
+  PIXELS_GENERAL
+} PixelClass;
 
 #if USE_GL
 /* These are defined in GLES2/gl2ext + gl2extimg, but we want them available
@@ -45,13 +74,6 @@
 #define GL_ETC1_RGB8_OES                                         0x8D64
 #endif
 
-typedef struct Color {
-  guchar red;
-  guchar green;
-  guchar blue;
-  guchar alpha;
-} Color;
-
 static inline void
 color_interp     (Color       *dest,
                   const Color *src1,
@@ -97,7 +119,6 @@ color_diff       (const Color *src1,
         abs((gint)src1->alpha - (gint)src2->alpha);
 }
 
-#if DITHER_BLOCK | DITHER_PIXEL
 static inline void
 error_add       (Color *dst,
                  const gint *error,
@@ -131,7 +152,31 @@ error_update    (gint *error,
   error[2] += src1->blue - src2->blue;
   error[3] += src1->alpha - src2->alpha;
 }
-#endif
+
+/* the same for pixels whose alpha stays as it is */
+static inline void
+error_add_rgb   (Color *dst,
+                 const gint *error,
+                 const Color *src)
+{
+  gint red = (gint)src->red + error[0];
+  gint green = (gint)src->green + error[1];
+  gint blue = (gint)src->blue + error[2];
+  dst->red = CLAMP (red, 0, 255);
+  dst->green = CLAMP (green, 0, 255);
+  dst->blue = CLAMP (blue, 0, 255);
+  dst->alpha = src->alpha;
+}
+
+static inline void
+error_update_rgb (gint *error,
+                  const Color *src1,
+                  const Color *src2)
+{
+  error[0] += src1->red - src2->red;
+  error[1] += src1->green - src2->green;
+  error[2] += src1->blue - src2->blue;
+}
 
 static inline gboolean
 color_equal      (const Color *src1,
@@ -144,750 +189,4662 @@ color_equal      (const Color *src1,
         src1->alpha == src2->alpha;
 }
 
-/*
- * pvr_texture_save_pvrtc4:
- *
- * saves an already compressed (with pvr_texture_compress)
- * data slice to a file. Returns TRUE on success
- *
- * Since: 0.8.2-maemo
- */
-gboolean pvr_texture_save_pvrtc4(
-                      const gchar *filename,
-                      const guchar *data,
-                      guint data_size,
-                      gint width, gint height)
+static void
+pvr_header_init (PVR_TEXTURE_HEADER *head,
+                 PvrFormat           format,
+                 gint                width,
+                 gint                height,
+                 guint               mipmap_count,
+                 guint               data_size)
 {
-    FILE *texfile;
-    int ret;
-    PVR_TEXTURE_HEADER head;
-    head.dwHeaderSize = sizeof(PVR_TEXTURE_HEADER);     /* size of the structure */
-    head.dwHeight = height;         /* height of surface to be created */
-    head.dwWidth = width;          /* width of input surface */
-    head.dwMipMapCount = 0;    /* number of MIP-map levels requested */
-    head.dwpfFlags = MGLPT_PVRTC4 | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA;        /* pixel format flags */
-    head.dwDataSize = data_size;       /* Size of the compress data */
-    head.dwBitCount = 4;       /* number of bits per pixel */
-    head.dwRBitMask = 0;       /* mask for red bit */
-    head.dwGBitMask = 0;       /* mask for green bits */
-    head.dwBBitMask = 0;       /* mask for blue bits */
-    head.dwAlphaBitMask = 1;   /* mask for alpha channel */
-    head.dwPVR = 'P' | 'V'<<8 | 'R'<<16 | '!'<<24; /* should be 'P' 'V' 'R' '!' */
-    head.dwNumSurfs = 1;       /* number of slices for volume textures or skyboxes */
-
-    /* load file */
-    texfile = g_fopen(filename, "wb");
-    if (!texfile)
-      return FALSE;
+  head->dwHeaderSize = sizeof(PVR_TEXTURE_HEADER);     /* size of the structure */
+  head->dwHeight = height;         /* height of surface to be created */
+  head->dwWidth = width;          /* width of input surface */
+  head->dwMipMapCount = mipmap_count;    /* number of MIP-map levels requested */
+  if (format == PVR_FORMAT_PVRTC2)
+    {
+      head->dwpfFlags = MGLPT_PVRTC2 | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA;        /* pixel format flags */
+      head->dwBitCount = 2;       /* number of bits per pixel */
+    }
+  else if (format == PVR_FORMAT_ETC1)
+    {
+      /* ETC1 blocks are stored in rows, and have no alpha */
+      head->dwpfFlags = ETC_RGB_4BPP;        /* pixel format flags */
+      head->dwBitCount = 4;       /* number of bits per pixel */
+    }
+  else
+    {
+      head->dwpfFlags = MGLPT_PVRTC4 | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA;        /* pixel format flags */
+      head->dwBitCount = 4;       /* number of bits per pixel */
+    }
+  head->dwDataSize = data_size;       /* Size of the compress data */
+  head->dwRBitMask = 0;       /* mask for red bit */
+  head->dwGBitMask = 0;       /* mask for green bits */
+  head->dwBBitMask = 0;       /* mask for blue bits */
+  head->dwAlphaBitMask = format == PVR_FORMAT_ETC1 ? 0 : 1;   /* mask for alpha channel */
+  head->dwPVR = 'P' | 'V'<<8 | 'R'<<16 | '!'<<24; /* should be 'P' 'V' 'R' '!' */
+  head->dwNumSurfs = 1;       /* number of slices for volume textures or skyboxes */
+}
 
-    ret = fwrite(&head, 1, sizeof(PVR_TEXTURE_HEADER), texfile);
-    if (ret != sizeof(PVR_TEXTURE_HEADER))
-      return FALSE;
-    ret = fwrite(data, 1, data_size, texfile);
-    if (ret != data_size)
-      return FALSE;
-    ret = fclose(texfile);
-    if (!ret)
-      return FALSE;
+/* A PVR_SYNC_DEFERRED writer syncs and puts its textures in place once
+ * this many are waiting, or sooner once they add up to this many bytes,
+ * so it doesn't hold too many files open. A PVR_SYNC_TOGETHER writer
+ * waits for pvr_texture_writer_sync regardless */
+#define WRITER_PENDING_FILES 64
+#define WRITER_PENDING_BYTES (16 << 20)
 
-    return TRUE;
-}
+/* A texture file that has been written but isn't in place yet */
+typedef struct
+{
+  gint   fd;
+  gchar *tmpl;     /* its temporary name, or NULL if it has none yet */
+  gchar *filename; /* where it goes */
+} PendingFile;
 
-gboolean
-pvr_texture_save_pvrtc4_atomically (const gchar   *filename,
-                                    const guchar  *data,
-                                    guint          data_size,
-                                    gint           width,
-                                    gint           height,
-                                    GError       **error)
+struct _PvrTextureWriter
 {
-  gchar *tmpl;
-  gint fd;
-  PVR_TEXTURE_HEADER head;
+  PvrSyncPolicy  policy;
+  GPtrArray     *pending;
+  gsize          pending_bytes;
+  /* files from pvr_texture_writer_begin still being written */
+  GPtrArray     *open;
+  PvrTextureWriterFunc func;
+  gpointer       func_data;
+};
 
-  /* Head */
-  head.dwHeaderSize = sizeof(PVR_TEXTURE_HEADER);     /* size of the structure */
-  head.dwHeight = height;         /* height of surface to be created */
-  head.dwWidth = width;          /* width of input surface */
-  head.dwMipMapCount = 0;    /* number of MIP-map levels requested */
-  head.dwpfFlags = MGLPT_PVRTC4 | PVR_FLAG_TWIDDLED | PVR_FLAG_ALPHA;        /* pixel format flags */
-  head.dwDataSize = data_size;       /* Size of the compress data */
-  head.dwBitCount = 4;       /* number of bits per pixel */
-  head.dwRBitMask = 0;       /* mask for red bit */
-  head.dwGBitMask = 0;       /* mask for green bits */
-  head.dwBBitMask = 0;       /* mask for blue bits */
-  head.dwAlphaBitMask = 1;   /* mask for alpha channel */
-  head.dwPVR = 'P' | 'V'<<8 | 'R'<<16 | '!'<<24; /* should be 'P' 'V' 'R' '!' */
-  head.dwNumSurfs = 1;       /* number of slices for volume textures or skyboxes */
-
-  tmpl = g_strdup_printf ("%sXXXXXX", filename);
-  fd = mkstemp (tmpl);
-  if (fd == -1)
-    {
-      GFileError code = g_file_error_from_errno (errno);
+/* writev all of the buffers, carrying on after short writes */
+static gboolean
+writev_all (gint          fd,
+            struct iovec *iov,
+            gint          n_iov)
+{
+  while (n_iov > 0)
+    {
+      ssize_t written = writev (fd, iov, n_iov);
 
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not open template file for %s",
-                   filename);
-      g_free (tmpl);
-      return FALSE;
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      while (n_iov > 0 && (gsize) written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          iov++;
+          n_iov--;
+        }
+      if (n_iov > 0)
+        {
+          iov->iov_base = (guchar *) iov->iov_base + written;
+          iov->iov_len -= written;
+        }
     }
 
-  if (write(fd, &head, sizeof(PVR_TEXTURE_HEADER)) == -1)
+  return TRUE;
+}
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+/* Files made with O_TMPFILE are given a name by linking them from /proc,
+ * as linking the descriptor itself is only allowed to root */
+static gboolean
+can_link_unnamed (void)
+{
+  static gint result = -1;
+
+  if (result == -1)
+    result = g_file_test ("/proc/self/fd", G_FILE_TEST_IS_DIR);
+
+  return result;
+}
+#endif
+
+G_LOCK_DEFINE_STATIC (file_mode);
+
+/* The mode open would give a new texture: readable by everyone, as themes
+ * need, less the umask. The umask can only be read by setting it, so
+ * that is done once and it is put straight back */
+static mode_t
+new_file_mode (void)
+{
+  static gboolean known = FALSE;
+  static mode_t mode;
+
+  G_LOCK (file_mode);
+  if (!known)
     {
-      GFileError code = g_file_error_from_errno (errno);
+      mode_t mask = umask (0);
 
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not write header to %s",
-                   tmpl);
-      g_free (tmpl);
-      return FALSE;
+      umask (mask);
+      mode = 0644 & ~mask;
+      known = TRUE;
     }
+  G_UNLOCK (file_mode);
+
+  return mode;
+}
+
+/* Throws the file away, leaving whatever is at its filename alone */
+static void
+pending_file_discard (PendingFile *file)
+{
+  if (file->fd != -1)
+    close (file->fd);
+  if (file->tmpl)
+    g_unlink (file->tmpl);
+  g_free (file->tmpl);
+  g_free (file->filename);
+  g_free (file);
+}
+
+/* Opens a file for a texture to go to @filename. Where the kernel and
+ * file system allow it the file has no name until pending_file_commit,
+ * so a crash leaves nothing behind; otherwise it is a temporary file
+ * next to @filename */
+static PendingFile *
+pending_file_new (const gchar  *filename,
+                  GError      **error)
+{
+  PendingFile *file;
+
+  file = g_new0 (PendingFile, 1);
+  file->filename = g_strdup (filename);
 
-  if (write(fd, data, data_size) == -1)
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+  if (can_link_unnamed ())
     {
-      GFileError code = g_file_error_from_errno (errno);
+      gchar *dir = g_path_get_dirname (filename);
 
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not write header to %s",
-                   tmpl);
-      g_free (tmpl);
-      return FALSE;
+      /* older kernels and some file systems fail this, and then we fall
+       * back to a named file */
+      file->fd = open (dir, O_TMPFILE | O_WRONLY, 0644);
+      g_free (dir);
+      if (file->fd != -1)
+        return file;
     }
+#endif
 
-  if (fdatasync (fd) == -1)
+  file->tmpl = g_strdup_printf ("%sXXXXXX", filename);
+  file->fd = mkstemp (file->tmpl);
+  if (file->fd == -1)
     {
-      GFileError code = g_file_error_from_errno (errno);
+      hd_pvr_texture_set_file_error (error,
+                                     "Could not open template file for %s",
+                                     filename);
+      g_free (file->tmpl);
+      file->tmpl = NULL;
+      pending_file_discard (file);
+      return NULL;
+    }
 
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not sync %s",
-                   tmpl);
-      g_free (tmpl);
-      return FALSE;
+  /* mkstemp makes files only we can read, whatever the umask */
+  if (fchmod (file->fd, new_file_mode ()) == -1)
+    {
+      hd_pvr_texture_set_file_error (error, "Could not set the mode of %s",
+                                     file->tmpl);
+      pending_file_discard (file);
+      return NULL;
     }
 
-  if (close (fd) == -1)
+  return file;
+}
+
+/* Gives the file its name, replacing whatever was there, and closes it.
+ * If that fails the file is left to pending_file_discard */
+static gboolean
+pending_file_commit (PendingFile  *file,
+                     GError      **error)
+{
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+  if (!file->tmpl)
     {
-      GFileError code = g_file_error_from_errno (errno);
+      gchar *path = g_strdup_printf ("/proc/self/fd/%d", file->fd);
+      gboolean ret;
 
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   code,
-                   "Could not close %s",
-                   tmpl);
-      g_free (tmpl);
+      /* linkat won't replace a file, so if there is one already the
+       * texture gets a temporary name after all, just long enough to
+       * rename it over */
+      ret = linkat (AT_FDCWD, path, AT_FDCWD, file->filename,
+                    AT_SYMLINK_FOLLOW) == 0;
+      while (!ret && errno == EEXIST)
+        {
+          g_free (file->tmpl);
+          file->tmpl = g_strdup_printf ("%s%06X", file->filename,
+                                        g_random_int_range (0, 0x1000000));
+          ret = linkat (AT_FDCWD, path, AT_FDCWD, file->tmpl,
+                        AT_SYMLINK_FOLLOW) == 0;
+        }
+      g_free (path);
+
+      if (!ret)
+        {
+          hd_pvr_texture_set_file_error (error, "Could not link %s",
+                                         file->filename);
+          g_free (file->tmpl);
+          file->tmpl = NULL;
+          return FALSE;
+        }
+    }
+#endif
+
+  if (close (file->fd) == -1)
+    {
+      file->fd = -1;
+      hd_pvr_texture_set_file_error (error, "Could not close %s",
+                                     file->filename);
       return FALSE;
     }
+  file->fd = -1;
 
-  if (rename (tmpl, filename) == -1)
+  if (file->tmpl && rename (file->tmpl, file->filename) == -1)
     {
-      GFileError code = g_file_error_from_errno (errno);
+      gint saved_errno = errno;
 
       g_set_error (error,
                    G_FILE_ERROR,
-                   code,
-                   "Could not rename %s to %s",
-                   tmpl,
-                   filename);
-      g_free (tmpl);
+                   g_file_error_from_errno (saved_errno),
+                   "Could not rename %s to %s: %s",
+                   file->tmpl,
+                   file->filename,
+                   g_strerror (saved_errno));
       return FALSE;
     }
+  g_free (file->tmpl);
+  file->tmpl = NULL;
 
-  g_free (tmpl);
   return TRUE;
 }
 
-#define SETMIN(result, col) { \
-        if ((result).red   > (col).red)   (result).red   = (col).red; \
-        if ((result).green > (col).green) (result).green = (col).green; \
-        if ((result).blue  > (col).blue)  (result).blue  = (col).blue; \
-        if ((result).alpha > (col).alpha) (result).alpha = (col).alpha; \
-}
-#define SETMAX(result, col) { \
-        if ((result).red   < (col).red)   (result).red   = (col).red; \
-        if ((result).green < (col).green) (result).green = (col).green; \
-        if ((result).blue  < (col).blue)  (result).blue  = (col).blue; \
-        if ((result).alpha < (col).alpha) (result).alpha = (col).alpha; \
-}
-
-inline static guchar find_best(
-                Color pixel_col,
-                Color *low,
-                Color *high,
-                guint block_stride,
-                guint x_interp,
-                guint y_interp)
+/* Gets the data of the files onto the disk, one by one, which still lets
+ * the disk take them together as they have all been written already */
+static gboolean
+pending_files_datasync (GPtrArray  *files,
+                        GError    **error)
 {
-  Color tmpa, tmpb;
-  guchar amtx, amty;
-  Color cl, ch, clm, chm;
-  guint diff[4];
+  guint i;
 
-  /* special case - if everything is equal then we don't care what we choose
-   * and we can skip a load of calculation */
-  if (color_equal(&low[0], &low[1]) &&
-      color_equal(&low[block_stride], &low[block_stride+1]) &&
-      color_equal(&low[block_stride], &low[0]) &&
-      color_equal(&high[0], &high[1]) &&
-      color_equal(&high[block_stride], &high[block_stride+1]) &&
-      color_equal(&high[block_stride], &high[0]) &&
-      color_equal(&low[0], &high[0]))
-    return 0;
+  for (i = 0; i < files->len; i++)
+    {
+      PendingFile *file = g_ptr_array_index (files, i);
 
-  /* interpolate our colours spatially */
+      if (fdatasync (file->fd) == -1)
+        {
+          hd_pvr_texture_set_file_error (error, "Could not sync %s",
+                                         file->filename);
+          return FALSE;
+        }
+    }
 
-  amtx = x_interp * 64;
-  amty = y_interp * 64;
+  return TRUE;
+}
 
-  color_interp(&tmpa, &low[0], &low[1], amtx);
-  color_interp(&tmpb, &low[block_stride], &low[block_stride+1], amtx);
-  color_interp(&cl, &tmpa, &tmpb, amty);
+/* Gets the data of a group of files onto the disk: with syncfs, once for
+ * each file system they are on. That flushes everything else waiting on
+ * those file systems too, so it is only worth it for several files */
+static gboolean
+pending_files_sync (GPtrArray  *files,
+                    GError    **error)
+{
+#ifdef HAVE_SYNCFS
+  dev_t *devs;
+  guint n_devs = 0, i, j;
 
-  color_interp(&tmpa, &high[0], &high[1], amtx);
-  color_interp(&tmpb, &high[block_stride], &high[block_stride+1], amtx);
-  color_interp(&ch, &tmpa, &tmpb, amty);
+  if (files->len < 2)
+    return pending_files_datasync (files, error);
 
-  /* interpolate for the mid-colours */
-  color_interp(&clm, &cl, &ch, 96); /* 3/8 */
-  color_interp(&chm, &cl, &ch, 160); /* 5/8 */
+  devs = g_new (dev_t, files->len);
+  for (i = 0; i < files->len; i++)
+    {
+      PendingFile *file = g_ptr_array_index (files, i);
+      struct stat st;
 
-  /* work out differences */
-  diff[0] = color_diff(&pixel_col, &cl);
-  diff[1] = color_diff(&pixel_col, &clm);
-  diff[2] = color_diff(&pixel_col, &chm);
-  diff[3] = color_diff(&pixel_col, &ch);
+      if (fstat (file->fd, &st) == -1)
+        {
+          hd_pvr_texture_set_file_error (error, "Could not sync %s",
+                                         file->filename);
+          g_free (devs);
+          return FALSE;
+        }
+      for (j = 0; j < n_devs && devs[j] != st.st_dev; j++)
+        ;
+      if (j < n_devs)
+        continue;
+      devs[n_devs++] = st.st_dev;
 
-  /* work out which one is smaller */
-  if (diff[0] < diff[1] && diff[0] < diff[2] && diff[0] < diff[3])
-    return 0;
-  if (diff[1] < diff[2] && diff[1] < diff[3])
-    return 1;
-  if (diff[2] < diff[3])
-    return 2;
-  return 3;
+      if (syncfs (file->fd) == -1)
+        {
+          hd_pvr_texture_set_file_error (error, "Could not sync %s",
+                                         file->filename);
+          g_free (devs);
+          return FALSE;
+        }
+    }
+
+  g_free (devs);
+  return TRUE;
+#else
+  return pending_files_datasync (files, error);
+#endif
 }
 
-inline static guint color_to_pvr_color( Color *col )
+/* Syncs the directories the files went in, each once, so that their new
+ * names stick */
+static gboolean
+pending_files_sync_dirs (GPtrArray  *files,
+                         GError    **error)
 {
-  /* 16 bit colour, if top bit is 1 it's 555, otherwise
-   * it's 3444 */
-  if (col->alpha >= 224)
+  GPtrArray *dirs = g_ptr_array_new ();
+  gboolean ret = TRUE;
+  guint i, j;
+
+  for (i = 0; i < files->len; i++)
     {
-      /* We're opaqueish */
-      return 0x8000 |
-             ((col->red & 0xF8) << 7) |
-             ((col->green & 0xF8) << 2) |
-             (col->blue >> 3);
+      PendingFile *file = g_ptr_array_index (files, i);
+      gchar *dir = g_path_get_dirname (file->filename);
+
+      for (j = 0; j < dirs->len; j++)
+        if (!strcmp (dir, g_ptr_array_index (dirs, j)))
+          break;
+      if (j < dirs->len)
+        g_free (dir);
+      else
+        g_ptr_array_add (dirs, dir);
     }
-  else
+
+  for (i = 0; i < dirs->len; i++)
     {
-      return ((col->alpha & 0xE0) << 7) |
-             ((col->red & 0xF0) << 4) |
-             (col->green & 0xF0) |
-             (col->blue >> 4);
+      const gchar *dir = g_ptr_array_index (dirs, i);
+      gint fd = ret ? g_open (dir, O_RDONLY, 0) : -1;
+
+      if (ret && (fd == -1 || fsync (fd) == -1))
+        {
+          hd_pvr_texture_set_file_error (error, "Could not sync %s", dir);
+          ret = FALSE;
+        }
+      if (fd != -1)
+        close (fd);
+      g_free (g_ptr_array_index (dirs, i));
     }
-}
+  g_ptr_array_free (dirs, TRUE);
 
-#if RAND_BLOCK
-inline static guchar clamp(gint x) {
-  if (x<0) x=0;
-  if (x>255) x=255;
-  return x;
+  return ret;
 }
-#endif
 
-inline static void nearest_pvr_color( Color *col, gboolean use_max ) {
-  if (col->alpha >= 224)
-    {
-      if (use_max) {
-        col->red = MIN(col->red + 7, 255);
-        col->green = MIN(col->green + 7, 255);
-        col->blue = MIN(col->blue + 7, 255);
-      }
-#if RAND_BLOCK
-      col->red = clamp((gint)col->red + (rand()&7) - 4);
-      col->green = clamp((gint)col->green + (rand()&7) - 4);
-      col->blue = clamp((gint)col->blue + (rand()&7) - 4);
-#endif
-      col->alpha = 0xFF;
-      col->red   = (col->red & 0xF8) | (col->red >> 5);
-      col->green = (col->green & 0xF8) | (col->green >> 5);
-      col->blue  = (col->blue & 0xF8) | (col->blue >> 5);
-    }
-  else
+/* Puts the writer's waiting files in place, syncing them first unless
+ * its policy is PVR_SYNC_NONE. If the syncing fails none of them are;
+ * a file that can't be put in place doesn't stop the others, and if the
+ * writer has a func it is told of that rather than it being an error */
+static gboolean
+writer_commit (PvrTextureWriter  *writer,
+               GError           **error)
+{
+  GPtrArray *files = writer->pending;
+  GPtrArray *committed;
+  GError *sync_error = NULL;
+  gboolean synced = TRUE, ret;
+  guint i;
+
+  if (!files->len)
+    return TRUE;
+
+  /* a texture saved on its own only needs its own data synced */
+  if (writer->policy == PVR_SYNC_IMMEDIATE)
+    synced = pending_files_datasync (files, &sync_error);
+  else if (writer->policy != PVR_SYNC_NONE)
+    synced = pending_files_sync (files, &sync_error);
+  ret = synced;
+
+  committed = g_ptr_array_new ();
+  for (i = 0; i < files->len; i++)
     {
-      if (use_max) {
-        col->alpha = MIN(col->alpha + 31, 255);
-        col->red = MIN(col->red + 15, 255);
-        col->green = MIN(col->green + 15, 255);
-        col->blue = MIN(col->blue + 15, 255);
-      }
-#if RAND_BLOCK
-      col->alpha = clamp((gint)col->alpha + (rand()&31) - 16);
-      col->red = clamp((gint)col->red + (rand()&15) - 8);
-      col->green = clamp((gint)col->green + (rand()&15) - 8);
-      col->blue = clamp((gint)col->blue + (rand()&15) - 8);
-#endif
-      col->alpha = (col->alpha & 0xE0) | (col->alpha >> 3);
-      col->red   = (col->red & 0xF0) | (col->red >> 4);
-      col->green = (col->green & 0xF0) | (col->green >> 4);
-      col->blue  = (col->blue & 0xF0) | (col->blue >> 4);
+      PendingFile *file = g_ptr_array_index (files, i);
+      GError *file_error = NULL;
+
+      if (!synced)
+        {
+          if (writer->func)
+            writer->func (file->filename, sync_error, writer->func_data);
+          continue;
+        }
+
+      if (pending_file_commit (file, &file_error))
+        g_ptr_array_add (committed, file);
+      if (writer->func)
+        writer->func (file->filename, file_error, writer->func_data);
+      else if (file_error)
+        {
+          /* the first failure is the one reported */
+          if (ret)
+            g_propagate_error (error, file_error);
+          else
+            g_error_free (file_error);
+          file_error = NULL;
+          ret = FALSE;
+        }
+      g_clear_error (&file_error);
     }
-}
+  if (!synced)
+    g_propagate_error (error, sync_error);
 
-inline static Color pvr_color_to_color( guint32 col )
+  if (writer->policy != PVR_SYNC_NONE && committed->len &&
+      !pending_files_sync_dirs (committed, ret ? error : NULL))
+    ret = FALSE;
+
+  for (i = 0; i < files->len; i++)
+    pending_file_discard (g_ptr_array_index (files, i));
+  g_ptr_array_set_size (files, 0);
+  g_ptr_array_free (committed, TRUE);
+  writer->pending_bytes = 0;
+
+  return ret;
+}
+
+/* Hands a written file of @size bytes over to the writer, which puts it
+ * in place as its policy says */
+static gboolean
+writer_add (PvrTextureWriter  *writer,
+            PendingFile       *file,
+            gsize              size,
+            GError           **error)
+{
+  g_ptr_array_add (writer->pending, file);
+  writer->pending_bytes += size;
+
+  if (writer->policy == PVR_SYNC_TOGETHER ||
+      (writer->policy == PVR_SYNC_DEFERRED &&
+       writer->pending->len < WRITER_PENDING_FILES &&
+       writer->pending_bytes < WRITER_PENDING_BYTES))
+    return TRUE;
+
+  return writer_commit (writer, error);
+}
+
+/**
+ * pvr_texture_writer_new:
+ *
+ * Makes a writer, which saves textures atomically: a texture is written
+ * to a file with no name (or, where that isn't possible, a temporary
+ * one) and only then put in place, so readers never see half of one.
+ * @policy says when the textures are synced to disk. A writer is not
+ * thread safe.
+ *
+ * Returns: a writer, to free with pvr_texture_writer_free
+ */
+PvrTextureWriter *
+pvr_texture_writer_new (PvrSyncPolicy policy)
+{
+  PvrTextureWriter *writer;
+
+  writer = g_new0 (PvrTextureWriter, 1);
+  writer->policy = policy;
+  writer->pending = g_ptr_array_new ();
+  writer->open = g_ptr_array_new ();
+
+  return writer;
+}
+
+/**
+ * pvr_texture_writer_set_func:
+ *
+ * Has @func told about each texture as it is put in place, or fails to
+ * be, in the order they were given to the writer. A texture that can't
+ * be put in place is then not an error for the writer's other calls,
+ * though failing to sync still is; every texture that was waiting is
+ * passed to @func with that error.
+ */
+void
+pvr_texture_writer_set_func (PvrTextureWriter     *writer,
+                             PvrTextureWriterFunc  func,
+                             gpointer              data)
+{
+  g_return_if_fail (writer != NULL);
+
+  writer->func = func;
+  writer->func_data = data;
+}
+
+/**
+ * pvr_texture_writer_save:
+ *
+ * Writes compressed data as a texture file at @filename, the header and
+ * the data in one go. With %PVR_SYNC_DEFERRED the texture may not be in
+ * place until pvr_texture_writer_sync, and with %PVR_SYNC_TOGETHER it
+ * won't be.
+ *
+ * Returns: %TRUE on success. If putting waiting textures in place
+ * failed, @error is set and some of them may not be there.
+ */
+gboolean
+pvr_texture_writer_save (PvrTextureWriter  *writer,
+                         const gchar       *filename,
+                         PvrFormat          format,
+                         const guchar      *data,
+                         guint              data_size,
+                         gint               width,
+                         gint               height,
+                         GError           **error)
+{
+  PVR_TEXTURE_HEADER head;
+  struct iovec iov[2];
+  PendingFile *file;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+  g_return_val_if_fail (data != NULL || data_size == 0, FALSE);
+
+  pvr_header_init (&head, format, width, height, 0, data_size);
+
+  file = pending_file_new (filename, error);
+  if (!file)
+    return FALSE;
+
+  iov[0].iov_base = &head;
+  iov[0].iov_len = sizeof(PVR_TEXTURE_HEADER);
+  iov[1].iov_base = (guchar *) data;
+  iov[1].iov_len = data_size;
+  if (!writev_all (file->fd, iov, G_N_ELEMENTS (iov)))
+    {
+      hd_pvr_texture_set_file_error (error, "Could not write %s", filename);
+      pending_file_discard (file);
+      return FALSE;
+    }
+
+  return writer_add (writer, file, sizeof(PVR_TEXTURE_HEADER) + data_size,
+                     error);
+}
+
+/**
+ * pvr_texture_writer_sync:
+ *
+ * Puts every texture the writer is holding back in place, with one sync
+ * for all of them unless its policy is %PVR_SYNC_NONE.
+ *
+ * Returns: %TRUE if they all made it
+ */
+gboolean
+pvr_texture_writer_sync (PvrTextureWriter  *writer,
+                         GError           **error)
+{
+  g_return_val_if_fail (writer != NULL, FALSE);
+
+  return writer_commit (writer, error);
+}
+
+/**
+ * pvr_texture_writer_begin:
+ *
+ * For files the writer doesn't lay out itself, such as texture packs:
+ * opens a file for @filename the way pvr_texture_writer_save does, for
+ * the caller to write. It is then handed back with
+ * pvr_texture_writer_commit, or given up with pvr_texture_writer_abort.
+ *
+ * Returns: a file descriptor to write to, or -1 on error
+ */
+gint
+pvr_texture_writer_begin (PvrTextureWriter  *writer,
+                          const gchar       *filename,
+                          GError           **error)
+{
+  PendingFile *file;
+
+  g_return_val_if_fail (writer != NULL, -1);
+  g_return_val_if_fail (filename != NULL, -1);
+
+  file = pending_file_new (filename, error);
+  if (!file)
+    return -1;
+
+  g_ptr_array_add (writer->open, file);
+  return file->fd;
+}
+
+/* Takes the file from pvr_texture_writer_begin with descriptor fd back
+ * off the writer's open list */
+static PendingFile *
+writer_take_open (PvrTextureWriter *writer,
+                  gint              fd)
+{
+  guint i;
+
+  for (i = 0; i < writer->open->len; i++)
+    {
+      PendingFile *file = g_ptr_array_index (writer->open, i);
+
+      if (file->fd == fd)
+        {
+          g_ptr_array_remove_index_fast (writer->open, i);
+          return file;
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * pvr_texture_writer_commit:
+ *
+ * Puts the file written to @fd, from pvr_texture_writer_begin, in place
+ * as the writer's policy says, just as pvr_texture_writer_save would.
+ * @fd is closed by the writer either way.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+pvr_texture_writer_commit (PvrTextureWriter  *writer,
+                           gint               fd,
+                           GError           **error)
+{
+  PendingFile *file;
+  struct stat st;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+
+  file = writer_take_open (writer, fd);
+  g_return_val_if_fail (file != NULL, FALSE);
+
+  return writer_add (writer, file, fstat (fd, &st) == 0 ? st.st_size : 0,
+                     error);
+}
+
+/**
+ * pvr_texture_writer_abort:
+ *
+ * Throws away the file written to @fd, from pvr_texture_writer_begin,
+ * leaving whatever was at its filename alone.
+ */
+void
+pvr_texture_writer_abort (PvrTextureWriter *writer,
+                          gint              fd)
+{
+  PendingFile *file;
+
+  g_return_if_fail (writer != NULL);
+
+  file = writer_take_open (writer, fd);
+  g_return_if_fail (file != NULL);
+
+  pending_file_discard (file);
+}
+
+/**
+ * pvr_texture_writer_free:
+ *
+ * Frees @writer. Textures it is still holding back, and files from
+ * pvr_texture_writer_begin not yet committed, are thrown away, so call
+ * pvr_texture_writer_sync first to keep them.
+ */
+void
+pvr_texture_writer_free (PvrTextureWriter *writer)
+{
+  guint i;
+
+  g_return_if_fail (writer != NULL);
+
+  for (i = 0; i < writer->pending->len; i++)
+    pending_file_discard (g_ptr_array_index (writer->pending, i));
+  for (i = 0; i < writer->open->len; i++)
+    pending_file_discard (g_ptr_array_index (writer->open, i));
+  g_ptr_array_free (writer->pending, TRUE);
+  g_ptr_array_free (writer->open, TRUE);
+  g_free (writer);
+}
+
+static gboolean
+save_with_policy (const gchar   *filename,
+                  PvrFormat      format,
+                  const guchar  *data,
+                  guint          data_size,
+                  gint           width,
+                  gint           height,
+                  PvrSyncPolicy  policy,
+                  GError       **error)
+{
+  PvrTextureWriter *writer;
+  gboolean ret;
+
+  writer = pvr_texture_writer_new (policy);
+  ret = pvr_texture_writer_save (writer, filename, format, data, data_size,
+                                 width, height, error);
+  pvr_texture_writer_free (writer);
+
+  return ret;
+}
+
+/*
+ * pvr_texture_save_pvrtc4:
+ *
+ * saves an already compressed (with pvr_texture_compress)
+ * data slice to a file. Returns TRUE on success. The file is
+ * replaced atomically, but not synced to disk
+ *
+ * Since: 0.8.2-maemo
+ */
+gboolean pvr_texture_save_pvrtc4(
+                      const gchar *filename,
+                      const guchar *data,
+                      guint data_size,
+                      gint width, gint height)
+{
+    return save_with_policy(filename, PVR_FORMAT_PVRTC4, data, data_size,
+                            width, height, PVR_SYNC_NONE, NULL);
+}
+
+/**
+ * pvr_texture_save_pvrtc4_atomically:
+ *
+ * Like pvr_texture_save_pvrtc4, but synced to disk before it replaces
+ * @filename.
+ */
+gboolean
+pvr_texture_save_pvrtc4_atomically (const gchar   *filename,
+                                    const guchar  *data,
+                                    guint          data_size,
+                                    gint           width,
+                                    gint           height,
+                                    GError       **error)
+{
+  return save_with_policy (filename, PVR_FORMAT_PVRTC4, data, data_size,
+                           width, height, PVR_SYNC_IMMEDIATE, error);
+}
+
+/**
+ * pvr_texture_save_etc1_atomically:
+ *
+ * Like pvr_texture_save_pvrtc4_atomically, for data compressed with
+ * pvr_texture_compress_etc1.
+ */
+gboolean
+pvr_texture_save_etc1_atomically (const gchar   *filename,
+                                  const guchar  *data,
+                                  guint          data_size,
+                                  gint           width,
+                                  gint           height,
+                                  GError       **error)
+{
+  return save_with_policy (filename, PVR_FORMAT_ETC1, data, data_size,
+                           width, height, PVR_SYNC_IMMEDIATE, error);
+}
+
+#define SETMIN(result, col) { \
+        if ((result).red   > (col).red)   (result).red   = (col).red; \
+        if ((result).green > (col).green) (result).green = (col).green; \
+        if ((result).blue  > (col).blue)  (result).blue  = (col).blue; \
+        if ((result).alpha > (col).alpha) (result).alpha = (col).alpha; \
+}
+#define SETMAX(result, col) { \
+        if ((result).red   < (col).red)   (result).red   = (col).red; \
+        if ((result).green < (col).green) (result).green = (col).green; \
+        if ((result).blue  < (col).blue)  (result).blue  = (col).blue; \
+        if ((result).alpha < (col).alpha) (result).alpha = (col).alpha; \
+}
+/* the same for pixels known to be opaque */
+#define SETMIN_RGB(result, col) { \
+        if ((result).red   > (col).red)   (result).red   = (col).red; \
+        if ((result).green > (col).green) (result).green = (col).green; \
+        if ((result).blue  > (col).blue)  (result).blue  = (col).blue; \
+}
+#define SETMAX_RGB(result, col) { \
+        if ((result).red   < (col).red)   (result).red   = (col).red; \
+        if ((result).green < (col).green) (result).green = (col).green; \
+        if ((result).blue  < (col).blue)  (result).blue  = (col).blue; \
+}
+
+inline static guchar find_best(
+                Color pixel_col,
+                const Color *low,
+                const Color *high,
+                guint block_stride,
+                guint x_interp,
+                guint y_interp)
+{
+  Color tmpa, tmpb;
+  guchar amtx, amty;
+  Color cl, ch, clm, chm;
+  guint diff[4];
+
+  /* special case - if everything is equal then we don't care what we choose
+   * and we can skip a load of calculation */
+  if (color_equal(&low[0], &low[1]) &&
+      color_equal(&low[block_stride], &low[block_stride+1]) &&
+      color_equal(&low[block_stride], &low[0]) &&
+      color_equal(&high[0], &high[1]) &&
+      color_equal(&high[block_stride], &high[block_stride+1]) &&
+      color_equal(&high[block_stride], &high[0]) &&
+      color_equal(&low[0], &high[0]))
+    return 0;
+
+  /* interpolate our colours spatially */
+
+  amtx = x_interp * 64;
+  amty = y_interp * 64;
+
+  color_interp(&tmpa, &low[0], &low[1], amtx);
+  color_interp(&tmpb, &low[block_stride], &low[block_stride+1], amtx);
+  color_interp(&cl, &tmpa, &tmpb, amty);
+
+  color_interp(&tmpa, &high[0], &high[1], amtx);
+  color_interp(&tmpb, &high[block_stride], &high[block_stride+1], amtx);
+  color_interp(&ch, &tmpa, &tmpb, amty);
+
+  /* interpolate for the mid-colours */
+  color_interp(&clm, &cl, &ch, 96); /* 3/8 */
+  color_interp(&chm, &cl, &ch, 160); /* 5/8 */
+
+  /* work out differences */
+  diff[0] = color_diff(&pixel_col, &cl);
+  diff[1] = color_diff(&pixel_col, &clm);
+  diff[2] = color_diff(&pixel_col, &chm);
+  diff[3] = color_diff(&pixel_col, &ch);
+
+  /* work out which one is smaller */
+  if (diff[0] < diff[1] && diff[0] < diff[2] && diff[0] < diff[3])
+    return 0;
+  if (diff[1] < diff[2] && diff[1] < diff[3])
+    return 1;
+  if (diff[2] < diff[3])
+    return 2;
+  return 3;
+}
+
+/* The reference version of PvrModulateBlockFunc, calling find_best for
+ * every pixel of the block */
+static guint32
+modulate_block_c (const Color *pixels,
+                  guint        pixel_stride,
+                  const Color *low,
+                  const Color *high,
+                  guint        block_stride)
+{
+  guint32 word = 0;
+  gint bx,by;
+
+  /* find_best interpolates our two sets of colours to where they should
+   * be (the blocks we get colour from swap halfway through the block
+   * hence the crazy offset stuff. It then figures out which one of the
+   * 4 values for the pixel works best */
+  for (by=3;by>=0;by--)
+    for (bx=3;bx>=0;bx--)
+      {
+        gint boffs = ((bx+2)>>2) + (((by+2)>>2) * block_stride);
+
+        word = (word << 2) |
+               find_best(pixels[bx + by*pixel_stride],
+                         &low[boffs],
+                         &high[boffs],
+                         block_stride,
+                         (bx+2)&3,
+                         (by+2)&3);
+      }
+
+  return word;
+}
+
+/* Interpolates the low and high colours of the 4 blocks at low[0],
+ * low[1], low[block_stride] and low[block_stride+1] to a point amtx/256
+ * of the way across and amty/256 of the way down */
+static inline void
+interp_block_colours (const Color *low,
+                      const Color *high,
+                      guint        block_stride,
+                      guint        amtx,
+                      guint        amty,
+                      Color       *cl,
+                      Color       *ch)
+{
+  Color tmpa, tmpb;
+
+  color_interp(&tmpa, &low[0], &low[1], amtx);
+  color_interp(&tmpb, &low[block_stride], &low[block_stride+1], amtx);
+  color_interp(cl, &tmpa, &tmpb, amty);
+
+  color_interp(&tmpa, &high[0], &high[1], amtx);
+  color_interp(&tmpb, &high[block_stride], &high[block_stride+1], amtx);
+  color_interp(ch, &tmpa, &tmpb, amty);
+}
+
+/* PVR_QUALITY_FAST version of modulate_block_c, for when there's no
+ * vector kernel. Rather than comparing
+ * each pixel with all 4 colours it could be, it works out how far along
+ * the line from the low to the high colour the pixel lies and rounds
+ * that to the nearest of 0, 3/8, 5/8 and 1 */
+static guint32
+modulate_block_fast_c (const Color *pixels,
+                       guint        pixel_stride,
+                       const Color *low,
+                       const Color *high,
+                       guint        block_stride)
+{
+  guint32 word = 0;
+  gint bx,by;
+
+  for (by=3;by>=0;by--)
+    for (bx=3;bx>=0;bx--)
+      {
+        gint boffs = ((bx+2)>>2) + (((by+2)>>2) * block_stride);
+        const Color *pixel = &pixels[bx + by*pixel_stride];
+        Color cl, ch;
+        gint dr, dg, db, da, along, length;
+        guint bits;
+
+        interp_block_colours (&low[boffs], &high[boffs], block_stride,
+                              ((bx+2)&3) * 64, ((by+2)&3) * 64,
+                              &cl, &ch);
+        dr = ch.red - cl.red;
+        dg = ch.green - cl.green;
+        db = ch.blue - cl.blue;
+        da = ch.alpha - cl.alpha;
+        length = dr*dr + dg*dg + db*db + da*da;
+        along = (pixel->red - cl.red) * dr + (pixel->green - cl.green) * dg +
+                (pixel->blue - cl.blue) * db + (pixel->alpha - cl.alpha) * da;
+
+        /* the thresholds are half way between the 4 colours */
+        if (along*16 < length*3)
+          bits = 0;
+        else if (along*2 < length)
+          bits = 1;
+        else if (along*16 < length*13)
+          bits = 2;
+        else
+          bits = 3;
+        word = (word << 2) | bits;
+      }
+
+  return word;
+}
+
+/* PVRTC2 version of modulate_block_c. The blocks are 8 pixels wide, and
+ * we only use the direct mode, where each pixel gets one bit choosing
+ * the low or the high colour */
+static guint32
+modulate_block_pvrtc2_c (const Color *pixels,
+                         guint        pixel_stride,
+                         const Color *low,
+                         const Color *high,
+                         guint        block_stride)
+{
+  guint32 word = 0;
+  gint bx,by;
+
+  for (by=3;by>=0;by--)
+    for (bx=7;bx>=0;bx--)
+      {
+        gint boffs = ((bx+4)>>3) + (((by+2)>>2) * block_stride);
+        Color cl, ch;
+
+        interp_block_colours (&low[boffs], &high[boffs], block_stride,
+                              ((bx+4)&7) * 32, ((by+2)&3) * 64,
+                              &cl, &ch);
+        word = (word << 1) |
+               (color_diff(&pixels[bx + by*pixel_stride], &ch) <=
+                color_diff(&pixels[bx + by*pixel_stride], &cl));
+      }
+
+  return word;
+}
+
+/* Below this alpha a pixel could be one the punch-through mode makes
+ * clear, so its block is worth trying in that mode */
+#define PUNCH_THROUGH_ALPHA 64
+
+/* How far a decoded colour is from the pixel it stands for. Pixels that
+ * are clear either way look the same whatever their colour */
+static inline guint
+modulation_diff (const Color *pixel,
+                 const Color *decoded)
+{
+  if (pixel->alpha == 0 && decoded->alpha == 0)
+    return 0;
+  return color_diff (pixel, decoded);
+}
+
+static inline gboolean
+block_has_clear_pixel (const Color *pixels,
+                       guint        pixel_stride)
+{
+  guint bx,by;
+
+  for (by=0;by<4;by++)
+    for (bx=0;bx<4;bx++)
+      if (pixels[bx + by*pixel_stride].alpha < PUNCH_THROUGH_ALPHA)
+        return TRUE;
+  return FALSE;
+}
+
+/* Works out the best modulation of a PVRTC4 block in punch-through mode,
+ * where the 4 values are the low colour, half way, half way but clear,
+ * and the high colour. If the block comes out closer to the pixels that
+ * way than with direct_word in the usual mode, returns that modulation
+ * and sets *punch_through; otherwise returns direct_word */
+static guint32
+modulate_block_punch_through (const Color *pixels,
+                              guint        pixel_stride,
+                              const Color *low,
+                              const Color *high,
+                              guint        block_stride,
+                              guint32      direct_word,
+                              gboolean    *punch_through)
+{
+  guint32 word = 0;
+  guint direct_error = 0, error = 0;
+  gint bx,by;
+
+  for (by=3;by>=0;by--)
+    for (bx=3;bx>=0;bx--)
+      {
+        gint boffs = ((bx+2)>>2) + (((by+2)>>2) * block_stride);
+        const Color *pixel = &pixels[bx + by*pixel_stride];
+        Color cl, ch, direct, mid, clear;
+        guint diff[4], direct_bits, bits, i;
+
+        interp_block_colours (&low[boffs], &high[boffs], block_stride,
+                              ((bx+2)&3) * 64, ((by+2)&3) * 64,
+                              &cl, &ch);
+
+        /* what the usual mode gives this pixel */
+        direct_bits = (direct_word >> ((bx + by*4) * 2)) & 3;
+        if (direct_bits == 0)
+          direct = cl;
+        else if (direct_bits == 1)
+          color_interp (&direct, &cl, &ch, 96);
+        else if (direct_bits == 2)
+          color_interp (&direct, &cl, &ch, 160);
+        else
+          direct = ch;
+        direct_error += modulation_diff (pixel, &direct);
+
+        color_interp (&mid, &cl, &ch, 128);
+        clear = mid;
+        clear.alpha = 0;
+        diff[0] = modulation_diff (pixel, &cl);
+        diff[1] = modulation_diff (pixel, &mid);
+        diff[2] = modulation_diff (pixel, &clear);
+        diff[3] = modulation_diff (pixel, &ch);
+
+        bits = 0;
+        for (i=1;i<4;i++)
+          if (diff[i] < diff[bits])
+            bits = i;
+        error += diff[bits];
+        word = (word << 2) | bits;
+      }
+
+  *punch_through = error < direct_error;
+  return *punch_through ? word : direct_word;
+}
+
+inline static guint color_to_pvr_color_opaque( const Color *col )
+{
+  return 0x8000 |
+         ((col->red & 0xF8) << 7) |
+         ((col->green & 0xF8) << 2) |
+         (col->blue >> 3);
+}
+
+inline static guint color_to_pvr_color( Color *col )
+{
+  /* 16 bit colour, if top bit is 1 it's 555, otherwise
+   * it's 3444 */
+  if (col->alpha >= 224)
+    {
+      /* We're opaqueish */
+      return color_to_pvr_color_opaque (col);
+    }
+  else
+    {
+      return ((col->alpha & 0xE0) << 7) |
+             ((col->red & 0xF0) << 4) |
+             (col->green & 0xF0) |
+             (col->blue >> 4);
+    }
+}
+
+#if RAND_BLOCK
+inline static guchar clamp(gint x) {
+  if (x<0) x=0;
+  if (x>255) x=255;
+  return x;
+}
+#endif
+
+inline static void nearest_pvr_color_opaque( Color *col, gboolean use_max ) {
+  if (use_max) {
+    col->red = MIN(col->red + 7, 255);
+    col->green = MIN(col->green + 7, 255);
+    col->blue = MIN(col->blue + 7, 255);
+  }
+#if RAND_BLOCK
+  col->red = clamp((gint)col->red + (rand()&7) - 4);
+  col->green = clamp((gint)col->green + (rand()&7) - 4);
+  col->blue = clamp((gint)col->blue + (rand()&7) - 4);
+#endif
+  col->alpha = 0xFF;
+  col->red   = (col->red & 0xF8) | (col->red >> 5);
+  col->green = (col->green & 0xF8) | (col->green >> 5);
+  col->blue  = (col->blue & 0xF8) | (col->blue >> 5);
+}
+
+inline static void nearest_pvr_color( Color *col, gboolean use_max ) {
+  if (col->alpha >= 224)
+    nearest_pvr_color_opaque (col, use_max);
+  else
+    {
+      if (use_max) {
+        col->alpha = MIN(col->alpha + 31, 255);
+        col->red = MIN(col->red + 15, 255);
+        col->green = MIN(col->green + 15, 255);
+        col->blue = MIN(col->blue + 15, 255);
+      }
+#if RAND_BLOCK
+      col->alpha = clamp((gint)col->alpha + (rand()&31) - 16);
+      col->red = clamp((gint)col->red + (rand()&15) - 8);
+      col->green = clamp((gint)col->green + (rand()&15) - 8);
+      col->blue = clamp((gint)col->blue + (rand()&15) - 8);
+#endif
+      col->alpha = (col->alpha & 0xE0) | (col->alpha >> 3);
+      col->red   = (col->red & 0xF0) | (col->red >> 4);
+      col->green = (col->green & 0xF0) | (col->green >> 4);
+      col->blue  = (col->blue & 0xF0) | (col->blue >> 4);
+    }
+}
+
+inline static Color pvr_color_to_color( guint32 col )
+{
+  Color result;
+  /* If top bit is 1, this is full alpha */
+  if (col & 0x8000)
+    {
+      result.alpha = 255;
+      result.red = (col>>7) & 0xF8;
+      result.green = (col>>2) & 0xF8;
+      result.blue = (col<<3) & 0xF8;
+    }
+  else
+    {
+      result.alpha = (col>>7) & 0xE0;
+      result.red = (col>>4) & 0xF0;
+      result.green = col & 0xF0;
+      result.blue = col<<4;
+    }
+  return result;
+}
+
+/* The colour the compressor takes a PVR colour word to stand for, which
+ * is the same as nearest_pvr_color gives */
+inline static Color pvr_color_to_model( guint32 col )
+{
+  Color result = pvr_color_to_color (col);
+
+  if (col & 0x8000)
+    {
+      result.red |= result.red >> 5;
+      result.green |= result.green >> 5;
+      result.blue |= result.blue >> 5;
+    }
+  else
+    {
+      result.alpha |= result.alpha >> 3;
+      result.red |= result.red >> 4;
+      result.green |= result.green >> 4;
+      result.blue |= result.blue >> 4;
+    }
+  return result;
+}
+
+static inline gboolean
+is_power_2(int a)
+{
+  return !(a & (a - 1)) && a;
+}
+
+static inline guint32
+log_2(guint v)
+{
+  guint32 r; // result of log2(v) will go here
+  guint32 shift;
+
+  r =     (v > 0xFFFF) << 4; v >>= r;
+  shift = (v > 0xFF  ) << 3; v >>= shift; r |= shift;
+  shift = (v > 0xF   ) << 2; v >>= shift; r |= shift;
+  shift = (v > 0x3   ) << 1; v >>= shift; r |= shift;
+                                          r |= (v >> 1);
+  return r;
+}
+
+
+/* calculate the masks needed to access the morton-ordered image.
+ * Values must be a power of 2 */
+static void _calculate_access_masks( gint width, gint height,
+      guint32 *morton_mask,
+      guint32 *xshift, guint32 *xmask,
+      guint32 *yshift, guint32 *ymask)
+{
+  *xshift = 0;
+  *yshift = 0;
+  *xmask = 0;
+  *ymask = 0;
+  *morton_mask = 0xFFFFFFFF;
+  if (width == height)
+    {
+      return;
+    }
+  if (width > height)
+    {
+      *morton_mask = (height*height)-1;
+      *xshift = log_2(height);
+      *xmask = 0xFFFFFFFF & ~*morton_mask;
+    }
+  else
+    { // width < height
+      *morton_mask = (width*width)-1;
+      *yshift = log_2(width);
+      *ymask = 0xFFFFFFFF & ~*morton_mask;
+    }
+}
+
+/* Where the blocks of a texture live in its morton-ordered data */
+typedef struct
+{
+  guint32 morton_mask, xshift, xmask, yshift, ymask;
+} MortonLayout;
+
+static void
+morton_layout_init (MortonLayout *layout,
+                    guint         width_block,
+                    guint         height_block)
+{
+  _calculate_access_masks(width_block, height_block,
+      &layout->morton_mask,
+      &layout->xshift, &layout->xmask,
+      &layout->yshift, &layout->ymask);
+}
+
+/* Interleave lower 16 bits of v with zeros, ready to be combined into
+ * a Morton number */
+static inline guint32
+morton_spread (guint32 v)
+{
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+/* PVR Stores images in a Morton arrangement to get some spatial
+ * locality
+ *
+ * Interleave lower 16 bits of x and y, so the bits of x
+ * are in the even positions and bits from y in the odd;
+ * z gets the resulting 32-bit Morton Number. Returns the offset in
+ * 32 bit words of block x,y, given my = morton_spread(y) */
+static inline guint32
+morton_block_offset (const MortonLayout *layout,
+                     guint32             x,
+                     guint32             y,
+                     guint32             my)
+{
+  guint32 mz;
+
+  mz = (my | (morton_spread (x) << 1)) & layout->morton_mask;
+  mz |= (x << layout->xshift) & layout->xmask;
+  mz |= (y << layout->yshift) & layout->ymask;
+  return mz << 1;
+}
+
+/* Below this many rows of blocks per thread it's not worth waking up
+ * another thread */
+#define MIN_BLOCK_ROWS_PER_THREAD 8
+
+/* The PVRTC encoder assembles blocks in square tiles of this many blocks
+ * a side, so threads are given whole tiles' worth of rows */
+#define ASSEMBLE_TILE_SIDE 8
+
+/* Work that is done in passes over rows of blocks. Within a pass any
+ * rows can be done in any order on any thread; pass_done is then
+ * called (on one thread) before the next pass starts */
+typedef struct
+{
+  void  (*rows)      (gpointer job,
+                      guint    pass,
+                      guint    y_start,
+                      guint    y_end);
+  void  (*pass_done) (gpointer job,
+                      guint    pass);
+  guint   n_passes;
+} RowPasses;
+
+/* A range of block rows for one pass, handed to a worker thread */
+typedef struct
+{
+  const RowPasses *passes;
+  gpointer         job;
+  guint            pass;
+  guint            y_start;
+  guint            y_end;
+} RowsTask;
+
+static void
+rows_task_run (gpointer data,
+               gpointer user_data)
+{
+  RowsTask *task = data;
+  GAsyncQueue *done = user_data;
+
+  task->passes->rows (task->job, task->pass, task->y_start, task->y_end);
+
+  g_async_queue_push (done, task);
+}
+
+/* Worker threads and the bookkeeping for handing them rows. Usually made
+ * for one compression, but a PvrTextureEncoder keeps one between them */
+typedef struct
+{
+  GThreadPool *pool;
+  GAsyncQueue *done;
+  RowsTask    *tasks;
+  guint        n_tasks;  /* room in tasks */
+} RowRunner;
+
+/* Starts n_threads worker threads. Returns FALSE if they couldn't be
+ * created */
+static gboolean
+row_runner_start (RowRunner *runner,
+                  guint      n_threads)
+{
+  memset (runner, 0, sizeof (*runner));
+  runner->done = g_async_queue_new ();
+  runner->pool = g_thread_pool_new (rows_task_run, runner->done,
+                                    n_threads, TRUE, NULL);
+  if (!runner->pool)
+    {
+      g_async_queue_unref (runner->done);
+      runner->done = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+row_runner_stop (RowRunner *runner)
+{
+  if (runner->pool)
+    g_thread_pool_free (runner->pool, FALSE, TRUE);
+  if (runner->done)
+    g_async_queue_unref (runner->done);
+  g_free (runner->tasks);
+  memset (runner, 0, sizeof (*runner));
+}
+
+/* Split each pass into bands of block rows, as if for n_threads threads,
+ * over the runner's workers */
+static void
+row_runner_run (RowRunner       *runner,
+                const RowPasses *passes,
+                gpointer         job,
+                guint            n_rows,
+                guint            n_threads)
+{
+  RowsTask *tasks;
+  guint rows_per_task, n_tasks, pass, i;
+
+  /* hand out a few bands per thread so that threads which get easy
+   * (flat) bands can pick up more work */
+  rows_per_task = MAX (1, n_rows / (n_threads * 4));
+  rows_per_task = (rows_per_task + ASSEMBLE_TILE_SIDE - 1) &
+                  ~(ASSEMBLE_TILE_SIDE - 1);
+  n_tasks = (n_rows + rows_per_task - 1) / rows_per_task;
+  if (n_tasks > runner->n_tasks)
+    {
+      runner->tasks = g_renew (RowsTask, runner->tasks, n_tasks);
+      runner->n_tasks = n_tasks;
+    }
+  tasks = runner->tasks;
+
+  for (pass = 0; pass < passes->n_passes; pass++)
+    {
+      for (i = 0; i < n_tasks; i++)
+        {
+          tasks[i].passes = passes;
+          tasks[i].job = job;
+          tasks[i].pass = pass;
+          tasks[i].y_start = i * rows_per_task;
+          tasks[i].y_end = MIN (n_rows, tasks[i].y_start + rows_per_task);
+          g_thread_pool_push (runner->pool, &tasks[i], NULL);
+        }
+
+      /* wait for every band - the next pass may need the results of
+       * the neighbouring rows */
+      for (i = 0; i < n_tasks; i++)
+        g_async_queue_pop (runner->done);
+
+      if (passes->pass_done)
+        passes->pass_done (job, pass);
+    }
+}
+
+/* Runs the passes on n_threads threads, using the runner's workers if it
+ * has any, or else ones started just for this */
+static void
+run_row_passes_with (RowRunner       *runner,
+                     const RowPasses *passes,
+                     gpointer         job,
+                     guint            n_rows,
+                     guint            n_threads)
+{
+  RowRunner tmp;
+  guint pass;
+
+  if (n_threads > 1 && g_thread_supported ())
+    {
+      if (runner && runner->pool)
+        {
+          row_runner_run (runner, passes, job, n_rows, n_threads);
+          return;
+        }
+      if (row_runner_start (&tmp, n_threads))
+        {
+          row_runner_run (&tmp, passes, job, n_rows, n_threads);
+          row_runner_stop (&tmp);
+          return;
+        }
+    }
+
+  for (pass = 0; pass < passes->n_passes; pass++)
+    {
+      passes->rows (job, pass, 0, n_rows);
+      if (passes->pass_done)
+        passes->pass_done (job, pass);
+    }
+}
+
+static void
+run_row_passes (const RowPasses *passes,
+                gpointer         job,
+                guint            n_rows,
+                guint            n_threads)
+{
+  run_row_passes_with (NULL, passes, job, n_rows, n_threads);
+}
+
+/**
+ * pvr_texture_get_n_threads:
+ *
+ * Returns the number of threads the PVR codec uses when it is left to
+ * choose for itself - the number of online CPUs.
+ */
+guint
+pvr_texture_get_n_threads (void)
+{
+  static guint n_cpus = 0;
+
+  if (!n_cpus)
+    {
+      long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+      n_cpus = n > 0 ? n : 1;
+    }
+
+  return n_cpus;
+}
+
+/* How many threads to really use for n_rows rows of blocks, if asked
+ * for requested (0 meaning one per CPU) */
+static guint
+choose_n_threads (guint requested,
+                  guint n_rows)
+{
+  guint n_threads;
+
+  n_threads = requested ? requested : pvr_texture_get_n_threads ();
+
+  return MIN (n_threads, MAX (1, n_rows / MIN_BLOCK_ROWS_PER_THREAD));
+}
+
+/* copy the first and last real colours of a row of blocks into the
+ * padding either side */
+static inline void
+pad_block_colour_row (Color *row,
+                      guint  width_block)
+{
+  row[0] = row[1];
+  row[width_block+1] = row[width_block];
+}
+
+/* copy top and bottom of our block colours so we get repeats. Must only
+ * be called once every row has been filled in */
+static void
+pad_block_colours (Color *col_low,
+                   Color *col_high,
+                   guint  block_stride,
+                   guint  height_block)
+{
+  memcpy((void*)&col_low[0],
+         (void*)&col_low[block_stride],
+                sizeof(Color)*block_stride);
+  memcpy((void*)&col_high[0],
+         (void*)&col_high[block_stride],
+                sizeof(Color)*block_stride);
+  memcpy((void*)&col_low[block_stride*(height_block+1)],
+         (void*)&col_low[block_stride*height_block],
+                sizeof(Color)*block_stride);
+  memcpy((void*)&col_high[block_stride*(height_block+1)],
+         (void*)&col_high[block_stride*height_block],
+                sizeof(Color)*block_stride);
+}
+
+/* State shared by everything working on one compression */
+typedef struct
+{
+  const guchar *uncompressed_data;
+  PvrFormat     format;
+  PvrEtc1Mode   etc1_mode;
+  gint          width;
+  guint         block_width;  /* in pixels, 4 for PVRTC4 or 8 for PVRTC2 */
+  guint         width_block;
+  guint         height_block;
+  guint         block_stride;
+  Color        *col_low;
+  Color        *col_high;
+  guint32      *out_data;
+  MortonLayout  layout;
+  PvrDither     dither;
+  gint          error_pixel[4]; /* only used by PVR_DITHER_PIXEL */
+  PvrModulateBlockFunc modulate_block;
+  /* When only part of the image is held at once (streaming), the block
+   * rows that uncompressed_data and the block colours start at */
+  guint         pixel_y0;
+  guint         colour_y0;
+  /* If tile_side is set, out_data only holds the rows from band_y0,
+   * tile by tile, rather than the whole image */
+  guint         band_y0;
+  guint         tile_side;
+  /* blocks a side of the tiles compress_assemble_blocks goes through */
+  guint         assemble_side;
+  /* passes of refine_rows between working out the block colours and
+   * assembling the blocks, for PVR_QUALITY_HIGH */
+  guint         refine_passes;
+  /* If src is set, pixels are read from it rather than from
+   * uncompressed_data: src_width x src_height RGBA8888 or RGB888 pixels
+   * in rows src_rowstride bytes apart. Past the edges, up to pad_x and
+   * pad_y, the last column and row repeat; beyond that the first ones
+   * do, as if the image had been padded to width x height */
+  const guchar *src;
+  guint         src_rowstride;
+  guint         src_channels;
+  gint          src_width;
+  gint          src_height;
+  gint          pad_x;
+  gint          pad_y;
+} CompressJob;
+
+/* Where coordinate c of the padded image comes from in the source */
+static inline gint
+compress_pad_coord (gint c,
+                    gint size,
+                    gint pad)
+{
+  return c < size ? c : (c < pad ? size - 1 : 0);
+}
+
+/* Finds the pixels of block x,y, setting *stride to the number of Colors
+ * between its rows. Blocks which are all in an RGBA source are read where
+ * they are; others are copied into tmp, which has room for 8x4 */
+static inline const Color *
+compress_get_block (const CompressJob *job,
+                    guint              x,
+                    guint              y,
+                    Color             *tmp,
+                    guint             *stride)
+{
+  guint block_width = job->block_width;
+  gint px = x * block_width;
+  gint py = y * 4;
+  guint bx, by;
+
+  if (!job->src)
+    {
+      *stride = job->width;
+      return (const Color*)job->uncompressed_data +
+             x*block_width + (y-job->pixel_y0)*job->width*4;
+    }
+
+  if (job->src_channels == 4 && !(job->src_rowstride & 3) &&
+      px + (gint) block_width <= job->src_width && py + 4 <= job->src_height)
+    {
+      *stride = job->src_rowstride / 4;
+      return (const Color*)(job->src + py*job->src_rowstride) + px;
+    }
+
+  for (by=0;by<4;by++)
+    {
+      const guchar *row = job->src + job->src_rowstride *
+        compress_pad_coord (py + by, job->src_height, job->pad_y);
+
+      for (bx=0;bx<block_width;bx++)
+        {
+          const guchar *pixel = row + job->src_channels *
+            compress_pad_coord (px + bx, job->src_width, job->pad_x);
+          Color *col = &tmp[bx + by*block_width];
+
+          col->red = pixel[0];
+          col->green = pixel[1];
+          col->blue = pixel[2];
+          col->alpha = job->src_channels == 4 ? pixel[3] : 255;
+        }
+    }
+  *stride = block_width;
+  return tmp;
+}
+
+/* Finds pixel px,py of the padded image, copying it into tmp if it comes
+ * from src */
+static inline const Color *
+compress_get_pixel (const CompressJob *job,
+                    gint               px,
+                    gint               py,
+                    Color             *tmp)
+{
+  const guchar *pixel;
+
+  if (!job->src)
+    return (const Color*)job->uncompressed_data +
+           px + (py - job->pixel_y0*4)*job->width;
+
+  pixel = job->src +
+          job->src_rowstride * compress_pad_coord (py, job->src_height,
+                                                   job->pad_y) +
+          job->src_channels * compress_pad_coord (px, job->src_width,
+                                                  job->pad_x);
+  tmp->red = pixel[0];
+  tmp->green = pixel[1];
+  tmp->blue = pixel[2];
+  tmp->alpha = job->src_channels == 4 ? pixel[3] : 255;
+  return tmp;
+}
+
+/* Where block x,y goes in job->out_data */
+static inline guint32
+compress_out_offset (const CompressJob *job,
+                     guint32            x,
+                     guint32            y,
+                     guint32            my)
+{
+  guint32 tile_side = job->tile_side;
+  guint32 tile;
+
+  /* ETC1 just goes in rows */
+  if (job->format == PVR_FORMAT_ETC1)
+    return ((y - job->band_y0) * job->width_block + x) << 1;
+
+  if (!tile_side)
+    return morton_block_offset (&job->layout, x, y, my);
+
+  /* tiles are square and aligned, so within one the blocks are in plain
+   * morton order */
+  tile = ((y - job->band_y0) / tile_side) * (job->width_block / tile_side) +
+         x / tile_side;
+  return (tile * tile_side * tile_side +
+          (morton_spread (y & (tile_side-1)) |
+           (morton_spread (x & (tile_side-1)) << 1))) << 1;
+}
+
+/* Works out the class of the pixels of blocks x_start to x_end of the
+ * rows y_start to y_end */
+static PixelClass
+classify_blocks (const CompressJob *job,
+                 guint              x_start,
+                 guint              x_end,
+                 guint              y_start,
+                 guint              y_end)
+{
+  PixelClass pixel_class = PIXELS_OPAQUE;
+  guint x,y,bx,by;
+
+  if (job->src && job->src_channels == 3)
+    return PIXELS_OPAQUE;
+
+  for (y=y_start;y<y_end;y++)
+    for (x=x_start;x<x_end;x++)
+      {
+        Color tmp[32];
+        const Color *block;
+        guint width;
+
+        block = compress_get_block (job, x, y, tmp, &width);
+        for (by=0;by<4;by++)
+          for (bx=0;bx<job->block_width;bx++)
+            {
+              guchar alpha = block[bx + by*width].alpha;
+
+              if (alpha == 255)
+                continue;
+              if (alpha != 0)
+                return PIXELS_GENERAL;
+              pixel_class = PIXELS_BINARY;
+            }
+      }
+
+  return pixel_class;
+}
+
+/* work out maximum and minimum colour values for the blocks x_start to
+ * x_end of the rows y_start to y_end, whose pixels are all of the given
+ * class. Specialised for each class by DEFINE_PIXEL_CLASS_KERNELS */
+static ALWAYS_INLINE void
+compress_block_colours_class (CompressJob *job,
+                              guint        x_start,
+                              guint        x_end,
+                              guint        y_start,
+                              guint        y_end,
+                              PixelClass   pixel_class)
+{
+  guint block_stride = job->block_stride;
+  Color *col_low = job->col_low;
+  Color *col_high = job->col_high;
+  guint block_width = job->block_width;
+#if DITHER_BLOCK
+  gint error_low[4] = {0,0,0,0};
+  gint error_high[4] = {0,0,0,0};
+#endif
+  guint x,y,bx,by;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint block_offs = (y-job->colour_y0+1)*block_stride;
+      for (x=x_start;x<x_end;x++)
+        {
+          Color clow, chigh, clow_dither, chigh_dither;
+          Color tmp[32];
+          const Color *block;
+          const Color *blockline;
+          guint width;
+
+          /* We now don't include the very edges in what we use
+           * for our blocks, as this helps make the block values
+           * we get a little more 'rounded'
+           */
+          block = compress_get_block (job, x, y, tmp, &width);
+          clow = block[1];
+          chigh = block[1];
+          for (by=0;by<4;by++)
+            {
+              guint edge = (by==0 || by==3) ? 1 : 0;
+
+              blockline = &block[width*by];
+              for (bx=edge;bx<block_width-edge;bx++)
+                {
+                  if (pixel_class == PIXELS_OPAQUE)
+                    {
+                      SETMIN_RGB(clow, blockline[bx]);
+                      SETMAX_RGB(chigh, blockline[bx]);
+                    }
+                  else
+                    {
+                      SETMIN(clow, blockline[bx]);
+                      SETMAX(chigh, blockline[bx]);
+                    }
+                }
+            }
+          /* add our current error */
+#if DITHER_BLOCK
+          error_add(&clow_dither, error_low, &clow);
+          error_add(&chigh_dither, error_high, &chigh);
+#else
+          clow_dither = clow;
+          chigh_dither = chigh;
+#endif
+          /* crop to the nearest color */
+          if (pixel_class == PIXELS_OPAQUE)
+            {
+              nearest_pvr_color_opaque(&clow_dither, FALSE);
+              nearest_pvr_color_opaque(&chigh_dither, TRUE);
+            }
+          else
+            {
+              nearest_pvr_color(&clow_dither, FALSE);
+              nearest_pvr_color(&chigh_dither, TRUE);
+            }
+          col_low[1+x+block_offs] = clow_dither;
+          col_high[1+x+block_offs] = chigh_dither;
+          /* update errors */
+#if DITHER_BLOCK
+          error_update(error_low, &clow, &clow_dither);
+          error_update(error_high, &chigh, &chigh_dither);
+#endif
+        }
+    }
+}
+
+/* 4x4 Bayer matrix for PVR_DITHER_ORDERED, indexed by the pixel's place
+ * in its block */
+static const guint8 dither_bayer[16] = {
+   0,  8,  2, 10,
+  12,  4, 14,  6,
+   3, 11,  1,  9,
+  15,  7, 13,  5
+};
+
+static inline gint
+dither_ordered_channel (gint value,
+                        gint threshold,
+                        gint range)
+{
+  /* up to 15/256 of the range either way, enough to break up the bands
+   * between modulation levels without adding visible noise */
+  value += (threshold * 2 - 15) * range / 256;
+  return CLAMP (value, 0, 255);
+}
+
+/* Nudges each pixel of a block by the Bayer matrix, in proportion to how
+ * far apart the block's colours are in each channel. Needs nothing from
+ * any other block, so the result doesn't depend on the order blocks are
+ * done in. Fully clear and fully opaque pixels keep their alpha, or the
+ * colour of clear ones would start to show */
+static ALWAYS_INLINE void
+dither_ordered_block (const Color *block,
+                      guint        width,
+                      guint        block_width,
+                      const Color *low,
+                      const Color *high,
+                      Color       *out,
+                      PixelClass   pixel_class)
+{
+  gint range_red = ABS ((gint) high->red - (gint) low->red);
+  gint range_green = ABS ((gint) high->green - (gint) low->green);
+  gint range_blue = ABS ((gint) high->blue - (gint) low->blue);
+  gint range_alpha = ABS ((gint) high->alpha - (gint) low->alpha);
+  guint bx, by;
+
+  for (by=0;by<4;by++)
+    for (bx=0;bx<block_width;bx++)
+      {
+        const Color *pixel = &block[bx + by*width];
+        Color *dithered = &out[bx + by*block_width];
+        gint threshold = dither_bayer[(bx & 3) + by*4];
+
+        dithered->red = dither_ordered_channel (pixel->red, threshold,
+                                                range_red);
+        dithered->green = dither_ordered_channel (pixel->green, threshold,
+                                                  range_green);
+        dithered->blue = dither_ordered_channel (pixel->blue, threshold,
+                                                 range_blue);
+        if (pixel_class != PIXELS_GENERAL ||
+            pixel->alpha == 0 || pixel->alpha == 255)
+          dithered->alpha = pixel->alpha;
+        else
+          dithered->alpha = dither_ordered_channel (pixel->alpha, threshold,
+                                                    range_alpha);
+      }
+}
+
+/* Assembles block x,y from its pixels, which are all of the given class,
+ * and the block colours around it. error is the error diffusion state
+ * for PVR_DITHER_ROW and PVR_DITHER_PIXEL, and unused otherwise */
+static ALWAYS_INLINE void
+compress_assemble_block (CompressJob *job,
+                         guint        x,
+                         guint        y,
+                         guint32      my,
+                         gint        *error,
+                         PixelClass   pixel_class)
+{
+  guint block_stride = job->block_stride;
+  Color *col_low = job->col_low;
+  Color *col_high = job->col_high;
+  guint block_width = job->block_width;
+  guint32 *out_data = job->out_data;
+  Color tmp[32];
+  Color pixels_dither[32];
+  const Color *block;
+  const Color *pixels;
+  guint width, pixel_stride;
+  gint offs = x + (y-job->colour_y0)*block_stride;
+  guint32 pixel_high_word = 0;
+  guint32 pixel_low_word = 0;
+  guint col_a, col_b;
+  gboolean punch_through = FALSE;
+  gint bx,by;
+  guint32 mz;
+
+  /* now work out what every pixel should be... */
+  block = compress_get_block (job, x, y, tmp, &width);
+  if (job->dither == PVR_DITHER_NONE)
+    {
+      pixels = block;
+      pixel_stride = width;
+    }
+  else if (job->dither == PVR_DITHER_ORDERED)
+    {
+      dither_ordered_block (block, width, block_width,
+                            &col_low[offs+1+block_stride],
+                            &col_high[offs+1+block_stride],
+                            pixels_dither, pixel_class);
+      pixels = pixels_dither;
+      pixel_stride = block_width;
+    }
+  else
+    {
+      /* the dither goes in the same order as the original
+       * per-pixel loop, so its results don't change. Pixels of the
+       * other classes keep their alpha of 0 or 255: the error being
+       * diffused only comes from clamping, which never touches those,
+       * so only RGB needs doing */
+      for (by=3;by>=0;by--)
+        for (bx=block_width-1;bx>=0;bx--)
+          {
+            Color pixel_col = block[bx + by*width];
+            Color *pixel_col_dither =
+              &pixels_dither[bx + by*block_width];
+
+            if (pixel_class == PIXELS_GENERAL)
+              {
+                error_add(pixel_col_dither, error, &pixel_col);
+                error_update(error, &pixel_col, pixel_col_dither);
+              }
+            else
+              {
+                error_add_rgb(pixel_col_dither, error, &pixel_col);
+                error_update_rgb(error, &pixel_col, pixel_col_dither);
+              }
+          }
+      pixels = pixels_dither;
+      pixel_stride = block_width;
+    }
+  pixel_low_word = job->modulate_block(pixels, pixel_stride,
+                                       &col_low[offs],
+                                       &col_high[offs],
+                                       block_stride);
+  /* blocks with see-through pixels may do better in the other mode */
+  if (pixel_class != PIXELS_OPAQUE && job->format == PVR_FORMAT_PVRTC4 &&
+      block_has_clear_pixel (pixels, pixel_stride))
+    pixel_low_word = modulate_block_punch_through (pixels, pixel_stride,
+                                                   &col_low[offs],
+                                                   &col_high[offs],
+                                                   block_stride,
+                                                   pixel_low_word,
+                                                   &punch_through);
+  /* pack our two colours */
+  if (pixel_class == PIXELS_OPAQUE)
+    {
+      col_a = color_to_pvr_color_opaque(&col_low[offs+1+block_stride]);
+      col_b = color_to_pvr_color_opaque(&col_high[offs+1+block_stride]);
+    }
+  else
+    {
+      col_a = color_to_pvr_color(&col_low[offs+1+block_stride]);
+      col_b = color_to_pvr_color(&col_high[offs+1+block_stride]);
+    }
+  /* and finally pack into a block. The last bit is the modulation
+   * mode: 0, 3/8, 5/8, 1 or for punch-through 0, 1/2, clear, 1 */
+  pixel_high_word = (col_b << 16) | (col_a & 0xFFFE) | punch_through;
+
+  /* write data out */
+  mz = compress_out_offset (job, x, y, my);
+  out_data[mz  ] = pixel_low_word;
+  out_data[mz+1] = pixel_high_word;
+}
+
+/* Gets x or y back from a morton number */
+static inline guint32
+morton_compact (guint32 v)
+{
+  v &= 0x55555555;
+  v = (v | (v >> 1)) & 0x33333333;
+  v = (v | (v >> 2)) & 0x0f0f0f0f;
+  v = (v | (v >> 4)) & 0x00ff00ff;
+  v = (v | (v >> 8)) & 0x0000ffff;
+  return v;
+}
+
+/* Assembles the blocks of the tile at tx,ty that are in the columns
+ * x_start to x_end and the rows y_start to y_end, in morton order.
+ * Specialised for each class by DEFINE_PIXEL_CLASS_KERNELS */
+static ALWAYS_INLINE void
+compress_assemble_tile_class (CompressJob *job,
+                              guint        tx,
+                              guint        ty,
+                              guint        x_start,
+                              guint        x_end,
+                              guint        y_start,
+                              guint        y_end,
+                              PixelClass   pixel_class)
+{
+  guint tile_side = job->assemble_side;
+  guint32 tile_my = morton_spread (ty);
+  guint i, x, y;
+
+  for (i=0;i<tile_side*tile_side;i++)
+    {
+      /* y is in the even bits of i and x in the odd ones */
+      y = ty + morton_compact (i);
+      x = tx + morton_compact (i >> 1);
+      if (y >= y_start && y < y_end && x >= x_start && x < x_end)
+        compress_assemble_block (job, x, y, tile_my | (i & 0x55555555),
+                                 NULL, pixel_class);
+    }
+}
+
+/* The encoder's per-block work, with everything that depends on the class
+ * of the pixels worked out when it's compiled */
+typedef struct
+{
+  void (*block_colours) (CompressJob *job,
+                         guint        x_start,
+                         guint        x_end,
+                         guint        y_start,
+                         guint        y_end);
+  void (*assemble_tile) (CompressJob *job,
+                         guint        tx,
+                         guint        ty,
+                         guint        x_start,
+                         guint        x_end,
+                         guint        y_start,
+                         guint        y_end);
+  void (*assemble_row) (CompressJob *job,
+                        guint        x_start,
+                        guint        x_end,
+                        guint        y,
+                        guint32      my,
+                        gint        *error);
+} PixelClassKernels;
+
+#define DEFINE_PIXEL_CLASS_KERNELS(name, pixel_class) \
+static void \
+compress_block_colours_##name (CompressJob *job, \
+                               guint        x_start, \
+                               guint        x_end, \
+                               guint        y_start, \
+                               guint        y_end) \
+{ \
+  compress_block_colours_class (job, x_start, x_end, y_start, y_end, \
+                                pixel_class); \
+} \
+static void \
+compress_assemble_tile_##name (CompressJob *job, \
+                               guint        tx, \
+                               guint        ty, \
+                               guint        x_start, \
+                               guint        x_end, \
+                               guint        y_start, \
+                               guint        y_end) \
+{ \
+  compress_assemble_tile_class (job, tx, ty, x_start, x_end, \
+                                y_start, y_end, pixel_class); \
+} \
+static void \
+compress_assemble_row_##name (CompressJob *job, \
+                              guint        x_start, \
+                              guint        x_end, \
+                              guint        y, \
+                              guint32      my, \
+                              gint        *error) \
+{ \
+  guint x; \
+ \
+  for (x=x_start;x<x_end;x++) \
+    compress_assemble_block (job, x, y, my, error, pixel_class); \
+}
+
+DEFINE_PIXEL_CLASS_KERNELS (opaque, PIXELS_OPAQUE)
+DEFINE_PIXEL_CLASS_KERNELS (binary, PIXELS_BINARY)
+DEFINE_PIXEL_CLASS_KERNELS (general, PIXELS_GENERAL)
+
+/* indexed by PixelClass */
+static const PixelClassKernels pixel_class_kernels[] = {
+  { compress_block_colours_opaque, compress_assemble_tile_opaque,
+    compress_assemble_row_opaque },
+  { compress_block_colours_binary, compress_assemble_tile_binary,
+    compress_assemble_row_binary },
+  { compress_block_colours_general, compress_assemble_tile_general,
+    compress_assemble_row_general }
+};
+
+/* work out maximum and minimum colour values for each block in the
+ * columns x_start to x_end of the rows y_start to y_end, a tile at a time
+ * so that each tile gets the kernels for its pixels */
+static void
+compress_block_colours_rect (CompressJob *job,
+                             guint        x_start,
+                             guint        x_end,
+                             guint        y_start,
+                             guint        y_end)
+{
+  guint tile_side = job->assemble_side;
+  guint tx, ty;
+
+  for (ty=y_start & ~(tile_side-1);ty<y_end;ty+=tile_side)
+    for (tx=x_start & ~(tile_side-1);tx<x_end;tx+=tile_side)
+      {
+        guint y0 = MAX (ty, y_start), y1 = MIN (ty + tile_side, y_end);
+        guint x0 = MAX (tx, x_start), x1 = MIN (tx + tile_side, x_end);
+        PixelClass pixel_class;
+
+        pixel_class = classify_blocks (job, x0, x1, y0, y1);
+        pixel_class_kernels[pixel_class].block_colours (job, x0, x1,
+                                                        y0, y1);
+      }
+}
+
+/* work out maximum and minimum colour values for each block in the
+ * rows y_start to y_end */
+static void
+compress_block_colours (CompressJob *job,
+                        guint        y_start,
+                        guint        y_end)
+{
+  guint width_block = job->width_block;
+  guint block_stride = job->block_stride;
+  guint y;
+
+  compress_block_colours_rect (job, 0, width_block, y_start, y_end);
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint block_offs = (y-job->colour_y0+1)*block_stride;
+
+      /* copy beginning and end */
+      pad_block_colour_row (&job->col_low[block_offs], width_block);
+      pad_block_colour_row (&job->col_high[block_offs], width_block);
+    }
+}
+
+/* assembles the blocks in the columns x_start to x_end of the rows
+ * y_start to y_end a tile at a time, for the dithers that don't care
+ * what order the blocks go in */
+static void
+compress_assemble_rect (CompressJob *job,
+                        guint        x_start,
+                        guint        x_end,
+                        guint        y_start,
+                        guint        y_end)
+{
+  guint tile_side = job->assemble_side;
+  guint tx, ty;
+
+  for (ty=y_start & ~(tile_side-1);ty<y_end;ty+=tile_side)
+    for (tx=x_start & ~(tile_side-1);tx<x_end;tx+=tile_side)
+      {
+        /* bands don't always start and end on a whole tile */
+        guint y0 = MAX (ty, y_start), y1 = MIN (ty + tile_side, y_end);
+        guint x0 = MAX (tx, x_start), x1 = MIN (tx + tile_side, x_end);
+        PixelClass pixel_class;
+
+        pixel_class = classify_blocks (job, x0, x1, y0, y1);
+        pixel_class_kernels[pixel_class].assemble_tile (job, tx, ty,
+                                                        x0, x1, y0, y1);
+      }
+}
+
+/* assemble each block in the rows y_start to y_end. The block colours
+ * for these rows and the rows either side must already be worked out.
+ *
+ * Unless the dither has to go in rows, the blocks are done a square tile
+ * at a time, in morton order within each tile. The output is then
+ * written in order, and the block colours being read stay in the cache
+ * rather than being fetched again for each row of a wide texture */
+static void
+compress_assemble_blocks (CompressJob *job,
+                          guint        y_start,
+                          guint        y_end)
+{
+  guint tile_side = job->assemble_side;
+  gint error_row[4];
+  gint *error;
+  guint x,y;
+
+  if (job->dither == PVR_DITHER_NONE || job->dither == PVR_DITHER_ORDERED)
+    {
+      compress_assemble_rect (job, 0, job->width_block, y_start, y_end);
+      return;
+    }
+
+  /* PVR_DITHER_PIXEL carries its error right through the image, the
+   * others only along one row of blocks */
+  error = job->dither == PVR_DITHER_PIXEL ? job->error_pixel : error_row;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint32 my = morton_spread (y); /* for morton numbers later */
+
+      if (job->dither == PVR_DITHER_ROW)
+        memset (error_row, 0, sizeof (error_row));
+
+      /* the row goes in order, but each tile's width of it gets the
+       * kernel for its pixels */
+      for (x=0;x<job->width_block;x+=tile_side)
+        {
+          guint x_end = MIN (x + tile_side, job->width_block);
+          PixelClass pixel_class;
+
+          pixel_class = classify_blocks (job, x, x_end, y, y + 1);
+          pixel_class_kernels[pixel_class].assemble_row (job, x, x_end, y,
+                                                         my, error);
+        }
+    }
+}
+
+/* PVR_QUALITY_HIGH goes over every block's colours this many times */
+#define REFINE_ITERATIONS 2
+
+/* The fields of a PVR colour word that refine_block steps through */
+typedef struct
+{
+  guint shift;
+  guint mask;
+  guint max;
+} RefineField;
+
+static const RefineField refine_fields_opaque[] = {
+  { 10, 31, 31 }, { 5, 31, 31 }, { 0, 31, 31 }
+};
+/* alpha stops at 6, as 7 would make the colour opaque */
+static const RefineField refine_fields_alpha[] = {
+  { 12, 7, 6 }, { 8, 15, 15 }, { 4, 15, 15 }, { 0, 15, 15 }
+};
+
+/* Works out the total error of the pixels that the colours of block x,y
+ * play a part in, if each pixel were given its best modulation value.
+ * Gives up once it reaches limit */
+static guint
+refine_region_error (const CompressJob *job,
+                     guint              x,
+                     guint              y,
+                     guint              limit)
+{
+  guint block_width = job->block_width;
+  guint half = block_width / 2;
+  gint px0 = MAX (0, (gint) (x*block_width) - (gint) half);
+  gint px1 = MIN (job->width, (gint) ((x+1)*block_width + half));
+  gint py0 = MAX (0, (gint) (y*4) - 2);
+  gint py1 = MIN ((gint) (job->height_block*4), (gint) (y*4) + 6);
+  guint error = 0;
+  gint px, py;
+
+  for (py=py0;py<py1 && error<limit;py++)
+    for (px=px0;px<px1;px++)
+      {
+        Color tmp;
+        const Color *pixel = compress_get_pixel (job, px, py, &tmp);
+        guint offs = (px + half) / block_width +
+                     ((py + 2) / 4 - job->colour_y0) * job->block_stride;
+        Color cl, ch, cm;
+        guint best;
+
+        interp_block_colours (&job->col_low[offs], &job->col_high[offs],
+                              job->block_stride,
+                              ((px + half) % block_width) * (256 / block_width),
+                              ((py + 2) & 3) * 64,
+                              &cl, &ch);
+        best = MIN (color_diff (pixel, &cl), color_diff (pixel, &ch));
+        /* PVRTC2 only gets to choose between the ends */
+        if (job->format == PVR_FORMAT_PVRTC4)
+          {
+            color_interp (&cm, &cl, &ch, 96);
+            best = MIN (best, (guint) color_diff (pixel, &cm));
+            color_interp (&cm, &cl, &ch, 160);
+            best = MIN (best, (guint) color_diff (pixel, &cm));
+          }
+        error += best;
+      }
+
+  return error;
+}
+
+/* Sets the colour of block x,y in grid, and the padding copies of it if
+ * it is on an edge */
+static void
+refine_set_colour (CompressJob *job,
+                   Color       *grid,
+                   guint        x,
+                   guint        y,
+                   Color        col)
+{
+  guint row = y - job->colour_y0 + 1;
+  guint first = row, last = row, r;
+
+  if (y == 0)
+    first = row - 1;
+  if (y == job->height_block - 1)
+    last = row + 1;
+
+  for (r=first;r<=last;r++)
+    {
+      Color *line = &grid[r * job->block_stride];
+
+      line[x+1] = col;
+      if (x == 0)
+        line[0] = col;
+      if (x == job->width_block - 1)
+        line[x+2] = col;
+    }
+}
+
+/* Tries moving each channel of the low and high colours of block x,y one
+ * step either way, keeping each change that makes the pixels around the
+ * block come out closer to the original */
+static void
+refine_block (CompressJob *job,
+              guint        x,
+              guint        y)
+{
+  guint offs = (y - job->colour_y0 + 1) * job->block_stride + x + 1;
+  guint error, end;
+
+  /* the bottom bit of the low colour is never written, so take it off
+   * before measuring anything */
+  refine_set_colour (job, job->col_low, x, y,
+                     pvr_color_to_model (color_to_pvr_color (&job->col_low[offs]) & 0xFFFE));
+  error = refine_region_error (job, x, y, G_MAXUINT);
+
+  for (end=0;end<2;end++)
+    {
+      Color *grid = end ? job->col_high : job->col_low;
+      guint32 word = color_to_pvr_color (&grid[offs]);
+      const RefineField *fields;
+      guint n_fields, f;
+      gint delta;
+
+      if (word & 0x8000)
+        {
+          fields = refine_fields_opaque;
+          n_fields = G_N_ELEMENTS (refine_fields_opaque);
+        }
+      else
+        {
+          fields = refine_fields_alpha;
+          n_fields = G_N_ELEMENTS (refine_fields_alpha);
+        }
+      if (!end)
+        word &= 0xFFFE;
+
+      for (f=0;f<n_fields;f++)
+        for (delta=-1;delta<=1;delta+=2)
+          {
+            /* low blue moves 2 at a time to keep its bottom bit clear */
+            gint step = (!end && fields[f].shift == 0) ? 2 : 1;
+            guint mask = fields[f].mask;
+            gint value = (word >> fields[f].shift) & mask;
+            guint32 candidate;
+            guint candidate_error;
+
+            value += delta * step;
+            if (value < 0 || value > (gint) fields[f].max)
+              continue;
+
+            candidate = (word & ~(mask << fields[f].shift)) |
+                        (value << fields[f].shift);
+            refine_set_colour (job, grid, x, y,
+                               pvr_color_to_model (candidate));
+            candidate_error = refine_region_error (job, x, y, error);
+            if (candidate_error < error)
+              {
+                error = candidate_error;
+                word = candidate;
+              }
+            else
+              refine_set_colour (job, grid, x, y, pvr_color_to_model (word));
+          }
+    }
+}
+
+/* Refines the blocks in every third row from y_start to y_end, starting
+ * with those whose row is phase mod 3. Those rows don't share any pixels,
+ * so they can be done in parallel */
+static void
+compress_refine_rows (CompressJob *job,
+                      guint        phase,
+                      guint        y_start,
+                      guint        y_end)
+{
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    if (y % 3 == phase)
+      for (x=0;x<job->width_block;x++)
+        refine_block (job, x, y);
+}
+
+static void
+compress_rows (gpointer data,
+               guint    pass,
+               guint    y_start,
+               guint    y_end)
+{
+  CompressJob *job = data;
+
+  if (pass == 0)
+    compress_block_colours (job, y_start, y_end);
+  else if (pass <= job->refine_passes)
+    compress_refine_rows (job, (pass - 1) % 3, y_start, y_end);
+  else
+    compress_assemble_blocks (job, y_start, y_end);
+}
+
+static void
+compress_pass_done (gpointer data,
+                    guint    pass)
+{
+  CompressJob *job = data;
+
+  if (pass == 0)
+    pad_block_colours (job->col_low, job->col_high,
+                       job->block_stride, job->height_block);
+}
+
+static const RowPasses compress_passes = {
+  compress_rows,
+  compress_pass_done,
+  2
+};
+
+static const RowPasses compress_refine_passes = {
+  compress_rows,
+  compress_pass_done,
+  2 + REFINE_ITERATIONS * 3
+};
+
+/* ETC1 blocks don't depend on their neighbours, so they need just the
+ * one pass. The rows are relative to job->band_y0 */
+static void
+compress_etc1_rows (gpointer data,
+                    guint    pass,
+                    guint    y_start,
+                    guint    y_end)
+{
+  CompressJob *job = data;
+  guint x,y;
+
+  for (y=job->band_y0+y_start;y<job->band_y0+y_end;y++)
+    for (x=0;x<job->width_block;x++)
+      {
+        Color tmp[32];
+        const Color *block;
+        guint stride;
+
+        block = compress_get_block (job, x, y, tmp, &stride);
+        _pvr_texture_etc1_encode_block (block, stride, job->etc1_mode,
+                                        (guchar*)&job->out_data
+                                          [compress_out_offset (job, x, y, 0)]);
+      }
+}
+
+static const RowPasses compress_etc1_passes = {
+  compress_etc1_rows,
+  NULL,
+  1
+};
+
+/**
+ * pvr_texture_options_init:
+ *
+ * Fills in @options with the defaults, which match what
+ * pvr_texture_compress_pvrtc4 does.
+ */
+void
+pvr_texture_options_init (PvrTextureOptions *options)
+{
+  g_return_if_fail (options != NULL);
+
+  options->dither = PVR_DITHER_PIXEL;
+  options->n_threads = 0;
+  options->simd = PVR_SIMD_AUTO;
+  options->mipmaps = FALSE;
+  options->etc1_mode = PVR_ETC1_QUALITY;
+  options->quality = PVR_QUALITY_NORMAL;
+  options->progress = NULL;
+  options->progress_data = NULL;
+  options->writer = NULL;
+}
+
+/**
+ * pvr_texture_compress_pvrtc4:
+ *
+ * Takes an RGBA8888 bitmap and returns the data (and size) created
+ * after it has been compressed in the PVRTC4 format.
+ *
+ * Since: 0.8.2-maemo
+ */
+guchar *pvr_texture_compress_pvrtc4(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint *compressed_size)
+{
+  PvrTextureOptions options;
+
+  pvr_texture_options_init (&options);
+
+  return pvr_texture_compress_pvrtc4_full (uncompressed_data,
+                                           width, height,
+                                           &options,
+                                           compressed_size);
+}
+
+/* Sets up everything in job but the buffers, for a width x height image
+ * in the given format */
+static void
+compress_job_init (CompressJob             *job,
+                   PvrFormat                format,
+                   gint                     width,
+                   gint                     height,
+                   const PvrTextureOptions *options)
+{
+  memset (job, 0, sizeof (*job));
+  job->format = format;
+  job->etc1_mode = options->etc1_mode;
+  job->width = width;
+  job->block_width = format == PVR_FORMAT_PVRTC2 ? 8 : 4;
+  job->width_block = width / job->block_width;
+  job->block_stride = job->width_block+2;
+  job->height_block = height / 4;
+  job->dither = options->dither;
+  if (options->quality == PVR_QUALITY_FAST)
+    job->dither = PVR_DITHER_NONE;
+  if (format == PVR_FORMAT_PVRTC2)
+    job->modulate_block = modulate_block_pvrtc2_c;
+  else
+    job->modulate_block = _pvr_texture_simd_get_modulate_block (options->simd);
+  /* the vector kernels search all 4 colours faster than the C one can
+   * skip the search, so PVR_QUALITY_FAST only does that without them */
+  if (!job->modulate_block)
+    job->modulate_block = options->quality == PVR_QUALITY_FAST ?
+                          modulate_block_fast_c : modulate_block_c;
+  morton_layout_init (&job->layout, job->width_block, job->height_block);
+  /* both are powers of 2 for PVRTC, so this is too */
+  job->assemble_side = MIN (ASSEMBLE_TILE_SIDE,
+                            MIN (job->width_block, job->height_block));
+}
+
+/* Compresses the whole of a job whose buffers are all set up, on the
+ * runner's threads if there is one */
+static void
+compress_run (CompressJob             *job,
+              const PvrTextureOptions *options,
+              RowRunner               *runner)
+{
+  guint n_threads;
+
+  n_threads = choose_n_threads (options->n_threads, job->height_block);
+#if RAND_BLOCK || DITHER_BLOCK
+  /* these carry state from block to block */
+  n_threads = 1;
+#endif
+  if (job->dither == PVR_DITHER_PIXEL)
+    n_threads = 1;
+
+  if (job->format == PVR_FORMAT_ETC1)
+    run_row_passes_with (runner, &compress_etc1_passes, job,
+                         job->height_block,
+                         choose_n_threads (options->n_threads,
+                                           job->height_block));
+  else if (options->quality == PVR_QUALITY_HIGH)
+    {
+      job->refine_passes = REFINE_ITERATIONS * 3;
+      run_row_passes_with (runner, &compress_refine_passes, job,
+                           job->height_block, n_threads);
+    }
+  else
+    run_row_passes_with (runner, &compress_passes, job, job->height_block,
+                         n_threads);
+}
+
+static guchar *
+compress_full (PvrFormat                format,
+               const guchar            *uncompressed_data,
+               gint                     width,
+               gint                     height,
+               const PvrTextureOptions *options,
+               guint                   *compressed_size)
+{
+  CompressJob job;
+  gint block_width = format == PVR_FORMAT_PVRTC2 ? 8 : 4;
+
+  g_return_val_if_fail(compressed_size!=0, 0);
+  g_return_val_if_fail(options!=0, 0);
+  /* must be a multiple of the block size + Power of 2 in each direction,
+   * though ETC1 doesn't mind about the power of 2 */
+  if ((width%block_width) || (height&3) || width<=0 || height<=0)
+    return 0;
+  if (format != PVR_FORMAT_ETC1 &&
+      (!is_power_2(width) || !is_power_2(height)))
+    return 0;
+
+  compress_job_init (&job, format, width, height, options);
+  job.uncompressed_data = uncompressed_data;
+  /* 64 bits per block, which is 4 or 2 bits per pixel */
+  *compressed_size = job.width_block*job.height_block*sizeof(guint32)*2;
+  job.out_data = g_malloc(*compressed_size);
+  /* but we make our block colour list one bigger all the way around
+   * and copy the colours so we don't need to do bounds checking */
+  job.col_low = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+  job.col_high = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+
+  compress_run (&job, options, NULL);
+
+  g_free(job.col_low);
+  g_free(job.col_high);
+  return (guchar*)job.out_data;
+}
+
+/**
+ * pvr_texture_compress_pvrtc4_full:
+ *
+ * Like pvr_texture_compress_pvrtc4, but using the given @options. Rows of
+ * blocks are split over @options->n_threads threads (or one per CPU if
+ * it is 0). Unless @options->dither is PVR_DITHER_PIXEL, which has to run
+ * on one thread, the result is the same whatever number of threads is
+ * used.
+ */
+guchar *
+pvr_texture_compress_pvrtc4_full (const guchar            *uncompressed_data,
+                                  gint                     width,
+                                  gint                     height,
+                                  const PvrTextureOptions *options,
+                                  guint                   *compressed_size)
+{
+  return compress_full (PVR_FORMAT_PVRTC4, uncompressed_data, width, height,
+                        options, compressed_size);
+}
+
+/**
+ * pvr_texture_compress_pvrtc2:
+ *
+ * Takes an RGBA8888 bitmap and returns the data (and size) created
+ * after it has been compressed in the PVRTC2 format, which is half the
+ * size of PVRTC4. @width must be at least 8.
+ */
+guchar *
+pvr_texture_compress_pvrtc2 (const guchar *uncompressed_data,
+                             gint          width,
+                             gint          height,
+                             guint        *compressed_size)
+{
+  PvrTextureOptions options;
+
+  pvr_texture_options_init (&options);
+
+  return pvr_texture_compress_pvrtc2_full (uncompressed_data,
+                                           width, height,
+                                           &options,
+                                           compressed_size);
+}
+
+/**
+ * pvr_texture_compress_pvrtc2_full:
+ *
+ * Like pvr_texture_compress_pvrtc2, but using the given @options, as for
+ * pvr_texture_compress_pvrtc4_full. There are no vector kernels for
+ * PVRTC2, so @options->simd is ignored.
+ */
+guchar *
+pvr_texture_compress_pvrtc2_full (const guchar            *uncompressed_data,
+                                  gint                     width,
+                                  gint                     height,
+                                  const PvrTextureOptions *options,
+                                  guint                   *compressed_size)
+{
+  return compress_full (PVR_FORMAT_PVRTC2, uncompressed_data, width, height,
+                        options, compressed_size);
+}
+
+/**
+ * pvr_texture_compress_etc1:
+ *
+ * Takes an RGBA8888 bitmap and returns the data (and size) created
+ * after it has been compressed in the ETC1 format. Alpha is thrown away.
+ * ETC1 doesn't need a power of 2, so @width and @height need only be
+ * multiples of 4.
+ */
+guchar *
+pvr_texture_compress_etc1 (const guchar *uncompressed_data,
+                           gint          width,
+                           gint          height,
+                           guint        *compressed_size)
+{
+  PvrTextureOptions options;
+
+  pvr_texture_options_init (&options);
+
+  return pvr_texture_compress_etc1_full (uncompressed_data,
+                                         width, height,
+                                         &options,
+                                         compressed_size);
+}
+
+/**
+ * pvr_texture_compress_etc1_full:
+ *
+ * Like pvr_texture_compress_etc1, but using the given @options. Only
+ * @options->n_threads and @options->etc1_mode matter.
+ */
+guchar *
+pvr_texture_compress_etc1_full (const guchar            *uncompressed_data,
+                                gint                     width,
+                                gint                     height,
+                                const PvrTextureOptions *options,
+                                guint                   *compressed_size)
+{
+  return compress_full (PVR_FORMAT_ETC1, uncompressed_data, width, height,
+                        options, compressed_size);
+}
+
+/**
+ * pvr_texture_update_pvrtc4:
+ * @compressed_data: PVRTC4 data of the whole texture, as from
+ * pvr_texture_compress_pvrtc4_full, which is changed in place
+ * @uncompressed_data: the RGBA8888 pixels of the whole texture, with the
+ * rectangle already changed
+ * @x, @y, @rect_width, @rect_height: the rectangle of pixels that changed
+ *
+ * Recompresses just the blocks of @compressed_data that the changed
+ * pixels affect: those in the rectangle, and the ring of blocks around
+ * it that the colours of those blocks are blended into. The time it
+ * takes goes with the size of the rectangle rather than the texture.
+ *
+ * If @compressed_data came from the same @options, the result is the
+ * same as compressing the whole texture again. That can only be so for
+ * the dithers that keep nothing from block to block, so PVR_DITHER_ROW
+ * and PVR_DITHER_PIXEL are done as PVR_DITHER_ORDERED; and
+ * PVR_QUALITY_HIGH, which looks across blocks, is done as
+ * PVR_QUALITY_NORMAL. It runs on the calling thread.
+ *
+ * Returns: %FALSE if the size isn't one PVRTC4 can have
+ */
+gboolean
+pvr_texture_update_pvrtc4 (guchar                  *compressed_data,
+                           const guchar            *uncompressed_data,
+                           gint                     width,
+                           gint                     height,
+                           gint                     x,
+                           gint                     y,
+                           gint                     rect_width,
+                           gint                     rect_height,
+                           const PvrTextureOptions *options)
+{
+  CompressJob job;
+  PvrTextureOptions block_options;
+  gint x_end, y_end;
+  guint cx0, cx1, cy0, cy1, ax0, ax1, ay0, ay1;
+  guint rows, row;
+
+  g_return_val_if_fail (compressed_data != NULL, FALSE);
+  g_return_val_if_fail (uncompressed_data != NULL, FALSE);
+  g_return_val_if_fail (options != NULL, FALSE);
+  if ((width&3) || (height&3) || width<=0 || height<=0 ||
+      !is_power_2(width) || !is_power_2(height))
+    return FALSE;
+
+  x_end = MIN (x + rect_width, width);
+  y_end = MIN (y + rect_height, height);
+  x = MAX (x, 0);
+  y = MAX (y, 0);
+  if (x >= x_end || y >= y_end)
+    return TRUE;
+
+  block_options = *options;
+  if (block_options.dither == PVR_DITHER_ROW ||
+      block_options.dither == PVR_DITHER_PIXEL)
+    block_options.dither = PVR_DITHER_ORDERED;
+
+  compress_job_init (&job, PVR_FORMAT_PVRTC4, width, height, &block_options);
+  job.uncompressed_data = uncompressed_data;
+  job.out_data = (guint32 *) compressed_data;
+
+  /* the blocks to assemble are the changed ones and one more all
+   * round, and they need the colours of one more again */
+  ax0 = MAX (x / 4 - 1, 0);
+  ay0 = MAX (y / 4 - 1, 0);
+  ax1 = MIN ((x_end + 3) / 4 + 1, (gint) job.width_block);
+  ay1 = MIN ((y_end + 3) / 4 + 1, (gint) job.height_block);
+  cx0 = ax0 ? ax0 - 1 : 0;
+  cy0 = ay0 ? ay0 - 1 : 0;
+  cx1 = MIN (ax1 + 1, job.width_block);
+  cy1 = MIN (ay1 + 1, job.height_block);
+
+  /* the colours are held for whole rows, so the layout is the same as
+   * for the full texture, but only the columns cx0 to cx1 are filled */
+  rows = cy1 - cy0;
+  job.colour_y0 = cy0;
+  job.col_low = g_new (Color, job.block_stride * (rows + 2));
+  job.col_high = g_new (Color, job.block_stride * (rows + 2));
+
+  compress_block_colours_rect (&job, cx0, cx1, cy0, cy1);
+  for (row = 1; row <= rows; row++)
+    {
+      Color *low = &job.col_low[row * job.block_stride];
+      Color *high = &job.col_high[row * job.block_stride];
+
+      /* off the left and right, if they are in */
+      if (cx0 == 0)
+        {
+          low[0] = low[1];
+          high[0] = high[1];
+        }
+      if (cx1 == job.width_block)
+        {
+          low[cx1 + 1] = low[cx1];
+          high[cx1 + 1] = high[cx1];
+        }
+    }
+  /* and above the top and below the bottom */
+  if (cy0 == 0)
+    {
+      memcpy (&job.col_low[cx0], &job.col_low[job.block_stride + cx0],
+              sizeof (Color) * (cx1 - cx0 + 2));
+      memcpy (&job.col_high[cx0], &job.col_high[job.block_stride + cx0],
+              sizeof (Color) * (cx1 - cx0 + 2));
+    }
+  if (cy1 == job.height_block)
+    {
+      memcpy (&job.col_low[(rows + 1) * job.block_stride + cx0],
+              &job.col_low[rows * job.block_stride + cx0],
+              sizeof (Color) * (cx1 - cx0 + 2));
+      memcpy (&job.col_high[(rows + 1) * job.block_stride + cx0],
+              &job.col_high[rows * job.block_stride + cx0],
+              sizeof (Color) * (cx1 - cx0 + 2));
+    }
+
+  compress_assemble_rect (&job, ax0, ax1, ay0, ay1);
+
+  g_free (job.col_low);
+  g_free (job.col_high);
+  return TRUE;
+}
+
+/* The reference version of PvrDecodeBlockFunc */
+static void
+decode_block_c (guint32      pixel_bits_word,
+                gboolean     block_alpha_mode,
+                const Color *low,
+                const Color *high,
+                guint        block_stride,
+                Color       *out,
+                guint        out_stride)
+{
+  gint bx,by;
+
+  /* now work out what every pixel in this block should be... */
+  for (by=0;by<4;by++)
+    for (bx=0;bx<4;bx++)
+      {
+        Color tmpa, tmpb, cl, ch, col;
+        gint boffs = ((bx+2)>>2) + (((by+2)>>2) * block_stride);
+        gint pixel_bits;
+        gint amtx, amty;
+
+        amtx = ((bx+2)&3) * 64;
+        amty = ((by+2)&3) * 64;
+        pixel_bits = pixel_bits_word&3;
+        pixel_bits_word = pixel_bits_word >> 2;
+
+        color_interp(&tmpa, &low[boffs],
+                        &low[boffs+1], amtx);
+        color_interp(&tmpb, &low[boffs+block_stride],
+                        &low[boffs+block_stride+1], amtx);
+        color_interp(&cl, &tmpa, &tmpb, amty);
+
+        color_interp(&tmpa, &high[boffs],
+                        &high[boffs+1], amtx);
+        color_interp(&tmpb, &high[boffs+block_stride],
+                        &high[boffs+block_stride+1], amtx);
+        color_interp(&ch, &tmpa, &tmpb, amty);
+
+        if (block_alpha_mode)
+          {
+            if (pixel_bits==0)
+              col = cl;
+            else if (pixel_bits==1)
+              color_interp(&col, &cl, &ch, 128);
+            else if (pixel_bits==2) {
+              color_interp(&col, &cl, &ch, 128);
+              col.alpha = 0;
+            } else col = ch;
+          }
+        else
+          {
+            if (pixel_bits==0)
+              col = cl;
+            else if (pixel_bits==1)
+              color_interp(&col, &cl, &ch, 96);
+            else if (pixel_bits==2) {
+              color_interp(&col, &cl, &ch, 160);
+            } else col = ch;
+          }
+        out[bx + by*out_stride] = col;
+      }
+}
+
+/* State shared by everything working on one decompression */
+typedef struct
+{
+  const guint32 *compressed_data;
+  Color         *uncompressed_data;
+  guint          out_stride;   /* in Colors */
+  gint           width;
+  gint           height;
+  guint          block_width;
+  guint          width_block;
+  guint          height_block;
+  guint          block_stride;
+  Color         *col_low;
+  Color         *col_high;
+  MortonLayout   layout;
+  PvrDecodeBlockFunc decode_block;
+} DecompressJob;
+
+/* unpack the block colours of rows y_start to y_end, straight from the
+ * morton-ordered data */
+static void
+decompress_block_colours (DecompressJob *job,
+                          guint          y_start,
+                          guint          y_end)
+{
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint32 my = morton_spread (y);
+      guint offs = (y+1)*job->block_stride;
+
+      for (x=0;x<job->width_block;x++)
+        {
+          guint32 pixel_col_word =
+            job->compressed_data[morton_block_offset (&job->layout,
+                                                      x, y, my) + 1];
+
+          job->col_high[offs+x+1] = pvr_color_to_color(pixel_col_word >> 16);
+          job->col_low[offs+x+1] = pvr_color_to_color(pixel_col_word & 0xFFFE);
+        }
+
+      pad_block_colour_row (&job->col_low[offs], job->width_block);
+      pad_block_colour_row (&job->col_high[offs], job->width_block);
+    }
+}
+
+static void
+decompress_blocks (DecompressJob *job,
+                   guint          y_start,
+                   guint          y_end)
+{
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint32 my = morton_spread (y);
+
+      for (x=0;x<job->width_block;x++)
+        {
+          const guint32 *block =
+            &job->compressed_data[morton_block_offset (&job->layout,
+                                                       x, y, my)];
+          gint offs = x + y*job->block_stride;
+
+          job->decode_block (block[0], block[1]&1,
+                             &job->col_low[offs], &job->col_high[offs],
+                             job->block_stride,
+                             &job->uncompressed_data[(x + y*job->out_stride) * 4],
+                             job->out_stride);
+        }
+    }
+}
+
+/* The modulation values of the PVRTC2 interpolated modes, out of 8 */
+static const guint pvrtc2_modulation_values[4] = { 0, 3, 5, 8 };
+
+/* Works out which mode a PVRTC2 block is in (0 for direct, 1 for
+ * interpolating horizontally and vertically, 2 for horizontally only
+ * and 3 for vertically only). Returns the modulation bits with the bits
+ * that were borrowed to say so put back the way the hardware sees them */
+static guint32
+pvrtc2_unpack_modulation (guint32  modulation,
+                          guint32  colour_word,
+                          guint   *mode)
+{
+  if (!(colour_word & 1))
+    {
+      *mode = 0;
+      return modulation;
+    }
+
+  if (modulation & 1)
+    {
+      /* the centre pixel says which, and only has one bit itself */
+      *mode = (modulation & (1 << 20)) ? 3 : 2;
+      if (modulation & (1 << 21))
+        modulation |= 1 << 20;
+      else
+        modulation &= ~(1 << 20);
+    }
+  else
+    *mode = 1;
+
+  if (modulation & 2)
+    modulation |= 1;
+  else
+    modulation &= ~1;
+
+  return modulation;
+}
+
+/* The modulation (out of 8) of pixel bx,by of a block, which must be one
+ * with its own value - every pixel in direct mode, or those where
+ * bx+by is even in the interpolated ones */
+static inline guint
+pvrtc2_stored_modulation (guint32 modulation,
+                          guint   mode,
+                          guint   bx,
+                          guint   by)
+{
+  if (mode == 0)
+    return ((modulation >> (bx + by*8)) & 1) ? 8 : 0;
+  return pvrtc2_modulation_values[(modulation >> ((bx + by*8) & ~1)) & 3];
+}
+
+/* The same for pixel x,y of the texture, wrapping round the edges */
+static guint
+pvrtc2_pixel_modulation (DecompressJob *job,
+                         gint           x,
+                         gint           y)
+{
+  const guint32 *block;
+  guint32 modulation;
+  guint mode;
+
+  x &= job->width-1;
+  y &= job->height-1;
+  block = &job->compressed_data[morton_block_offset (&job->layout,
+                                                     x >> 3, y >> 2,
+                                                     morton_spread (y >> 2))];
+  modulation = pvrtc2_unpack_modulation (block[0], block[1], &mode);
+
+  return pvrtc2_stored_modulation (modulation, mode, x&7, y&3);
+}
+
+static void
+decompress_blocks_pvrtc2 (DecompressJob *job,
+                          guint          y_start,
+                          guint          y_end)
+{
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    {
+      guint32 my = morton_spread (y);
+
+      for (x=0;x<job->width_block;x++)
+        {
+          const guint32 *block =
+            &job->compressed_data[morton_block_offset (&job->layout,
+                                                       x, y, my)];
+          const Color *low = &job->col_low[x + y*job->block_stride];
+          const Color *high = &job->col_high[x + y*job->block_stride];
+          Color *out = &job->uncompressed_data[x*8 + y*4*job->out_stride];
+          guint32 modulation;
+          guint mode;
+          gint bx,by;
+
+          modulation = pvrtc2_unpack_modulation (block[0], block[1], &mode);
+
+          for (by=0;by<4;by++)
+            for (bx=0;bx<8;bx++)
+              {
+                gint boffs = ((bx+4)>>3) + (((by+2)>>2) * job->block_stride);
+                gint px = x*8 + bx;
+                gint py = y*4 + by;
+                Color cl, ch, col;
+                guint amt;
+
+                interp_block_colours (&low[boffs], &high[boffs],
+                                      job->block_stride,
+                                      ((bx+4)&7) * 32, ((by+2)&3) * 64,
+                                      &cl, &ch);
+
+                /* the pixels without their own value are averaged from
+                 * their neighbours, which may be in other blocks */
+                if (mode == 0 || !((bx^by)&1))
+                  amt = pvrtc2_stored_modulation (modulation, mode, bx, by);
+                else if (mode == 1)
+                  amt = (pvrtc2_pixel_modulation (job, px, py-1) +
+                         pvrtc2_pixel_modulation (job, px, py+1) +
+                         pvrtc2_pixel_modulation (job, px-1, py) +
+                         pvrtc2_pixel_modulation (job, px+1, py) + 2) / 4;
+                else if (mode == 2)
+                  amt = (pvrtc2_pixel_modulation (job, px-1, py) +
+                         pvrtc2_pixel_modulation (job, px+1, py) + 1) / 2;
+                else
+                  amt = (pvrtc2_pixel_modulation (job, px, py-1) +
+                         pvrtc2_pixel_modulation (job, px, py+1) + 1) / 2;
+
+                if (amt == 8)
+                  col = ch;
+                else
+                  color_interp(&col, &cl, &ch, amt * 32);
+                out[bx + by*job->out_stride] = col;
+              }
+        }
+    }
+}
+
+static void
+decompress_rows (gpointer data,
+                 guint    pass,
+                 guint    y_start,
+                 guint    y_end)
+{
+  DecompressJob *job = data;
+
+  if (pass == 0)
+    decompress_block_colours (job, y_start, y_end);
+  else if (job->block_width == 8)
+    decompress_blocks_pvrtc2 (job, y_start, y_end);
+  else
+    decompress_blocks (job, y_start, y_end);
+}
+
+static void
+decompress_pass_done (gpointer data,
+                      guint    pass)
+{
+  DecompressJob *job = data;
+
+  if (pass == 0)
+    pad_block_colours (job->col_low, job->col_high,
+                       job->block_stride, job->height_block);
+}
+
+static const RowPasses decompress_passes = {
+  decompress_rows,
+  decompress_pass_done,
+  2
+};
+
+static void
+decompress_etc1_rows (gpointer data,
+                      guint    pass,
+                      guint    y_start,
+                      guint    y_end)
+{
+  DecompressJob *job = data;
+  const guchar *blocks = (const guchar*)job->compressed_data;
+  guint x,y;
+
+  for (y=y_start;y<y_end;y++)
+    for (x=0;x<job->width_block;x++)
+      _pvr_texture_etc1_decode_block (&blocks[(x + y*job->width_block) * 8],
+                                      &job->uncompressed_data
+                                        [x*4 + y*4*job->out_stride],
+                                      job->out_stride);
+}
+
+static const RowPasses decompress_etc1_passes = {
+  decompress_etc1_rows,
+  NULL,
+  1
+};
+
+/**
+ * pvr_texture_decompress_pvrtc4:
+ *
+ * Returns an RGBA8888 bitmap created from decompressing the given compressed
+ * data that was in PVRTC4 format...
+ *
+ * Since: 0.8.2-maemo
+ */
+guchar *pvr_texture_decompress_pvrtc4(
+                const guchar *compressed_data,
+                gint width,
+                gint height)
+{
+  PvrTextureOptions options;
+
+  pvr_texture_options_init (&options);
+
+  return pvr_texture_decompress_pvrtc4_full (compressed_data,
+                                             width, height,
+                                             &options);
+}
+
+/**
+ * pvr_texture_decompress_into:
+ *
+ * Decompresses @compressed_data, a @width x @height image in @format,
+ * into the RGBA8888 buffer at @dest whose rows are @rowstride bytes
+ * apart, rather than into a new buffer. @rowstride must be a multiple
+ * of 4. Returns FALSE if the size isn't one @format can have.
+ */
+gboolean
+pvr_texture_decompress_into (PvrFormat                format,
+                             const guchar            *compressed_data,
+                             gint                     width,
+                             gint                     height,
+                             const PvrTextureOptions *options,
+                             guchar                  *dest,
+                             guint                    rowstride)
+{
+  DecompressJob job;
+
+  g_return_val_if_fail(options!=0, FALSE);
+  g_return_val_if_fail(dest!=0, FALSE);
+  g_return_val_if_fail((rowstride&3)==0, FALSE);
+  memset (&job, 0, sizeof (job));
+  job.block_width = format == PVR_FORMAT_PVRTC2 ? 8 : 4;
+  /* must be a multiple of the block size + Power of 2 in each direction,
+   * though ETC1 doesn't mind about the power of 2 */
+  if ((width%job.block_width) || (height&3) || width<=0 || height<=0)
+    return FALSE;
+  if (format != PVR_FORMAT_ETC1 &&
+      (!is_power_2(width) || !is_power_2(height)))
+    return FALSE;
+  g_return_val_if_fail(rowstride>=(guint)width*4, FALSE);
+
+  job.compressed_data = (const guint32*)compressed_data;
+  job.uncompressed_data = (Color*)dest;
+  job.out_stride = rowstride / sizeof(Color);
+  job.width = width;
+  job.height = height;
+  job.width_block = width / job.block_width;
+  job.block_stride = job.width_block+2;
+  job.height_block = height / 4;
+  if (format == PVR_FORMAT_ETC1)
+    {
+      run_row_passes (&decompress_etc1_passes, &job, job.height_block,
+                      choose_n_threads (options->n_threads, job.height_block));
+      return TRUE;
+    }
+
+  job.decode_block = _pvr_texture_simd_get_decode_block (options->simd);
+  if (!job.decode_block)
+    job.decode_block = decode_block_c;
+  morton_layout_init (&job.layout, job.width_block, job.height_block);
+  /* but we make our block colour list one bigger all the way around
+   * and copy the colours so we don't need to do bounds checking */
+  job.col_low = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+  job.col_high = g_malloc(sizeof(Color)*job.block_stride*(job.height_block+2));
+
+  run_row_passes (&decompress_passes, &job, job.height_block,
+                  choose_n_threads (options->n_threads, job.height_block));
+
+  g_free(job.col_low);
+  g_free(job.col_high);
+  return TRUE;
+}
+
+/* Writes a pixel out in the given layout */
+static inline void
+store_pixel (const Color    *col,
+             PvrPixelFormat  format,
+             guchar         *dest)
+{
+  guint a;
+
+  switch (format)
+    {
+    case PVR_PIXEL_ARGB32_PREMUL:
+      a = col->alpha;
+      /* x*a/255, rounded, without dividing */
+#define PREMUL(x) ((((x)*a + 128) + (((x)*a + 128) >> 8)) >> 8)
+      *(guint32 *) dest = (a << 24) | (PREMUL (col->red) << 16) |
+                          (PREMUL (col->green) << 8) | PREMUL (col->blue);
+#undef PREMUL
+      break;
+    case PVR_PIXEL_RGB565:
+      *(guint16 *) dest = ((col->red >> 3) << 11) |
+                          ((col->green >> 2) << 5) |
+                          (col->blue >> 3);
+      break;
+    default:
+      memcpy (dest, col, sizeof (Color));
+      break;
+    }
+}
+
+/**
+ * pvr_texture_decompress_pvrtc4_rect:
+ *
+ * Decompresses just the @rect_width x @rect_height rectangle at @x, @y of
+ * the @width x @height PVRTC4 image in @compressed_data, writing it in
+ * @dest_format to @dest, whose rows are @rowstride bytes apart. Pixel
+ * @x, @y goes at @dest itself, so this can write straight into part of a
+ * GdkPixbuf or cairo image surface. Only the blocks the rectangle
+ * touches are decoded. @dest must be aligned for the pixel layout, as
+ * pixbufs and surfaces are. Of @options, only @options->simd matters;
+ * it runs on the calling thread. Returns FALSE if the size isn't one
+ * PVRTC4 can have, or the rectangle isn't inside the image.
+ */
+gboolean
+pvr_texture_decompress_pvrtc4_rect (const guchar            *compressed_data,
+                                    gint                     width,
+                                    gint                     height,
+                                    const PvrTextureOptions *options,
+                                    gint                     x,
+                                    gint                     y,
+                                    gint                     rect_width,
+                                    gint                     rect_height,
+                                    PvrPixelFormat           dest_format,
+                                    guchar                  *dest,
+                                    guint                    rowstride)
+{
+  const guint32 *data = (const guint32 *) compressed_data;
+  MortonLayout layout;
+  PvrDecodeBlockFunc decode_block;
+  guint pixel_size = dest_format == PVR_PIXEL_RGB565 ? 2 : 4;
+  gint width_block, height_block, bx0, bx1, by0, by1, stride, rows;
+  gint bx, by, i, j;
+  Color *col_low, *col_high;
+
+  g_return_val_if_fail(compressed_data!=0, FALSE);
+  g_return_val_if_fail(options!=0, FALSE);
+  g_return_val_if_fail(dest!=0, FALSE);
+  if ((width&3) || (height&3) || width<=0 || height<=0 ||
+      !is_power_2(width) || !is_power_2(height))
+    return FALSE;
+  if (x<0 || y<0 || rect_width<=0 || rect_height<=0 ||
+      x+rect_width>width || y+rect_height>height)
+    return FALSE;
+  g_return_val_if_fail(rowstride>=(guint)rect_width*pixel_size, FALSE);
+
+  decode_block = _pvr_texture_simd_get_decode_block (options->simd);
+  if (!decode_block)
+    decode_block = decode_block_c;
+  width_block = width / 4;
+  height_block = height / 4;
+  morton_layout_init (&layout, width_block, height_block);
+
+  /* the blocks the rectangle touches */
+  bx0 = x / 4;
+  by0 = y / 4;
+  bx1 = (x + rect_width + 3) / 4;
+  by1 = (y + rect_height + 3) / 4;
+
+  /* and the colours of one more block all round, which blend into
+   * them. Past the edges the colours repeat, as decompress_blocks has
+   * them */
+  stride = bx1 - bx0 + 2;
+  rows = by1 - by0 + 2;
+  col_low = g_new (Color, stride * rows);
+  col_high = g_new (Color, stride * rows);
+  for (j=0;j<rows;j++)
+    {
+      gint cy = CLAMP (by0 - 1 + j, 0, height_block - 1);
+      guint32 my = morton_spread (cy);
+
+      for (i=0;i<stride;i++)
+        {
+          gint cx = CLAMP (bx0 - 1 + i, 0, width_block - 1);
+          guint32 word = data[morton_block_offset (&layout, cx, cy, my) + 1];
+
+          col_high[i + j*stride] = pvr_color_to_color (word >> 16);
+          col_low[i + j*stride] = pvr_color_to_color (word & 0xFFFE);
+        }
+    }
+
+  for (by=by0;by<by1;by++)
+    {
+      guint32 my = morton_spread (by);
+      gint py0 = MAX (y, by*4), py1 = MIN (y + rect_height, by*4 + 4);
+
+      for (bx=bx0;bx<bx1;bx++)
+        {
+          const guint32 *block =
+            &data[morton_block_offset (&layout, bx, by, my)];
+          gint offs = (bx - bx0) + (by - by0)*stride;
+          gint px0 = MAX (x, bx*4), px1 = MIN (x + rect_width, bx*4 + 4);
+          Color pixels[16];
+          gint px, py;
+
+          decode_block (block[0], block[1]&1,
+                        &col_low[offs], &col_high[offs], stride,
+                        pixels, 4);
+
+          for (py=py0;py<py1;py++)
+            {
+              guchar *out = dest + (py - y)*rowstride +
+                            (px0 - x)*pixel_size;
+
+              for (px=px0;px<px1;px++, out+=pixel_size)
+                store_pixel (&pixels[(px - bx*4) + (py - by*4)*4],
+                             dest_format, out);
+            }
+        }
+    }
+
+  g_free (col_low);
+  g_free (col_high);
+  return TRUE;
+}
+
+/**
+ * pvr_texture_level_size:
+ *
+ * Works out how many bytes a @width x @height image takes in @format, the
+ * way other PVR readers do: PVRTC images are always at least 2x2 blocks,
+ * and ETC1 images are rounded up to whole blocks. The size of the image
+ * that is actually stored is put in @data_width and @data_height, if
+ * they aren't %NULL.
+ */
+gsize
+pvr_texture_level_size (PvrFormat  format,
+                        gint       width,
+                        gint       height,
+                        gint      *data_width,
+                        gint      *data_height)
+{
+  gint w, h;
+
+  switch (format)
+    {
+    case PVR_FORMAT_PVRTC2:
+      w = MAX (width, 16);
+      h = MAX (height, 8);
+      break;
+    case PVR_FORMAT_ETC1:
+      w = (width + 3) & ~3;
+      h = (height + 3) & ~3;
+      break;
+    default:
+      w = MAX (width, 8);
+      h = MAX (height, 8);
+      break;
+    }
+
+  if (data_width)
+    *data_width = w;
+  if (data_height)
+    *data_height = h;
+
+  return format == PVR_FORMAT_PVRTC2 ? (gsize) w * h / 4 : (gsize) w * h / 2;
+}
+
+static guchar *
+decompress_full (PvrFormat                format,
+                 const guchar            *compressed_data,
+                 gint                     width,
+                 gint                     height,
+                 const PvrTextureOptions *options)
+{
+  guchar *uncompressed_data;
+
+  g_return_val_if_fail(options!=0, 0);
+  if (width<=0 || height<=0)
+    return 0;
+
+  uncompressed_data = g_malloc(sizeof(Color)*width*height);
+  if (!pvr_texture_decompress_into (format, compressed_data, width, height,
+                                    options, uncompressed_data,
+                                    width*sizeof(Color)))
+    {
+      g_free (uncompressed_data);
+      return 0;
+    }
+
+  return uncompressed_data;
+}
+
+/**
+ * pvr_texture_measure_psnr:
+ *
+ * Decompresses @compressed_data, a @width x @height image in @format, and
+ * compares it with the RGBA8888 @uncompressed_data it was made from. If
+ * @channel_psnr isn't %NULL, the PSNR of red, green, blue and alpha on
+ * their own are put in it.
+ *
+ * Returns: the PSNR over all 4 channels in dB, or PVR_PSNR_MAX if
+ * nothing changed
+ */
+gdouble
+pvr_texture_measure_psnr (PvrFormat     format,
+                          const guchar *uncompressed_data,
+                          const guchar *compressed_data,
+                          gint          width,
+                          gint          height,
+                          gdouble      *channel_psnr)
+{
+  PvrTextureOptions options;
+  guchar *decoded;
+  guint64 sums[4] = { 0, 0, 0, 0 };
+  gdouble n_pixels = (gdouble) width * height;
+  gsize i;
+  guint c;
+
+  g_return_val_if_fail (uncompressed_data != NULL, 0);
+  g_return_val_if_fail (compressed_data != NULL, 0);
+
+  pvr_texture_options_init (&options);
+  decoded = decompress_full (format, compressed_data, width, height,
+                             &options);
+  if (!decoded)
+    return 0;
+
+  for (i=0;i<(gsize) width*height*4;i++)
+    {
+      gint d = (gint) uncompressed_data[i] - (gint) decoded[i];
+
+      sums[i & 3] += d*d;
+    }
+  g_free (decoded);
+
+  if (channel_psnr)
+    for (c=0;c<4;c++)
+      channel_psnr[c] = sums[c] ?
+        MIN (PVR_PSNR_MAX, 10 * log10 (255.0*255.0*n_pixels / sums[c])) :
+        PVR_PSNR_MAX;
+
+  for (c=1;c<4;c++)
+    sums[0] += sums[c];
+  if (!sums[0])
+    return PVR_PSNR_MAX;
+  return MIN (PVR_PSNR_MAX, 10 * log10 (255.0*255.0*n_pixels*4 / sums[0]));
+}
+
+/**
+ * pvr_texture_decompress_pvrtc4_full:
+ *
+ * Like pvr_texture_decompress_pvrtc4, but splitting the rows of blocks
+ * over @options->n_threads threads (or one per CPU if it is 0) and using
+ * the vector kernels picked by @options->simd. The blocks are read
+ * straight from their morton order.
+ */
+guchar *
+pvr_texture_decompress_pvrtc4_full (const guchar            *compressed_data,
+                                    gint                     width,
+                                    gint                     height,
+                                    const PvrTextureOptions *options)
+{
+  return decompress_full (PVR_FORMAT_PVRTC4, compressed_data,
+                          width, height, options);
+}
+
+/**
+ * pvr_texture_decompress_pvrtc2:
+ *
+ * Returns an RGBA8888 bitmap created from decompressing the given
+ * compressed data that was in PVRTC2 format. All the PVRTC2 block modes
+ * are understood, not just the one pvr_texture_compress_pvrtc2 writes.
+ */
+guchar *
+pvr_texture_decompress_pvrtc2 (const guchar *compressed_data,
+                               gint          width,
+                               gint          height)
+{
+  PvrTextureOptions options;
+
+  pvr_texture_options_init (&options);
+
+  return pvr_texture_decompress_pvrtc2_full (compressed_data,
+                                             width, height,
+                                             &options);
+}
+
+/**
+ * pvr_texture_decompress_pvrtc2_full:
+ *
+ * Like pvr_texture_decompress_pvrtc2, but splitting the rows of blocks
+ * over @options->n_threads threads (or one per CPU if it is 0).
+ */
+guchar *
+pvr_texture_decompress_pvrtc2_full (const guchar            *compressed_data,
+                                    gint                     width,
+                                    gint                     height,
+                                    const PvrTextureOptions *options)
+{
+  return decompress_full (PVR_FORMAT_PVRTC2, compressed_data,
+                          width, height, options);
+}
+
+/**
+ * pvr_texture_decompress_etc1:
+ *
+ * Returns an RGBA8888 bitmap created from decompressing the given
+ * compressed data that was in ETC1 format. Alpha is always 255.
+ */
+guchar *
+pvr_texture_decompress_etc1 (const guchar *compressed_data,
+                             gint          width,
+                             gint          height)
+{
+  PvrTextureOptions options;
+
+  pvr_texture_options_init (&options);
+
+  return pvr_texture_decompress_etc1_full (compressed_data,
+                                           width, height,
+                                           &options);
+}
+
+/**
+ * pvr_texture_decompress_etc1_full:
+ *
+ * Like pvr_texture_decompress_etc1, but splitting the rows of blocks
+ * over @options->n_threads threads (or one per CPU if it is 0).
+ */
+guchar *
+pvr_texture_decompress_etc1_full (const guchar            *compressed_data,
+                                  gint                     width,
+                                  gint                     height,
+                                  const PvrTextureOptions *options)
+{
+  return decompress_full (PVR_FORMAT_ETC1, compressed_data,
+                          width, height, options);
+}
+
+/* Works out what size a width x height image is padded to. PVRTC
+ * textures are never smaller than 2x2 blocks, or readers will expect more
+ * data than we write, and must be a power of 2, so the image is padded by
+ * repeating its edges and then wrapping round; TRUE is returned for that.
+ * ETC1 only needs whole blocks, unless it has mipmaps, so the edges can
+ * just be repeated */
+static gboolean
+padded_size (PvrFormat  format,
+             gint       width,
+             gint       height,
+             gboolean   mipmaps,
+             gint      *padded_width,
+             gint      *padded_height)
+{
+  if (format == PVR_FORMAT_ETC1 && !mipmaps)
+    {
+      *padded_width = (width + 3) & ~3;
+      *padded_height = (height + 3) & ~3;
+      return FALSE;
+    }
+
+  pvr_texture_level_size (format, 1, 1, padded_width, padded_height);
+  while (*padded_width < width)
+    *padded_width *= 2;
+  while (*padded_height < height)
+    *padded_height *= 2;
+
+  return TRUE;
+}
+
+/* Halves the size of a level for the next mipmap, as far as the format
+ * allows. Returns FALSE if it is already as small as it can be */
+static gboolean
+next_mipmap_size (PvrFormat  format,
+                  gint      *width,
+                  gint      *height)
+{
+  gint min_width, min_height;
+
+  pvr_texture_level_size (format, 1, 1, &min_width, &min_height);
+  if (*width == min_width && *height == min_height)
+    return FALSE;
+
+  *width = MAX (min_width, *width / 2);
+  *height = MAX (min_height, *height / 2);
+  return TRUE;
+}
+
+/* Sides (in blocks) of the tiles the streaming encoder writes. An aligned
+ * square of blocks is contiguous in morton order, so each tile can go to
+ * the file in one write */
+#define STREAM_TILE_SIDE 8
+
+/* Most mipmap levels we can have, for a 2^31 texture */
+#define STREAM_MAX_LEVELS 32
+
+/* One mipmap level being compressed by the streaming encoder */
+typedef struct {
+  CompressJob   job;
+  /* size of the level, always a power of 2 */
+  gint          width;
+  gint          height;
+  /* where the level's data starts in the file */
+  off_t         offset;
+  /* rows of blocks assembled at once */
+  guint         band_rows;
+  /* rows of pixels received so far */
+  guint         rows_in;
+  /* the rows of pixels for band_rows+1 rows of blocks. Only allocated
+   * for level 0 if its rows are copied in a few at a time */
+  guchar       *pixels;
+  /* sums of the rows of the level above being box filtered into the
+   * next row of this one, and how many rows have gone in so far */
+  guint16      *sums;
+  guint         n_summed;
+} StreamLevel;
+
+struct _PvrStreamEncoder
+{
+  gchar        *filename;
+  PendingFile  *file;
+  /* the writer to hand the file to, and its size */
+  PvrTextureWriter *writer;
+  gsize         size;
+  /* size of the source */
+  gint          width;
+  gint          height;
+  guint         n_channels;
+  guint         n_threads;
+  PvrFormat     format;
+  /* whether the padding wraps round to the other side, so the texture
+   * tiles, or just repeats the edge */
+  gboolean      pad_wrap;
+  /* padded copies of the first and last rows, to pad the bottom with */
+  guchar       *first_row;
+  guchar       *last_row;
+  /* set if every row came at once, and level 0 was read in place */
+  gboolean      direct;
+  /* who to tell how far we've got, in blocks over all the levels */
+  PvrProgressFunc progress;
+  gpointer      progress_data;
+  gsize         blocks_done;
+  gsize         blocks_total;
+  /* level 0 is the padded source */
+  StreamLevel   levels[STREAM_MAX_LEVELS];
+  guint         n_levels;
+};
+
+/* pwrite all of data, carrying on after short writes */
+static gboolean
+write_all_at (gint          fd,
+              const guchar *data,
+              gsize         size,
+              off_t         offset)
+{
+  while (size > 0)
+    {
+      ssize_t written = pwrite (fd, data, size, offset);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      data += written;
+      size -= written;
+      offset += written;
+    }
+
+  return TRUE;
+}
+
+static void
+stream_encoder_free (PvrStreamEncoder *encoder)
+{
+  guint i;
+
+  for (i = 0; i < encoder->n_levels; i++)
+    {
+      StreamLevel *level = &encoder->levels[i];
+
+      g_free (level->job.col_low);
+      g_free (level->job.col_high);
+      g_free (level->job.out_data);
+      g_free (level->pixels);
+      g_free (level->sums);
+    }
+  g_free (encoder->first_row);
+  g_free (encoder->last_row);
+  g_free (encoder->filename);
+  g_free (encoder);
+}
+
+/* Sets up a level of the given size, returning the size of its data */
+static gsize
+stream_level_init (StreamLevel             *level,
+                   PvrFormat                format,
+                   gint                     width,
+                   gint                     height,
+                   const PvrTextureOptions *options,
+                   guint                    n_threads)
+{
+  CompressJob *job = &level->job;
+
+  level->width = width;
+  level->height = height;
+
+  compress_job_init (job, format, width, height, options);
+  job->tile_side = MIN (STREAM_TILE_SIDE,
+                        MIN (job->width_block, job->height_block));
+
+  /* give each thread a decent number of rows per band */
+  level->band_rows = MAX (job->tile_side,
+                          MIN_BLOCK_ROWS_PER_THREAD * n_threads);
+  level->band_rows = MIN (level->band_rows, job->height_block);
+
+  job->col_low = g_malloc (sizeof(Color) * job->block_stride *
+                           (level->band_rows + 2));
+  job->col_high = g_malloc (sizeof(Color) * job->block_stride *
+                            (level->band_rows + 2));
+  job->out_data = g_malloc (sizeof(guint32) * 2 *
+                            job->width_block * level->band_rows);
+
+  return job->width_block * job->height_block * sizeof(guint32) * 2;
+}
+
+/* Makes the window that rows of pixels are copied into */
+static void
+stream_level_alloc_pixels (StreamLevel *level)
+{
+  level->pixels = g_malloc ((level->band_rows + 1) * 4 * level->width * 4);
+  level->job.uncompressed_data = level->pixels;
+}
+
+/* Copy a row of the source into dst, padding the right-hand edge with
+ * the last colour value, then the first. Poor-man's tiling */
+static void
+stream_pad_row (PvrStreamEncoder *encoder,
+                guchar           *dst,
+                const guchar     *src)
+{
+  gint width = encoder->width;
+  gint mid = encoder->pad_wrap ? (encoder->levels[0].width + width) / 2 :
+                                 encoder->levels[0].width;
+  gint x;
+
+  if (encoder->n_channels == 4)
+    memcpy (dst, src, width * 4);
+  else
+    for (x = 0; x < width; x++)
+      {
+        dst[x*4+0] = src[x*3+0];
+        dst[x*4+1] = src[x*3+1];
+        dst[x*4+2] = src[x*3+2];
+        dst[x*4+3] = 255;
+      }
+
+  for (x = width; x < mid; x++)
+    memcpy (&dst[x*4], &dst[(width-1)*4], 4);
+  for (x = mid; x < encoder->levels[0].width; x++)
+    memcpy (&dst[x*4], dst, 4);
+}
+
+static void
+stream_assemble_rows (gpointer data,
+                      guint    pass,
+                      guint    y_start,
+                      guint    y_end)
+{
+  CompressJob *job = data;
+
+  compress_assemble_blocks (job, job->band_y0 + y_start, job->band_y0 + y_end);
+}
+
+static const RowPasses stream_passes = {
+  stream_assemble_rows,
+  NULL,
+  1
+};
+
+/* Write out the tiles of the band just assembled, merging the ones which
+ * follow each other in the file */
+static gboolean
+stream_write_band (PvrStreamEncoder *encoder,
+                   StreamLevel      *level,
+                   guint             band_end)
+{
+  CompressJob *job = &level->job;
+  guint tile_side = job->tile_side;
+  guint tiles_across = job->width_block / tile_side;
+  gsize tile_size = tile_side * tile_side * sizeof(guint32) * 2;
+  const guchar *out = (const guchar *) job->out_data;
+  const guchar *run = NULL;
+  off_t run_offset = 0;
+  gsize run_size = 0;
+  guint tx, ty;
+
+  /* ETC1 rows are all together already */
+  if (job->format == PVR_FORMAT_ETC1)
+    return write_all_at (encoder->file->fd, out,
+                         (band_end - job->band_y0) * job->width_block *
+                           sizeof(guint32) * 2,
+                         level->offset + job->band_y0 * job->width_block *
+                           sizeof(guint32) * 2);
+
+  for (ty = job->band_y0; ty < band_end; ty += tile_side)
+    for (tx = 0; tx < tiles_across; tx++)
+      {
+        off_t offset = level->offset + sizeof(guint32) *
+          morton_block_offset (&job->layout, tx * tile_side, ty,
+                               morton_spread (ty));
+
+        if (run && offset == run_offset + (off_t) run_size &&
+            out == run + run_size)
+          {
+            run_size += tile_size;
+          }
+        else
+          {
+            if (run && !write_all_at (encoder->file->fd, run, run_size,
+                                      run_offset))
+              return FALSE;
+            run = out;
+            run_offset = offset;
+            run_size = tile_size;
+          }
+        out += tile_size;
+      }
+
+  return !run || write_all_at (encoder->file->fd, run, run_size, run_offset);
+}
+
+/* Compress and write the band of blocks starting at job->band_y0, now that
+ * all its pixels and the row of blocks below it have arrived */
+static gboolean
+stream_encode_band (PvrStreamEncoder  *encoder,
+                    StreamLevel       *level,
+                    GError           **error)
+{
+  CompressJob *job = &level->job;
+  guint height_block = job->height_block;
+  guint block_stride = job->block_stride;
+  guint band_y0 = job->band_y0;
+  guint band_end = MIN (band_y0 + level->band_rows, height_block);
+  guint colour_end = MIN (band_end + 1, height_block);
+
+  if (job->format == PVR_FORMAT_ETC1)
+    {
+      run_row_passes (&compress_etc1_passes, job, band_end - band_y0,
+                      choose_n_threads (encoder->n_threads,
+                                        band_end - band_y0));
+    }
+  else
+    {
+      /* block colours for this band and the row below it. The first row
+       * of the band was done as the row below the previous one */
+      compress_block_colours (job, band_y0 ? band_y0 + 1 : 0, colour_end);
+
+      /* copy top and bottom of our block colours so we get repeats */
+      if (band_y0 == 0)
+        {
+          memcpy (&job->col_low[0], &job->col_low[block_stride],
+                  sizeof(Color) * block_stride);
+          memcpy (&job->col_high[0], &job->col_high[block_stride],
+                  sizeof(Color) * block_stride);
+        }
+      if (colour_end == height_block)
+        {
+          guint last = (height_block - band_y0) * block_stride;
+
+          memcpy (&job->col_low[last + block_stride], &job->col_low[last],
+                  sizeof(Color) * block_stride);
+          memcpy (&job->col_high[last + block_stride], &job->col_high[last],
+                  sizeof(Color) * block_stride);
+        }
+
+      run_row_passes (&stream_passes, job, band_end - band_y0,
+                      choose_n_threads (encoder->n_threads,
+                                        band_end - band_y0));
+    }
+
+  if (!stream_write_band (encoder, level, band_end))
+    {
+      hd_pvr_texture_set_file_error (error, "Could not write to %s",
+                                     encoder->filename);
+      return FALSE;
+    }
+
+  if (band_end < height_block)
+    {
+      guint rows = band_end - band_y0;
+      gsize block_row_size = level->width * 4 * 4;
+
+      /* keep the colours of the last row of the band and the row below,
+       * and the pixels of the row below */
+      memmove (&job->col_low[0], &job->col_low[rows * block_stride],
+               sizeof(Color) * block_stride * 2);
+      memmove (&job->col_high[0], &job->col_high[rows * block_stride],
+               sizeof(Color) * block_stride * 2);
+      if (level->pixels)
+        memmove (level->pixels, &level->pixels[rows * block_row_size],
+                 block_row_size);
+    }
+
+  job->band_y0 = job->pixel_y0 = job->colour_y0 = band_end;
+
+  /* stopping doesn't set an error; it's up to whoever asked */
+  encoder->blocks_done += (band_end - band_y0) * job->width_block;
+  return !encoder->progress ||
+         encoder->progress ((gdouble) encoder->blocks_done /
+                            encoder->blocks_total, encoder->progress_data);
+}
+
+/* Where the next row of pixels for a level should be put */
+static inline guchar *
+stream_row_slot (StreamLevel *level)
+{
+  return &level->pixels[(level->rows_in - level->job.pixel_y0 * 4) *
+                        level->width * 4];
+}
+
+/* Adds a row of the level above to the box filter for this level. Levels
+ * which are already 4 pixels wide or high only shrink the other way.
+ * Returns TRUE when a whole row of this level has been made */
+static gboolean
+stream_level_downsample (StreamLevel  *level,
+                         const guchar *row,
+                         gint          row_width,
+                         gint          row_height)
+{
+  guint x_step = row_width / level->width;
+  guint y_step = row_height / level->height;
+  guint n_channels = level->width * 4;
+  guint i;
+
+  if (level->n_summed == 0)
+    memset (level->sums, 0, n_channels * sizeof(guint16));
+
+  if (x_step == 2)
+    for (i = 0; i < n_channels; i++)
+      level->sums[i] += row[(i & ~3)*2 + (i & 3)] + row[(i & ~3)*2 + 4 + (i & 3)];
+  else
+    for (i = 0; i < n_channels; i++)
+      level->sums[i] += row[i];
+
+  if (++level->n_summed < y_step)
+    return FALSE;
+
+  {
+    guint n = x_step * y_step;
+    guchar *dst = stream_row_slot (level);
+
+    for (i = 0; i < n_channels; i++)
+      dst[i] = (level->sums[i] + n / 2) / n;
+  }
+  level->n_summed = 0;
+
+  return TRUE;
+}
+
+/* Call once the next row of a level has been put in its slot. Passes it
+ * down to the smaller levels, then compresses a band if one is ready */
+static gboolean
+stream_row_done (PvrStreamEncoder  *encoder,
+                 guint              n_level,
+                 GError           **error)
+{
+  StreamLevel *level = &encoder->levels[n_level];
+
+  if (n_level + 1 < encoder->n_levels &&
+      stream_level_downsample (&encoder->levels[n_level + 1],
+                               stream_row_slot (level),
+                               level->width, level->height) &&
+      !stream_row_done (encoder, n_level + 1, error))
+    return FALSE;
+
+  level->rows_in++;
+
+  /* the last row can finish two bands, if the last one is short */
+  while (level->job.band_y0 < level->job.height_block &&
+         level->rows_in == MIN ((level->job.band_y0 + level->band_rows + 1) * 4,
+                                (guint) level->height))
+    if (!stream_encode_band (encoder, level, error))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Compresses all of level 0 straight from rows, which hold the whole
+ * image, padding it by addressing rather than by copying. Padded rows
+ * are only made, one at a time, to feed the mipmaps */
+static gboolean
+stream_encode_direct (PvrStreamEncoder  *encoder,
+                      const guchar      *rows,
+                      guint              rowstride,
+                      GError           **error)
+{
+  StreamLevel *level = &encoder->levels[0];
+  CompressJob *job = &level->job;
+  gboolean ret = TRUE;
+  guchar *row;
+  gint y;
+
+  job->src = rows;
+  job->src_rowstride = rowstride;
+  job->src_channels = encoder->n_channels;
+  job->src_width = encoder->width;
+  job->src_height = encoder->height;
+  job->pad_x = encoder->pad_wrap ? (level->width + encoder->width) / 2 :
+                                   level->width;
+  job->pad_y = encoder->pad_wrap ? (level->height + encoder->height) / 2 :
+                                   level->height;
+
+  while (job->band_y0 < job->height_block)
+    if (!stream_encode_band (encoder, level, error))
+      return FALSE;
+
+  if (encoder->n_levels == 1)
+    return TRUE;
+
+  row = g_malloc (level->width * 4);
+  for (y = 0; y < level->height && ret; y++)
+    {
+      stream_pad_row (encoder, row,
+                      rows + rowstride * compress_pad_coord (y, encoder->height,
+                                                             job->pad_y));
+      if (stream_level_downsample (&encoder->levels[1], row,
+                                   level->width, level->height))
+        ret = stream_row_done (encoder, 1, error);
+    }
+  g_free (row);
+
+  return ret;
+}
+
+/**
+ * pvr_texture_stream_encoder_new:
+ *
+ * Starts compressing a @width x @height image to @format in @filename. The
+ * image is padded to a power of 2 in each direction the same way
+ * hd_pvr_texture_save always has, except for ETC1 without mipmaps which
+ * is only padded to whole blocks by repeating the edges. Rows of the image are then given with
+ * pvr_texture_stream_encoder_write_rows, in as many pieces as is
+ * convenient, and are compressed and written to disk a band at a time so
+ * only a few rows of pixels and block colours are ever held in memory.
+ * The file is written to a temporary and only replaces @filename when
+ * pvr_texture_stream_encoder_finish succeeds.
+ *
+ * If options->mipmaps is set, each row is also box filtered down into
+ * every mipmap level as it arrives, and the levels are compressed
+ * alongside the full size image, so the whole chain is made in one pass.
+ * The chain stops at the smallest texture the format allows: 8x8 for
+ * PVRTC4, 16x8 for PVRTC2 and 4x4 for ETC1.
+ *
+ * If options->progress is set, it is called after each band of blocks
+ * with the fraction of the whole chain done so far. If it returns FALSE
+ * the encoder stops, and pvr_texture_stream_encoder_write_rows or
+ * pvr_texture_stream_encoder_finish returns FALSE without setting an
+ * error.
+ *
+ * @n_channels is 4 for RGBA8888 or 3 for RGB888 data.
+ *
+ * Returns: the encoder, or %NULL if the file could not be created
+ */
+PvrStreamEncoder *
+pvr_texture_stream_encoder_new (const gchar              *filename,
+                                PvrFormat                 format,
+                                gint                      width,
+                                gint                      height,
+                                guint                     n_channels,
+                                const PvrTextureOptions  *options,
+                                GError                  **error)
 {
-  Color result;
-  /* If top bit is 1, this is full alpha */
-  if (col & 0x8000)
+  PvrStreamEncoder *encoder;
+  PVR_TEXTURE_HEADER head;
+  gint level_width, level_height;
+  gsize data_size;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+  g_return_val_if_fail (width > 0 && height > 0, NULL);
+  g_return_val_if_fail (n_channels == 3 || n_channels == 4, NULL);
+  g_return_val_if_fail (options != NULL, NULL);
+
+  encoder = g_new0 (PvrStreamEncoder, 1);
+  encoder->filename = g_strdup (filename);
+  encoder->writer = options->writer;
+  encoder->width = width;
+  encoder->height = height;
+  encoder->n_channels = n_channels;
+  encoder->format = format;
+  encoder->progress = options->progress;
+  encoder->progress_data = options->progress_data;
+
+  encoder->n_threads = options->n_threads ? options->n_threads :
+                                            pvr_texture_get_n_threads ();
+  if (options->dither == PVR_DITHER_PIXEL && format != PVR_FORMAT_ETC1 &&
+      options->quality != PVR_QUALITY_FAST)
+    encoder->n_threads = 1;
+
+  encoder->pad_wrap = padded_size (format, width, height, options->mipmaps,
+                                   &level_width, &level_height);
+
+  encoder->first_row = g_malloc (level_width * 4);
+  encoder->last_row = g_malloc (level_width * 4);
+
+  /* then halve it down to the smallest size if we want mipmaps. Level 0
+   * only gets a window of pixels if its rows come a few at a time */
+  data_size = 0;
+  while (TRUE)
     {
-      result.alpha = 255;
-      result.red = (col>>7) & 0xF8;
-      result.green = (col>>2) & 0xF8;
-      result.blue = (col<<3) & 0xF8;
+      StreamLevel *level = &encoder->levels[encoder->n_levels++];
+
+      level->offset = sizeof(PVR_TEXTURE_HEADER) + data_size;
+      data_size += stream_level_init (level, format,
+                                      level_width, level_height,
+                                      options, encoder->n_threads);
+      encoder->blocks_total += level->job.width_block *
+                               level->job.height_block;
+      if (encoder->n_levels > 1)
+        {
+          stream_level_alloc_pixels (level);
+          level->sums = g_malloc (level_width * 4 * sizeof(guint16));
+        }
+
+      if (!options->mipmaps ||
+          !next_mipmap_size (format, &level_width, &level_height))
+        break;
     }
-  else
+
+  encoder->size = sizeof(PVR_TEXTURE_HEADER) + data_size;
+  encoder->file = pending_file_new (filename, error);
+  if (!encoder->file)
     {
-      result.alpha = (col>>7) & 0xE0;
-      result.red = (col>>4) & 0xF0;
-      result.green = col & 0xF0;
-      result.blue = col<<4;
+      stream_encoder_free (encoder);
+      return NULL;
     }
-  return result;
-}
 
-static inline gboolean
-is_power_2(int a)
-{
-  return !(a & (a - 1)) && a;
+  pvr_header_init (&head, format, encoder->levels[0].width,
+                   encoder->levels[0].height, encoder->n_levels - 1,
+                   data_size);
+  if (!write_all_at (encoder->file->fd, (const guchar *) &head,
+                     sizeof(head), 0))
+    {
+      hd_pvr_texture_set_file_error (error, "Could not write header to %s",
+                                     filename);
+      pvr_texture_stream_encoder_abort (encoder);
+      return NULL;
+    }
+
+  return encoder;
 }
 
-static inline guint32
-log_2(guint v)
+/**
+ * pvr_texture_stream_encoder_write_rows:
+ *
+ * Gives the encoder the next @n_rows rows of the image, which are
+ * @rowstride bytes apart. Whenever enough rows have arrived a band of
+ * blocks is compressed and written. If all the rows come in one go,
+ * they are compressed where they are, without being copied.
+ *
+ * Returns: %FALSE if writing failed, or the progress function asked to
+ * stop. The encoder should then be abandoned with
+ * pvr_texture_stream_encoder_abort.
+ */
+gboolean
+pvr_texture_stream_encoder_write_rows (PvrStreamEncoder  *encoder,
+                                       const guchar      *rows,
+                                       guint              rowstride,
+                                       guint              n_rows,
+                                       GError           **error)
 {
-  guint32 r; // result of log2(v) will go here
-  guint32 shift;
+  StreamLevel *level;
+  guint i;
 
-  r =     (v > 0xFFFF) << 4; v >>= r;
-  shift = (v > 0xFF  ) << 3; v >>= shift; r |= shift;
-  shift = (v > 0xF   ) << 2; v >>= shift; r |= shift;
-  shift = (v > 0x3   ) << 1; v >>= shift; r |= shift;
-                                          r |= (v >> 1);
-  return r;
-}
+  g_return_val_if_fail (encoder != NULL, FALSE);
 
+  level = &encoder->levels[0];
+  g_return_val_if_fail (level->rows_in + n_rows <= (guint) encoder->height,
+                        FALSE);
 
-/* calculate the masks needed to access the morton-ordered image.
- * Values must be a power of 2 */
-static void _calculate_access_masks( gint width, gint height,
-      guint32 *morton_mask,
-      guint32 *xshift, guint32 *xmask,
-      guint32 *yshift, guint32 *ymask)
-{
-  *xshift = 0;
-  *yshift = 0;
-  *xmask = 0;
-  *ymask = 0;
-  *morton_mask = 0xFFFFFFFF;
-  if (width == height)
+  /* given the whole image at once, there's no need to copy any of it */
+  if (level->rows_in == 0 && n_rows == (guint) encoder->height)
     {
-      return;
+      encoder->direct = TRUE;
+      level->rows_in = n_rows;
+      return stream_encode_direct (encoder, rows, rowstride, error);
     }
-  if (width > height)
+
+  if (!level->pixels)
+    stream_level_alloc_pixels (level);
+
+  for (i = 0; i < n_rows; i++)
     {
-      *morton_mask = (height*height)-1;
-      *xshift = log_2(height);
-      *xmask = 0xFFFFFFFF & ~*morton_mask;
-    }
-  else
-    { // width < height
-      *morton_mask = (width*width)-1;
-      *yshift = log_2(width);
-      *ymask = 0xFFFFFFFF & ~*morton_mask;
+      guchar *slot = stream_row_slot (level);
+
+      stream_pad_row (encoder, slot, &rows[i * rowstride]);
+      if (level->rows_in == 0)
+        memcpy (encoder->first_row, slot, level->width * 4);
+      if (level->rows_in == (guint) encoder->height - 1)
+        memcpy (encoder->last_row, slot, level->width * 4);
+
+      if (!stream_row_done (encoder, 0, error))
+        return FALSE;
     }
+
+  return TRUE;
 }
 
 /**
- * pvr_texture_compress_pvrtc4:
+ * pvr_texture_stream_encoder_finish:
  *
- * Takes an RGBA8888 bitmap and returns the data (and size) created
- * after it has been compressed in the PVRTC4 format.
+ * Once every row of the image has been written, pads the bottom of it by
+ * copying the last line and then the first, compresses what is left,
+ * and hands the file to the options' writer; without one it is synced
+ * and moved into place. @encoder is freed whether this succeeds or not.
  *
- * Since: 0.8.2-maemo
+ * Returns: %TRUE if the texture was saved
  */
-guchar *pvr_texture_compress_pvrtc4(
-                const guchar *uncompressed_data,
-                gint width,
-                gint height,
-                guint *compressed_size)
+gboolean
+pvr_texture_stream_encoder_finish (PvrStreamEncoder  *encoder,
+                                   GError           **error)
 {
-  guchar *compressed_data = 0;
-  guint width_block, height_block, block_stride;
-  Color *col_low, *col_high;
-#if DITHER_BLOCK
-  gint error_low[4] = {0,0,0,0};
-  gint error_high[4] = {0,0,0,0};
-#endif
-#if DITHER_PIXEL
-  gint error_pixel[4] = {0,0,0,0};
-#endif
-  gint x,y;
-  guint32 *out_data;
-  guint32 morton_mask, xshift, xmask, yshift, ymask;
+  StreamLevel *level;
+  PendingFile *file;
+  gboolean ret;
+  guint mid;
+  guint y;
 
-  g_return_val_if_fail(compressed_size!=0, 0);
-  /* must be a multiple of 4 + Power of 2 in each direction */
-  if ((width&3) || (height&3) ||
-      !is_power_2(width) ||
-      !is_power_2(height))
-    return 0;
+  g_return_val_if_fail (encoder != NULL, FALSE);
 
-  width_block = width / 4;
-  block_stride = width_block+2;
-  height_block = height / 4;
-  _calculate_access_masks(width_block, height_block,
-      &morton_mask, &xshift, &xmask, &yshift, &ymask);
-  /* 4 bits per pixel, or 64 bits per block*/
-  *compressed_size = width_block*height_block*sizeof(guint32)*2;
-  compressed_data = g_malloc(*compressed_size);
-  /* but we make our block colour list one bigger all the way around
-   * and copy the colours so we don't need to do bounds checking */
-  col_low = g_malloc(sizeof(Color)*block_stride*(height_block+2));
-  col_high = g_malloc(sizeof(Color)*block_stride*(height_block+2));
+  level = &encoder->levels[0];
+  if (level->rows_in != (guint) encoder->height)
+    {
+      g_warning ("%s: only %u of %d rows were written",
+                 G_STRFUNC, level->rows_in, encoder->height);
+      pvr_texture_stream_encoder_abort (encoder);
+      return FALSE;
+    }
 
-  /* work out maximum and minimum colour values for each block */
-  for (y=0;y<height_block;y++)
+  /* Now pad the last few lines by copying the last line
+   * over and over, then the first. If the rows were read in place
+   * that's been done already */
+  mid = encoder->pad_wrap ? (level->height + encoder->height) / 2 :
+                            (guint) level->height;
+  for (y = encoder->height; y < (guint) level->height && !encoder->direct; y++)
     {
-      guint block_offs = (y+1)*block_stride;
-      for (x=0;x<width_block;x++)
+      memcpy (stream_row_slot (level),
+              y < mid ? encoder->last_row : encoder->first_row,
+              level->width * 4);
+      if (!stream_row_done (encoder, 0, error))
         {
-          Color clow, chigh, clow_dither, chigh_dither;
-          Color *block;
-          Color *blockline;
-
-          /* We now don't include the very edges in what we use
-           * for our blocks, as this helps make the block values
-           * we get a little more 'rounded'
-           */
-          block = (Color*)&uncompressed_data[(x + y*width) * 16];
-          clow = block[1];
-          chigh = block[1];
-          SETMIN(clow, block[2]);
-          SETMAX(chigh, block[2]);
-          blockline = &block[width*1];
-          SETMIN(clow, blockline[0]);
-          SETMAX(chigh, blockline[0]);
-          SETMIN(clow, blockline[1]);
-          SETMAX(chigh, blockline[1]);
-          SETMIN(clow, blockline[2]);
-          SETMAX(chigh, blockline[2]);
-          SETMIN(clow, blockline[3]);
-          SETMAX(chigh, blockline[3]);
-          blockline = &block[width*2];
-          SETMIN(clow, blockline[0]);
-          SETMAX(chigh, blockline[0]);
-          SETMIN(clow, blockline[1]);
-          SETMAX(chigh, blockline[1]);
-          SETMIN(clow, blockline[2]);
-          SETMAX(chigh, blockline[2]);
-          SETMIN(clow, blockline[3]);
-          SETMAX(chigh, blockline[3]);
-          blockline = &block[width*3];
-          SETMIN(clow, blockline[1]);
-          SETMAX(chigh, blockline[1]);
-          SETMIN(clow, blockline[2]);
-          SETMAX(chigh, blockline[2]);
-          /* add our current error */
-#if DITHER_BLOCK
-          error_add(&clow_dither, error_low, &clow);
-          error_add(&chigh_dither, error_high, &chigh);
-#else
-          clow_dither = clow;
-          chigh_dither = chigh;
-#endif
-          /* crop to the nearest color */
-          nearest_pvr_color(&clow_dither, FALSE);
-          nearest_pvr_color(&chigh_dither, TRUE);
-          col_low[1+x+block_offs] = clow_dither;
-          col_high[1+x+block_offs] = chigh_dither;
-          /* update errors */
-#if DITHER_BLOCK
-          error_update(error_low, &clow, &clow_dither);
-          error_update(error_high, &chigh, &chigh_dither);
-#endif
+          pvr_texture_stream_encoder_abort (encoder);
+          return FALSE;
         }
-      /* copy beginning and end */
-      col_low[block_offs] = col_low[block_offs+1];
-      col_low[block_offs+width_block+1] = col_low[block_offs+width_block];
-      col_high[block_offs] = col_high[block_offs+1];
-      col_high[block_offs+width_block+1] = col_high[block_offs+width_block];
     }
-  /* copy top and bottom of our block so we get repeats */
-  memcpy((void*)&col_low[0],
-         (void*)&col_low[block_stride],
-                sizeof(Color)*block_stride);
-  memcpy((void*)&col_high[0],
-         (void*)&col_high[block_stride],
-                sizeof(Color)*block_stride);
-  memcpy((void*)&col_low[block_stride*(height_block+1)],
-         (void*)&col_low[block_stride*height_block],
-                sizeof(Color)*block_stride);
-  memcpy((void*)&col_high[block_stride*(height_block+1)],
-         (void*)&col_high[block_stride*height_block],
-                sizeof(Color)*block_stride);
 
-  /* now assemble each block */
-  out_data = (guint32*)compressed_data;
-  for (y=0;y<height_block;y++)
-    {
-      gint my; /* for morton numbers later */
-      my = (y | (y << 8)) & 0x00FF00FF;
-      my = (my | (my << 4)) & 0x0F0F0F0F;
-      my = (my | (my << 2)) & 0x33333333;
-      my = (my | (my << 1)) & 0x55555555;
-      for (x=0;x<width_block;x++)
-        {
-          Color *block;
-          gint offs = x + y*block_stride;
-          guint32 pixel_high_word = 0;
-          guint32 pixel_low_word = 0;
-          guint col_a, col_b;
-          gint bx,by;
-          gint mx, mz; /* for morton numbers later */
-
-          /* now work out what every pixel should be... */
-          block = (Color*)&uncompressed_data
-                        [(x + y*width) * 4 * sizeof(guint32)];
-          /* find_best interpolates our two sets of colours to where they should
-           * be (the blocks we get colour from swap halfway through the block
-           * hence the crazy offset stuff. It then figures out which one of the
-           * 4 values for the pixel works best */
-          for (by=3;by>=0;by--)
-            for (bx=3;bx>=0;bx--)
-              {
-                Color pixel_col = block[bx + by*width];
-#if DITHER_PIXEL
-                Color pixel_col_dither;
-#endif
-                gint boffs = offs + ((bx+2)>>2) + (((by+2)>>2) * block_stride);
-#if DITHER_PIXEL
-                error_add(&pixel_col_dither, error_pixel, &pixel_col);
-#endif
-                pixel_low_word = (pixel_low_word << 2) |
-                          find_best(
-#if DITHER_PIXEL
-                                  pixel_col_dither,
-#else
-                                  pixel_col,
-#endif
-                                  &col_low[boffs],
-                                  &col_high[boffs],
-                                  block_stride,
-                                  (bx+2)&3,
-                                  (by+2)&3);
-#if DITHER_PIXEL
-                error_update(error_pixel, &pixel_col, &pixel_col_dither);
-#endif
-              }
-           /* pack our two colours */
-           col_a = color_to_pvr_color(&col_low[offs+1+block_stride]);
-           col_b = color_to_pvr_color(&col_high[offs+1+block_stride]);
-           /* and finally pack into a block */
-           /* last bit is the modulation mode, but we're cheating and
-            * just going for the easy 0, 3/8, 5/8, 1 one */
-           pixel_high_word = (col_b << 16) | (col_a & 0xFFFE);
-
-           /* PVR Stores images in a Morton arrangement to get some spatial
-            * locality
-            *
-            * Interleave lower 16 bits of x and y, so the bits of x
-            * are in the even positions and bits from y in the odd;
-            * z gets the resulting 32-bit Morton Number. */
-           mx = (x | (x << 8)) & 0x00FF00FF;
-           mx = (mx | (mx << 4)) & 0x0F0F0F0F;
-           mx = (mx | (mx << 2)) & 0x33333333;
-           mx = (mx | (mx << 1)) & 0x55555555;
-           mz = (my | (mx << 1)) & morton_mask;
-           mz |= (x << xshift) & xmask;
-           mz |= (y << yshift) & ymask;
-           mz = mz << 1;
-
-           /* write data out */
-           out_data[mz  ] = pixel_low_word;
-           out_data[mz+1] = pixel_high_word;
-      }
+  /* without a writer of our own, the texture is synced before it goes
+   * in place, as pvr_texture_save_pvrtc4_atomically does */
+  file = encoder->file;
+  encoder->file = NULL;
+  if (encoder->writer)
+    ret = writer_add (encoder->writer, file, encoder->size, error);
+  else
+    {
+      PvrTextureWriter *writer = pvr_texture_writer_new (PVR_SYNC_IMMEDIATE);
+
+      ret = writer_add (writer, file, encoder->size, error);
+      pvr_texture_writer_free (writer);
     }
 
-  g_free(col_low);
-  g_free(col_high);
-  return compressed_data;
+  stream_encoder_free (encoder);
+  return ret;
 }
 
 /**
- * pvr_texture_decompress_pvrtc4:
+ * pvr_texture_stream_encoder_abort:
  *
- * Returns an RGBA8888 bitmap created from decompressing the given compressed
- * data that was in PVRTC4 format...
+ * Gives up on the texture, removing the temporary file, and frees
+ * @encoder. The original file, if any, is left untouched.
+ */
+void
+pvr_texture_stream_encoder_abort (PvrStreamEncoder *encoder)
+{
+  g_return_if_fail (encoder != NULL);
+
+  if (encoder->file)
+    pending_file_discard (encoder->file);
+
+  stream_encoder_free (encoder);
+}
+
+/* Compresses one texture after another, keeping its worker threads and
+ * scratch buffers between them */
+struct _PvrTextureEncoder
+{
+  PvrTextureOptions options;
+  RowRunner         runner;
+  /* block colours, grown to fit the biggest level so far */
+  Color            *col_low;
+  Color            *col_high;
+  gsize             n_colours;
+  /* the mipmap being made, and the one above it it is made from */
+  guchar           *mipmaps[2];
+  gsize             mipmap_size;
+};
+
+/**
+ * pvr_texture_encoder_new:
  *
- * Since: 0.8.2-maemo
+ * Makes an encoder that compresses textures with the given @options,
+ * which is worth doing when there are a lot of them. Its threads and
+ * buffers are kept from one texture to the next, and only ever grow, so
+ * once it has seen the biggest texture it makes no more allocations.
+ * @options->progress is not used.
+ *
+ * Returns: the encoder, to be freed with pvr_texture_encoder_free
  */
-guchar *pvr_texture_decompress_pvrtc4(
-                const guchar *compressed_data,
-                gint width,
-                gint height)
+PvrTextureEncoder *
+pvr_texture_encoder_new (const PvrTextureOptions *options)
 {
-  Color *uncompressed_data = 0;
-  guint32 *compressed_datal = (guint32*)compressed_data;
-  guint32 *arranged_data = 0; /* data after it has been rearranged */
-  gint width_block, height_block, block_stride;
-  Color *col_low, *col_high;
-  gint x,y;
-  guint32 morton_mask, xshift, xmask, yshift, ymask;
-  /* must be a multiple of 4 + Power of 2 in each direction */
-  if ((width&3) || (height&3) ||
-      !is_power_2(width) ||
-      !is_power_2(height))
-    return 0;
+  PvrTextureEncoder *encoder;
+  guint n_threads;
 
-  width_block = width / 4;
-  block_stride = width_block+2;
-  height_block = height / 4;
-  _calculate_access_masks(width_block, height_block,
-      &morton_mask, &xshift, &xmask, &yshift, &ymask);
-  /* 4 bits per pixel, or 64 bits per block*/
-  uncompressed_data = g_malloc(sizeof(Color)*width*height);
-  arranged_data = (guint32*)g_malloc(sizeof(guint32)*2*width_block*height_block);
-  /* but we make our block colour list one bigger all the way around
-   * and copy the colours so we don't need to do bounds checking */
-  col_low = g_malloc(sizeof(Color)*block_stride*(height_block+2));
-  col_high = g_malloc(sizeof(Color)*block_stride*(height_block+2));
-
-  /* re-arrange data and  */
-  for (y=0;y<height_block;y++)
-    {
-      /* space out Y bits ready for Morton pattern */
-      gint my;
-      gint offs = y*block_stride + block_stride;
-      my = (y | (y << 8)) & 0x00FF00FF;
-      my = (my | (my << 4)) & 0x0F0F0F0F;
-      my = (my | (my << 2)) & 0x33333333;
-      my = (my | (my << 1)) & 0x55555555;
-
-      for (x=0;x<width_block;x++)
-        {
-          guint32 pixel_col_word = 0;
-          gint mx, mz; /* for morton numbers later */
-
-          /* PVR Stores images in Morton pattern to get some spatial
-          * locality
-          *
-          * Interleave lower 16 bits of x and y, so the bits of x
-          * are in the even positions and bits from y in the odd;
-          * z gets the resulting 32-bit Morton Number. */
-          mx = (x | (x << 8)) & 0x00FF00FF;
-          mx = (mx | (mx << 4)) & 0x0F0F0F0F;
-          mx = (mx | (mx << 2)) & 0x33333333;
-          mx = (mx | (mx << 1)) & 0x55555555;
-          mz = (my | (mx << 1)) & morton_mask;
-          mz |= (x << xshift) & xmask;
-          mz |= (y << yshift) & ymask;
-          mz = mz << 1;
-
-          arranged_data[(x+(y*width_block))*2  ] = compressed_datal[mz  ];
-          arranged_data[(x+(y*width_block))*2+1] = compressed_datal[mz+1];
-          pixel_col_word = compressed_datal[mz+1];
-
-          col_high[offs+x+1] = pvr_color_to_color(pixel_col_word >> 16);
-          col_low[offs+x+1] = pvr_color_to_color(pixel_col_word & 0xFFFE);
-        }
-
-        col_low[offs] = col_low[offs+1];
-        col_low[offs+block_stride+1] = col_low[offs+block_stride];
-        col_high[offs] = col_high[offs+1];
-        col_high[offs+block_stride+1] = col_high[offs+block_stride];
+  g_return_val_if_fail (options != NULL, NULL);
+
+  encoder = g_new0 (PvrTextureEncoder, 1);
+  encoder->options = *options;
+
+  /* if there are no threads, compress_run does without */
+  n_threads = options->n_threads ? options->n_threads :
+                                   pvr_texture_get_n_threads ();
+  if (n_threads > 1 && g_thread_supported ())
+    row_runner_start (&encoder->runner, n_threads);
+
+  return encoder;
+}
+
+/**
+ * pvr_texture_encoder_free:
+ *
+ * Stops the encoder's threads and frees it.
+ */
+void
+pvr_texture_encoder_free (PvrTextureEncoder *encoder)
+{
+  g_return_if_fail (encoder != NULL);
+
+  row_runner_stop (&encoder->runner);
+  g_free (encoder->col_low);
+  g_free (encoder->col_high);
+  g_free (encoder->mipmaps[0]);
+  g_free (encoder->mipmaps[1]);
+  g_free (encoder);
+}
+
+/**
+ * pvr_texture_encoder_get_size:
+ *
+ * Returns: how many bytes the PVR file for a @width x @height image in
+ * @format takes, header and all
+ */
+gsize
+pvr_texture_encoder_get_size (PvrTextureEncoder *encoder,
+                              PvrFormat          format,
+                              gint               width,
+                              gint               height)
+{
+  gint level_width, level_height;
+  gsize size = sizeof(PVR_TEXTURE_HEADER);
+
+  g_return_val_if_fail (encoder != NULL, 0);
+  g_return_val_if_fail (width > 0 && height > 0, 0);
+
+  padded_size (format, width, height, encoder->options.mipmaps,
+               &level_width, &level_height);
+  do
+    size += pvr_texture_level_size (format, level_width, level_height,
+                                    NULL, NULL);
+  while (encoder->options.mipmaps &&
+         next_mipmap_size (format, &level_width, &level_height));
+
+  return size;
+}
+
+/* Box filters src, whose rows are rowstride bytes apart, into the
+ * dst_width x dst_height RGBA8888 mipmap dst. src is the level above,
+ * width x height, but only src_width x src_height of it is there; the
+ * rest is padding as for compress_pad_coord. This gives the same result
+ * as the stream encoder's stream_level_downsample */
+static void
+encoder_downsample (const guchar *src,
+                    guint         rowstride,
+                    guint         n_channels,
+                    gint          src_width,
+                    gint          src_height,
+                    gint          pad_x,
+                    gint          pad_y,
+                    gint          width,
+                    gint          height,
+                    guchar       *dst,
+                    gint          dst_width,
+                    gint          dst_height)
+{
+  gint x_step = width / dst_width;
+  gint y_step = height / dst_height;
+  guint n = x_step * y_step;
+  gint x, y, i, j;
+  guint c;
+
+  for (y = 0; y < dst_height; y++)
+    for (x = 0; x < dst_width; x++)
+      {
+        guint sums[4] = { 0, 0, 0, 0 };
+
+        for (j = 0; j < y_step; j++)
+          {
+            const guchar *row = src + rowstride *
+              compress_pad_coord (y * y_step + j, src_height, pad_y);
+
+            for (i = 0; i < x_step; i++)
+              {
+                const guchar *pixel = row + n_channels *
+                  compress_pad_coord (x * x_step + i, src_width, pad_x);
+
+                sums[0] += pixel[0];
+                sums[1] += pixel[1];
+                sums[2] += pixel[2];
+                sums[3] += n_channels == 4 ? pixel[3] : 255;
+              }
+          }
+
+        for (c = 0; c < 4; c++)
+          *dst++ = (sums[c] + n / 2) / n;
       }
-    /* copy top and bottom of our block so we get repeats */
-    memcpy(&col_low[0], &col_low[block_stride],
-                sizeof(Color)*block_stride);
-    memcpy(&col_high[0], &col_high[block_stride],
-                sizeof(Color)*block_stride);
-    memcpy(&col_low[block_stride*(height_block+1)],
-           &col_low[block_stride*height_block],
-                sizeof(Color)*block_stride);
-    memcpy(&col_high[block_stride*(height_block+1)],
-           &col_high[block_stride*height_block],
-                sizeof(Color)*block_stride);
+}
+
+/**
+ * pvr_texture_encoder_compress:
+ *
+ * Compresses a @width x @height image to @format, writing the whole PVR
+ * file to @out, which must have room for the number of bytes
+ * pvr_texture_encoder_get_size gives and be 4 byte aligned. The image is
+ * @n_channels (3 or 4) bytes per pixel in rows @rowstride bytes apart. It
+ * is padded and given mipmaps the same way as by the stream encoder,
+ * and the result is the same as the file that would write, but for
+ * PVR_QUALITY_HIGH, which the stream encoder can't do and this does.
+ *
+ * Returns: %TRUE if the texture was compressed
+ */
+gboolean
+pvr_texture_encoder_compress (PvrTextureEncoder *encoder,
+                              PvrFormat          format,
+                              const guchar      *pixels,
+                              gint               width,
+                              gint               height,
+                              guint              rowstride,
+                              guint              n_channels,
+                              guchar            *out)
+{
+  const PvrTextureOptions *options;
+  PVR_TEXTURE_HEADER head;
+  gint top_width, top_height, level_width, level_height;
+  gboolean pad_wrap;
+  gsize offset = sizeof(head);
+  guint n_levels = 0;
+
+  g_return_val_if_fail (encoder != NULL, FALSE);
+  g_return_val_if_fail (pixels != NULL && out != NULL, FALSE);
+  g_return_val_if_fail (width > 0 && height > 0, FALSE);
+  g_return_val_if_fail (n_channels == 3 || n_channels == 4, FALSE);
+  g_return_val_if_fail (((gsize) out & 3) == 0, FALSE);
+
+  options = &encoder->options;
+  pad_wrap = padded_size (format, width, height, options->mipmaps,
+                          &top_width, &top_height);
+  level_width = top_width;
+  level_height = top_height;
+
+  while (TRUE)
+    {
+      CompressJob job;
+      gsize n_colours;
+
+      compress_job_init (&job, format, level_width, level_height, options);
 
-    for (y=0;y<height_block;y++)
-      for (x=0;x<width_block;x++)
+      n_colours = job.block_stride * (job.height_block + 2);
+      if (n_colours > encoder->n_colours)
         {
-          gint bx,by;
-          gint offs = x + y*block_stride;
-          guint32 pixel_bits_word = arranged_data[(x+(y*width_block))*2];
-          guint32 pixel_col_word  = arranged_data[(x+(y*width_block))*2 + 1];
-          gboolean block_alpha_mode = pixel_col_word&1;
-          /* now work out what every pixel in this block should be... */
-          for (by=0;by<4;by++)
-            for (bx=0;bx<4;bx++)
-              {
-                Color tmpa, tmpb, cl, ch, col;
-                gint boffs = offs + ((bx+2)>>2) + (((by+2)>>2) * block_stride);
-                gint pixel_bits;
-                gint amtx, amty;
-
-                amtx = ((bx+2)&3) * 64;
-                amty = ((by+2)&3) * 64;
-                pixel_bits = pixel_bits_word&3;
-                pixel_bits_word = pixel_bits_word >> 2;
-
-                color_interp(&tmpa, &col_low[boffs],
-                                &col_low[boffs+1], amtx);
-                color_interp(&tmpb, &col_low[boffs+block_stride],
-                                &col_low[boffs+block_stride+1], amtx);
-                color_interp(&cl, &tmpa, &tmpb, amty);
-
-                color_interp(&tmpa, &col_high[boffs],
-                                &col_high[boffs+1], amtx);
-                color_interp(&tmpb, &col_high[boffs+block_stride],
-                                &col_high[boffs+block_stride+1], amtx);
-                color_interp(&ch, &tmpa, &tmpb, amty);
-
-                if (block_alpha_mode)
-                  {
-                    if (pixel_bits==0)
-                      col = cl;
-                    else if (pixel_bits==1)
-                      color_interp(&col, &cl, &ch, 128);
-                    else if (pixel_bits==2) {
-                      color_interp(&col, &cl, &ch, 128);
-                      col.alpha = 0;
-                    } else col = ch;
-                  }
-                else
-                  {
-                    if (pixel_bits==0)
-                      col = cl;
-                    else if (pixel_bits==1)
-                      color_interp(&col, &cl, &ch, 96);
-                    else if (pixel_bits==2) {
-                      color_interp(&col, &cl, &ch, 160);
-                    } else col = ch;
-                  }
-              uncompressed_data[(x*4) + (y*width*4) + bx + (by*width)]
-                = col;
-            }
+          g_free (encoder->col_low);
+          g_free (encoder->col_high);
+          encoder->col_low = g_new (Color, n_colours);
+          encoder->col_high = g_new (Color, n_colours);
+          encoder->n_colours = n_colours;
+        }
+      job.col_low = encoder->col_low;
+      job.col_high = encoder->col_high;
+      job.out_data = (guint32 *) (out + offset);
+
+      /* the image itself is read in place, the mipmaps from our copies */
+      if (n_levels == 0)
+        {
+          job.src = pixels;
+          job.src_rowstride = rowstride;
+          job.src_channels = n_channels;
+          job.src_width = width;
+          job.src_height = height;
+          job.pad_x = pad_wrap ? (top_width + width) / 2 : top_width;
+          job.pad_y = pad_wrap ? (top_height + height) / 2 : top_height;
+        }
+      else
+        job.uncompressed_data = encoder->mipmaps[n_levels & 1];
+
+      compress_run (&job, options, &encoder->runner);
+      offset += pvr_texture_level_size (format, level_width, level_height,
+                                        NULL, NULL);
+      n_levels++;
+
+      if (!options->mipmaps)
+        break;
+
+      {
+        gint above_width = level_width, above_height = level_height;
+        gsize mipmap_size;
+
+        if (!next_mipmap_size (format, &level_width, &level_height))
+          break;
+
+        /* the first mipmap is the biggest */
+        mipmap_size = level_width * level_height * 4;
+        if (mipmap_size > encoder->mipmap_size)
+          {
+            g_free (encoder->mipmaps[0]);
+            g_free (encoder->mipmaps[1]);
+            encoder->mipmaps[0] = g_malloc (mipmap_size);
+            encoder->mipmaps[1] = g_malloc (mipmap_size);
+            encoder->mipmap_size = mipmap_size;
+          }
+
+        if (n_levels == 1)
+          encoder_downsample (pixels, rowstride, n_channels, width, height,
+                              job.pad_x, job.pad_y,
+                              above_width, above_height,
+                              encoder->mipmaps[1], level_width, level_height);
+        else
+          encoder_downsample (encoder->mipmaps[(n_levels - 1) & 1],
+                              above_width * 4, 4, above_width, above_height,
+                              above_width, above_height,
+                              above_width, above_height,
+                              encoder->mipmaps[n_levels & 1],
+                              level_width, level_height);
       }
+    }
 
-  g_free(col_low);
-  g_free(col_high);
-  g_free(arranged_data);
-  return (guchar*)uncompressed_data;
+  pvr_header_init (&head, format, top_width, top_height, n_levels - 1,
+                   offset - sizeof(head));
+  memcpy (out, &head, sizeof(head));
+
+  return TRUE;
 }
@@ -24,7 +24,8 @@
 
 #ifndef PVRTEXTURE_H_
 #define PVRTEXTURE_H_
-/* handles compression + decompression of PVRTC4 texture files */
+/* handles compression + decompression of PVRTC4, PVRTC2 and ETC1
+ * texture files */
 
 #include <glib.h>
 
@@ -49,9 +50,111 @@ typedef struct PVR_TEXTURE_HEADER_TAG {
 #define MGLPT_PVRTC2 (0x18)
 #define MGLPT_PVRTC4 (0x19)
 #define ETC_RGB_4BPP (0x36)
+/* The same PVRTC formats, as some other tools label them */
+#define OGL_PVRTC2   (0x0C)
+#define OGL_PVRTC4   (0x0D)
+#define PVR_FLAG_FORMAT_MASK (0x000000ff)
 #define PVR_FLAG_TWIDDLED (0x00000200)
 #define PVR_FLAG_ALPHA    (0x00008000)
 
+/* Compressed formats the codec can produce */
+typedef enum {
+    PVR_FORMAT_PVRTC4, /* 4 bits per pixel, in blocks of 4x4 */
+    PVR_FORMAT_PVRTC2, /* 2 bits per pixel, in blocks of 8x4 */
+    PVR_FORMAT_ETC1    /* 4 bits per pixel, opaque, any multiple of 4 */
+} PvrFormat;
+
+/* Layouts pvr_texture_decompress_pvrtc4_rect can write pixels in */
+typedef enum {
+    PVR_PIXEL_RGBA8888,      /* 4 bytes: red, green, blue, alpha */
+    PVR_PIXEL_ARGB32_PREMUL, /* a native-endian 32 bit word with alpha at
+                              * the top and colours premultiplied by it,
+                              * as cairo's CAIRO_FORMAT_ARGB32 */
+    PVR_PIXEL_RGB565         /* a native-endian 16 bit word, alpha dropped */
+} PvrPixelFormat;
+
+/* How hard the ETC1 compressor looks for base colours */
+typedef enum {
+    PVR_ETC1_FAST,     /* just the average colour of each half block */
+    PVR_ETC1_QUALITY   /* the average, and its neighbours in each channel */
+} PvrEtc1Mode;
+
+/* How the compressor spreads the error of each pixel onto the next */
+typedef enum {
+    PVR_DITHER_NONE,   /* no dithering, every block is independent */
+    PVR_DITHER_ROW,    /* error diffusion restarted on each row of blocks */
+    PVR_DITHER_PIXEL,  /* error diffusion across the whole image (serial) */
+    PVR_DITHER_ORDERED /* a Bayer matrix scaled to each block's colours, so
+                        * no state passes between blocks */
+} PvrDither;
+
+/* How long the PVRTC compressor spends looking for a good result */
+typedef enum {
+    PVR_QUALITY_NORMAL, /* the block colours from each block's range */
+    PVR_QUALITY_FAST,   /* no dithering, and without vector kernels each
+                         * pixel's modulation is rounded from where it
+                         * lies between the block colours rather than
+                         * searched for */
+    PVR_QUALITY_HIGH    /* block colours then refined by trying nearby
+                         * colours against the decoded result; not done
+                         * by the stream encoder, which can't look back */
+} PvrQuality;
+
+/* Which vector unit the codec kernels may use */
+typedef enum {
+    PVR_SIMD_AUTO,     /* the best one the CPU has */
+    PVR_SIMD_NONE,     /* the plain C reference code */
+    PVR_SIMD_SSE2,
+    PVR_SIMD_AVX2,
+    PVR_SIMD_NEON
+} PvrSimd;
+
+/* How soon a PvrTextureWriter gets textures onto the disk */
+typedef enum {
+    PVR_SYNC_IMMEDIATE, /* each texture is synced before it is put in place */
+    PVR_SYNC_DEFERRED,  /* textures are held back until pvr_texture_writer_sync
+                         * (or until enough are waiting), then synced
+                         * together and put in place */
+    PVR_SYNC_NONE,      /* textures are put in place without syncing, so
+                         * after a crash they may be empty */
+    PVR_SYNC_TOGETHER   /* as PVR_SYNC_DEFERRED, but however many are
+                         * waiting none is put in place before
+                         * pvr_texture_writer_sync, so they all go in at
+                         * once or not at all */
+} PvrSyncPolicy;
+
+/* Puts texture files in place whole, never half written */
+typedef struct _PvrTextureWriter PvrTextureWriter;
+
+/* Told that the file for @filename is in place, or with @error why it
+ * isn't */
+typedef void (*PvrTextureWriterFunc) (const gchar  *filename,
+                                      const GError *error,
+                                      gpointer      data);
+
+/* Told what fraction of the texture has been compressed. Returning FALSE
+ * stops the compression */
+typedef gboolean (*PvrProgressFunc) (gdouble fraction, gpointer data);
+
+/* Settings for pvr_texture_compress_pvrtc4_full and
+ * pvr_texture_decompress_pvrtc4_full */
+typedef struct {
+    PvrDither dither;     /* dithering mode */
+    guint     n_threads;  /* worker threads, or 0 for one per CPU */
+    PvrSimd   simd;       /* kernels to use, falls back to C if unavailable */
+    gboolean  mipmaps;    /* stream encoder only: also write mipmaps */
+    PvrEtc1Mode etc1_mode; /* ETC1 only */
+    PvrQuality quality;   /* PVRTC only */
+    PvrProgressFunc progress; /* stream encoder only: called from the
+                               * encoding thread after each band of blocks */
+    gpointer  progress_data;
+    PvrTextureWriter *writer; /* stream encoder only: puts the texture in
+                               * place, or NULL to sync it there itself */
+} PvrTextureOptions;
+
+/* What pvr_texture_measure_psnr gives for identical images */
+#define PVR_PSNR_MAX (100.0)
+
 gboolean pvr_texture_save_pvrtc4(
                         const gchar *filename,
                         const guchar *data,
@@ -64,15 +167,225 @@ guchar *pvr_texture_compress_pvrtc4(
                 gint height,
                 guint *compressed_size);
 
+void pvr_texture_options_init(PvrTextureOptions *options);
+
+guint pvr_texture_get_n_threads(void);
+
+guchar *pvr_texture_compress_pvrtc4_full(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options,
+                guint *compressed_size);
+
+guchar *pvr_texture_compress_pvrtc2(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint *compressed_size);
+
+guchar *pvr_texture_compress_pvrtc2_full(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options,
+                guint *compressed_size);
+
 guchar *pvr_texture_decompress_pvrtc4(
                 const guchar *compressed_data,
                 gint width,
                 gint height);
 
+guchar *pvr_texture_decompress_pvrtc4_full(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options);
+
+guchar *pvr_texture_decompress_pvrtc2(
+                const guchar *compressed_data,
+                gint width,
+                gint height);
+
+guchar *pvr_texture_decompress_pvrtc2_full(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options);
+
+guchar *pvr_texture_compress_etc1(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                guint *compressed_size);
+
+guchar *pvr_texture_compress_etc1_full(
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options,
+                guint *compressed_size);
+
+gboolean pvr_texture_update_pvrtc4(
+                guchar *compressed_data,
+                const guchar *uncompressed_data,
+                gint width,
+                gint height,
+                gint x,
+                gint y,
+                gint rect_width,
+                gint rect_height,
+                const PvrTextureOptions *options);
+
+guchar *pvr_texture_decompress_etc1(
+                const guchar *compressed_data,
+                gint width,
+                gint height);
+
+guchar *pvr_texture_decompress_etc1_full(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options);
+
+gboolean pvr_texture_decompress_into(
+                PvrFormat format,
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options,
+                guchar *dest,
+                guint rowstride);
+
+gboolean pvr_texture_decompress_pvrtc4_rect(
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                const PvrTextureOptions *options,
+                gint x,
+                gint y,
+                gint rect_width,
+                gint rect_height,
+                PvrPixelFormat dest_format,
+                guchar *dest,
+                guint rowstride);
+
+gdouble pvr_texture_measure_psnr(
+                PvrFormat format,
+                const guchar *uncompressed_data,
+                const guchar *compressed_data,
+                gint width,
+                gint height,
+                gdouble *channel_psnr);
+
+gsize pvr_texture_level_size(
+                PvrFormat format,
+                gint width,
+                gint height,
+                gint *data_width,
+                gint *data_height);
+
+/* Compresses an image to a file a few rows at a time */
+typedef struct _PvrStreamEncoder PvrStreamEncoder;
+
+PvrStreamEncoder *pvr_texture_stream_encoder_new(
+                const gchar *filename,
+                PvrFormat format,
+                gint width,
+                gint height,
+                guint n_channels,
+                const PvrTextureOptions *options,
+                GError **error);
+
+gboolean pvr_texture_stream_encoder_write_rows(
+                PvrStreamEncoder *encoder,
+                const guchar *rows,
+                guint rowstride,
+                guint n_rows,
+                GError **error);
+
+gboolean pvr_texture_stream_encoder_finish(
+                PvrStreamEncoder *encoder,
+                GError **error);
+
+void pvr_texture_stream_encoder_abort(
+                PvrStreamEncoder *encoder);
+
+/* Compresses one image after another, reusing its threads and buffers */
+typedef struct _PvrTextureEncoder PvrTextureEncoder;
+
+PvrTextureEncoder *pvr_texture_encoder_new(
+                const PvrTextureOptions *options);
+
+void pvr_texture_encoder_free(
+                PvrTextureEncoder *encoder);
+
+gsize pvr_texture_encoder_get_size(
+                PvrTextureEncoder *encoder,
+                PvrFormat format,
+                gint width,
+                gint height);
+
+gboolean pvr_texture_encoder_compress(
+                PvrTextureEncoder *encoder,
+                PvrFormat format,
+                const guchar *pixels,
+                gint width,
+                gint height,
+                guint rowstride,
+                guint n_channels,
+                guchar *out);
+
+PvrTextureWriter *pvr_texture_writer_new(
+                PvrSyncPolicy policy);
+
+void pvr_texture_writer_set_func(
+                PvrTextureWriter *writer,
+                PvrTextureWriterFunc func,
+                gpointer data);
+
+gboolean pvr_texture_writer_save(
+                PvrTextureWriter *writer,
+                const gchar *filename,
+                PvrFormat format,
+                const guchar *data,
+                guint data_size,
+                gint width,
+                gint height,
+                GError **error);
+
+gboolean pvr_texture_writer_sync(
+                PvrTextureWriter *writer,
+                GError **error);
+
+gint pvr_texture_writer_begin(
+                PvrTextureWriter *writer,
+                const gchar *filename,
+                GError **error);
+
+gboolean pvr_texture_writer_commit(
+                PvrTextureWriter *writer,
+                gint fd,
+                GError **error);
+
+void pvr_texture_writer_abort(
+                PvrTextureWriter *writer,
+                gint fd);
+
+void pvr_texture_writer_free(
+                PvrTextureWriter *writer);
+
 gboolean pvr_texture_save_pvrtc4_atomically (const gchar   *filename,
                                              const guchar  *data,
                                              guint          data_size,
                                              gint           width,
                                              gint           height,
                                              GError       **error);
+
+gboolean pvr_texture_save_etc1_atomically (const gchar   *filename,
+                                           const guchar  *data,
+                                           guint          data_size,
+                                           gint           width,
+                                           gint           height,
+                                           GError       **error);
 #endif /*PVRTEXTURE_H_*/
@@ -0,0 +1,335 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* A gdk-pixbuf loader for PVR textures, so that anything which shows
+ * images can show them:
+ *
+ *   pixbuf = gdk_pixbuf_new_from_file_at_size ("background.pvr",
+ *                                              200, 120, &error);
+ *
+ * The header is checked as soon as it arrives, and for a texture with
+ * mipmaps the pixbuf is made from the smallest level still as big as the
+ * size asked for, so it is never decoded at full size just to be scaled
+ * down. ETC1 blocks are stored in rows, so ETC1 is decoded a band of
+ * blocks at a time as the data comes in; PVRTC blocks are twiddled over
+ * the whole level, so PVRTC is decoded once its level is complete.
+ * Levels keep the padding they were saved with. Decoding stays on the
+ * calling thread, as the loader runs inside whatever program is showing
+ * the image.
+ */
+
+#define GDK_PIXBUF_ENABLE_BACKEND
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <gdk-pixbuf/gdk-pixbuf-io.h>
+
+#include "hd-pvr-texture-private.h"
+#include "pvr-texture.h"
+
+/* what gdk-pixbuf looks for in a module */
+G_MODULE_EXPORT void fill_vtable (GdkPixbufModule *module);
+G_MODULE_EXPORT void fill_info   (GdkPixbufFormat *info);
+
+typedef struct
+{
+  GdkPixbufModuleSizeFunc      size_func;
+  GdkPixbufModulePreparedFunc  prepared_func;
+  GdkPixbufModuleUpdatedFunc   updated_func;
+  gpointer                     user_data;
+
+  /* the header is gathered here until it is all in, and then the whole
+   * file is, once we know how big that is */
+  PVR_TEXTURE_HEADER  head;
+  guchar             *data;
+  gsize               size;
+  gsize               received;
+
+  HDPvrTexture       *texture;
+  /* the level the pixbuf is decoded from, and where it is in the file */
+  guint               level;
+  gsize               level_start;
+  gsize               level_end;
+  GdkPixbuf          *pixbuf;
+  /* whether the level is decoded a band of blocks at a time, and how
+   * many rows are done */
+  gboolean            by_rows;
+  guint               rows_done;
+  gboolean            decoded;
+} PvrContext;
+
+static gpointer
+pvr_begin_load (GdkPixbufModuleSizeFunc      size_func,
+                GdkPixbufModulePreparedFunc  prepared_func,
+                GdkPixbufModuleUpdatedFunc   updated_func,
+                gpointer                     user_data,
+                GError                     **error)
+{
+  PvrContext *context;
+
+  context = g_new0 (PvrContext, 1);
+  context->size_func = size_func;
+  context->prepared_func = prepared_func;
+  context->updated_func = updated_func;
+  context->user_data = user_data;
+
+  return context;
+}
+
+/* Checks the header, picks the level to decode and makes the pixbuf for
+ * it */
+static gboolean
+pvr_context_start (PvrContext  *context,
+                   GError     **error)
+{
+  const guchar *level;
+  guint level_width, level_height, n_levels, width, height;
+  gint wanted_width, wanted_height;
+  gsize level_size;
+
+  /* see that the header makes sense before making room for the data it
+   * says there is */
+  if (!hd_pvr_texture_check_header (&context->head, "The image",
+                                    &context->size, error))
+    return FALSE;
+
+  context->data = g_try_malloc (context->size);
+  if (!context->data)
+    {
+      g_set_error (error, GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                   "Not enough memory to load PVR texture");
+      return FALSE;
+    }
+  memcpy (context->data, &context->head, sizeof (PVR_TEXTURE_HEADER));
+
+  context->texture = hd_pvr_texture_new_for_data (context->data,
+                                                  context->size,
+                                                  "The image", error);
+  if (!context->texture)
+    return FALSE;
+
+  hd_pvr_texture_get_level (context->texture, 0, &width, &height, NULL);
+  wanted_width = width;
+  wanted_height = height;
+  if (context->size_func)
+    {
+      context->size_func (&wanted_width, &wanted_height, context->user_data);
+      if (wanted_width <= 0 || wanted_height <= 0)
+        {
+          g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                       "Transformed PVR texture has zero width or height");
+          return FALSE;
+        }
+    }
+
+  /* the smallest level that is still as big as the size asked for */
+  n_levels = hd_pvr_texture_get_n_levels (context->texture);
+  for (context->level = 0; context->level + 1 < n_levels; context->level++)
+    {
+      hd_pvr_texture_get_level (context->texture, context->level + 1,
+                                &width, &height, NULL);
+      if ((gint) width < wanted_width || (gint) height < wanted_height)
+        break;
+    }
+
+  level = hd_pvr_texture_get_level (context->texture, context->level,
+                                    &level_width, &level_height,
+                                    &level_size);
+  context->level_start = level - context->data;
+  context->level_end = context->level_start + level_size;
+  context->by_rows = hd_pvr_texture_get_format (context->texture) ==
+                      HD_PVR_TEXTURE_FORMAT_ETC1 &&
+                      level_width % 4 == 0 && level_height % 4 == 0;
+
+  context->pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8,
+                                    level_width, level_height);
+  if (!context->pixbuf)
+    {
+      g_set_error (error, GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                   "Not enough memory to load PVR texture");
+      return FALSE;
+    }
+  gdk_pixbuf_fill (context->pixbuf, 0);
+
+  if (context->prepared_func)
+    context->prepared_func (context->pixbuf, NULL, context->user_data);
+
+  return TRUE;
+}
+
+/* Decodes whatever of the level has arrived and can be decoded */
+static gboolean
+pvr_context_decode (PvrContext  *context,
+                    GError     **error)
+{
+  guchar *pixels = gdk_pixbuf_get_pixels (context->pixbuf);
+  guint rowstride = gdk_pixbuf_get_rowstride (context->pixbuf);
+  guint width = gdk_pixbuf_get_width (context->pixbuf);
+  guint height = gdk_pixbuf_get_height (context->pixbuf);
+  guint y;
+
+  if (context->decoded || context->received <= context->level_start)
+    return TRUE;
+
+  if (context->by_rows)
+    {
+      PvrTextureOptions options;
+      gsize row_bytes = width / 4 * 8;
+      guint rows;
+
+      rows = MIN ((context->received - context->level_start) / row_bytes * 4,
+                  height);
+      if (rows == context->rows_done)
+        return TRUE;
+
+      pvr_texture_options_init (&options);
+      options.n_threads = 1;
+      y = context->rows_done;
+      if (!pvr_texture_decompress_into (PVR_FORMAT_ETC1,
+                                        context->data + context->level_start +
+                                        y / 4 * row_bytes,
+                                        width, rows - y, &options,
+                                        pixels + y * rowstride, rowstride))
+        {
+          g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                       "Could not decode PVR texture");
+          return FALSE;
+        }
+      context->rows_done = rows;
+      context->decoded = rows == height;
+    }
+  else
+    {
+      if (context->received < context->level_end)
+        return TRUE;
+
+      if (!hd_pvr_texture_decode_with_threads (context->texture,
+                                               context->level, pixels,
+                                               rowstride, 1, error))
+        return FALSE;
+      y = 0;
+      context->rows_done = height;
+      context->decoded = TRUE;
+    }
+
+  if (context->updated_func)
+    context->updated_func (context->pixbuf, 0, y, width,
+                           context->rows_done - y, context->user_data);
+
+  return TRUE;
+}
+
+static gboolean
+pvr_load_increment (gpointer       data,
+                    const guchar  *buf,
+                    guint          size,
+                    GError       **error)
+{
+  PvrContext *context = data;
+  gsize n;
+
+  if (!context->data)
+    {
+      n = MIN (size, sizeof (PVR_TEXTURE_HEADER) - context->received);
+      memcpy ((guchar *) &context->head + context->received, buf, n);
+      context->received += n;
+      buf += n;
+      size -= n;
+
+      if (context->received < sizeof (PVR_TEXTURE_HEADER))
+        return TRUE;
+      if (!pvr_context_start (context, error))
+        return FALSE;
+    }
+
+  /* anything after the texture data is ignored */
+  n = MIN (size, context->size - context->received);
+  memcpy (context->data + context->received, buf, n);
+  context->received += n;
+
+  return pvr_context_decode (context, error);
+}
+
+static gboolean
+pvr_stop_load (gpointer   data,
+               GError   **error)
+{
+  PvrContext *context = data;
+  gboolean ret = TRUE;
+
+  if (!context->decoded)
+    {
+      g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                   "Premature end of PVR texture");
+      ret = FALSE;
+    }
+
+  if (context->pixbuf)
+    g_object_unref (context->pixbuf);
+  hd_pvr_texture_free (context->texture);
+  g_free (context->data);
+  g_free (context);
+
+  return ret;
+}
+
+void
+fill_vtable (GdkPixbufModule *module)
+{
+  module->begin_load = pvr_begin_load;
+  module->stop_load = pvr_stop_load;
+  module->load_increment = pvr_load_increment;
+}
+
+void
+fill_info (GdkPixbufFormat *info)
+{
+  /* a 52 byte header, with "PVR!" at the end of it */
+  static GdkPixbufModulePattern signature[] =
+  {
+    { "4   xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxPVR!",
+      " zzzxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx    ", 100 },
+    { NULL, NULL, 0 }
+  };
+  static gchar *mime_types[] =
+  {
+    "image/x-pvr",
+    NULL
+  };
+  static gchar *extensions[] =
+  {
+    "pvr",
+    NULL
+  };
+
+  info->name = "pvr";
+  info->signature = signature;
+  info->description = "PowerVR texture";
+  info->mime_types = mime_types;
+  info->extensions = extensions;
+  info->flags = GDK_PIXBUF_FORMAT_THREADSAFE;
+  info->license = "LGPL";
+}
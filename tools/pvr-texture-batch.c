@@ -0,0 +1,214 @@
+/*
+ * This file is part of libhildondesktop
+ *
+ * Copyright (C) 2008 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Compresses images to PVR textures in bulk, for building theme and
+ * background packages:
+ *
+ *   pvr-texture-batch [OPTION...] [IMAGE|DIRECTORY...]
+ *
+ * Images given on the command line, listed in a manifest or found under
+ * a directory are compressed by a pool of worker threads, skipping those
+ * whose textures are already up to date. */
+
+#include <glib.h>
+#include <libhildondesktop/hd-pvr-texture.h>
+#include <stdlib.h>
+#include <string.h>
+
+static gchar    *manifest   = NULL;
+static gchar    *output_dir = NULL;
+static gchar    *format     = NULL;
+static gint      n_jobs     = 0;
+static gboolean  mipmaps    = FALSE;
+static gboolean  fast       = FALSE;
+static gboolean  force      = FALSE;
+static gboolean  quiet      = FALSE;
+
+static GOptionEntry entries[] =
+{
+  { "manifest", 'm', 0, G_OPTION_ARG_FILENAME, &manifest,
+    "Compress the images listed in FILE, one per line, each optionally "
+    "followed by a tab and its texture", "FILE" },
+  { "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+    "Put the textures of images and directories given on the command "
+    "line in DIR", "DIR" },
+  { "format", 'f', 0, G_OPTION_ARG_STRING, &format,
+    "auto, pvrtc4, pvrtc2 or etc1 (default: auto)", "FORMAT" },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &n_jobs,
+    "Compress N images at once (default: one per CPU)", "N" },
+  { "mipmaps", 0, 0, G_OPTION_ARG_NONE, &mipmaps,
+    "Also store mipmaps", NULL },
+  { "fast", 0, 0, G_OPTION_ARG_NONE, &fast,
+    "Compress quickly, at some cost in quality", NULL },
+  { "force", 0, 0, G_OPTION_ARG_NONE, &force,
+    "Compress images even if their textures are up to date", NULL },
+  { "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+    "Don't print statistics", NULL },
+  { NULL }
+};
+
+static gboolean
+parse_format (const gchar        *name,
+              HDPvrTextureFormat *texture_format)
+{
+  static const struct
+  {
+    const gchar        *name;
+    HDPvrTextureFormat  format;
+  } formats[] =
+  {
+    { "auto",   HD_PVR_TEXTURE_FORMAT_AUTO },
+    { "pvrtc4", HD_PVR_TEXTURE_FORMAT_PVRTC4 },
+    { "pvrtc2", HD_PVR_TEXTURE_FORMAT_PVRTC2 },
+    { "etc1",   HD_PVR_TEXTURE_FORMAT_ETC1 }
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++)
+    if (!g_ascii_strcasecmp (name, formats[i].name))
+      {
+        *texture_format = formats[i].format;
+        return TRUE;
+      }
+
+  return FALSE;
+}
+
+static void
+report_error (const gchar  *input,
+              const gchar  *output,
+              const GError *error,
+              gpointer      user_data)
+{
+  g_printerr ("%s: %s\n", input, error->message);
+}
+
+int
+main (int argc, char *argv[])
+{
+  HDPvrTextureFormat texture_format = HD_PVR_TEXTURE_FORMAT_AUTO;
+  HDPvrTextureSaveFlags flags = HD_PVR_TEXTURE_SAVE_DEFAULT;
+  HDPvrTextureBatchStats stats;
+  HDPvrTextureBatch *batch;
+  GOptionContext *context;
+  GError *error = NULL;
+  gboolean ret;
+  gint i;
+
+  g_thread_init (NULL);
+  g_type_init ();
+
+  context = g_option_context_new ("[IMAGE|DIRECTORY...] - "
+                                  "compress images to PVR textures");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (context);
+
+  if (format && !parse_format (format, &texture_format))
+    {
+      g_printerr ("Unknown format %s\n", format);
+      return EXIT_FAILURE;
+    }
+  if (mipmaps)
+    flags |= HD_PVR_TEXTURE_SAVE_MIPMAPS;
+  if (fast)
+    flags |= HD_PVR_TEXTURE_SAVE_FAST;
+
+  if (argc < 2 && !manifest)
+    {
+      g_printerr ("Nothing to compress. See %s --help\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  batch = hd_pvr_texture_batch_new (texture_format, flags, MAX (n_jobs, 0));
+
+  if (manifest && !hd_pvr_texture_batch_add_manifest (batch, manifest,
+                                                      &error))
+    {
+      g_printerr ("Couldn't read %s: %s\n", manifest, error->message);
+      g_error_free (error);
+      hd_pvr_texture_batch_free (batch);
+      return EXIT_FAILURE;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      if (g_file_test (argv[i], G_FILE_TEST_IS_DIR))
+        {
+          if (!hd_pvr_texture_batch_add_dir (batch, argv[i], output_dir,
+                                             &error))
+            {
+              g_printerr ("Couldn't read %s: %s\n", argv[i], error->message);
+              g_error_free (error);
+              hd_pvr_texture_batch_free (batch);
+              return EXIT_FAILURE;
+            }
+        }
+      else if (output_dir)
+        {
+          gchar *base = g_path_get_basename (argv[i]);
+          gchar *dot = strrchr (base, '.');
+          gchar *output;
+
+          if (dot && dot != base)
+            *dot = '\0';
+          output = g_strconcat (output_dir, G_DIR_SEPARATOR_S,
+                                base, ".pvr", NULL);
+          hd_pvr_texture_batch_add (batch, argv[i], output);
+          g_free (output);
+          g_free (base);
+        }
+      else
+        hd_pvr_texture_batch_add (batch, argv[i], NULL);
+    }
+
+  ret = hd_pvr_texture_batch_run (batch, force, report_error, NULL,
+                                  &stats, &error);
+  hd_pvr_texture_batch_free (batch);
+
+  if (!ret)
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+    }
+
+  if (!quiet)
+    {
+      gdouble seconds = MAX (stats.seconds, 1e-6);
+
+      g_print ("%u compressed, %u up to date, %u failed in %.2f s\n",
+               stats.n_compressed, stats.n_skipped, stats.n_failed,
+               stats.seconds);
+      g_print ("%.1f textures/s, %.2f Mpixels/s, %.2f MB written "
+               "with %u syncs\n",
+               stats.n_compressed / seconds,
+               stats.pixels / seconds / 1e6,
+               stats.bytes_written / 1e6,
+               stats.n_syncs);
+    }
+
+  return ret && !stats.n_failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}